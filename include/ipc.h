@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* The maximum identifier length of an IPC service */
 #define IPC_SERVICE_NAME_MAX 255
@@ -32,10 +33,22 @@
 /** The maximum size of an IPC message */
 #define IPC_MESSAGE_SIZE_MAX 16384
 
+/** The size of each buffer in the shared memory pool of a session */
+#define IPC_BUFFER_SIZE (1024 * 1024)
+
+/** The size of the reference to a buffer that goes over the wire */
+#define IPC_BUFFER_REF_SIZE (3 * sizeof(uint32_t))
+
+/** The most that the files returned by a call may hold, in total */
+#define IPC_FILE_SIZE_MAX (64 * 1024 * 1024)
+
+/** The libipc error code for the errno value e, as IPC_CAPTURE_ERRNO gives it */
+#define IPC_ERRNO(e) (-(e) - 1000)
+
 /** Capture the value of errno in a way that does not overlap with libipc
  * error codes.
  */
-#define IPC_CAPTURE_ERRNO (-errno - 1000)
+#define IPC_CAPTURE_ERRNO IPC_ERRNO(errno)
 
 enum {
 	IPC_ERROR_NAME_TOO_LONG = 1, /* The name of a service is too long to fit in a buffer */
@@ -45,30 +58,76 @@ enum {
 	IPC_ERROR_METHOD_NOT_FOUND = 5,
 	IPC_ERROR_CONNECTION_FAILED = 6, /* Client unable to connect to server socket */
 	IPC_ERROR_MESSAGE_INVALID = 7, /* An invalid message was detected */
+	IPC_ERROR_BUSY = 8, /* The server is too busy to accept the call */
+	IPC_ERROR_LIMIT_EXCEEDED = 9, /* The method is already running as many times as it may */
+	IPC_ERROR_RATE_LIMITED = 10, /* The user has sent more requests than the server allows */
+	IPC_ERROR_UNAVAILABLE = 11, /* Recent calls to the service failed, so this one was not sent */
+	IPC_ERROR_TIMED_OUT = 12, /* The call did not complete before its deadline */
+	IPC_ERROR_SPOOL_FULL = 13, /* There is no room in the spool for another one-way call */
 };
 
-enum {
+enum IPC_DOMAIN_TYPES {
 	IPC_DOMAIN_SYSTEM = 1, /* Allows communication with the entire OS */
 	IPC_DOMAIN_USER = 2,   /* Allows communication for programs belonging to the current user */
-} IPC_DOMAIN_TYPES;
+};
 
 /** An IPC message, either a request or a response */
 struct ipc_message {
 	/* TODO: uint8_t     _ipc_version; */ /** The ABI version of the message */
 	uint32_t    _ipc_bufsz;    /** The total size of the message data buffer */
 	uint32_t    _ipc_method;   /** The unique ID of the method */
+	uint32_t    _ipc_id;       /** Chosen by the client; a response has the same ID as its request */
 	uint32_t    _ipc_argc;     /** The number of arguments in the message */
+	int32_t     _ipc_status;   /** In a response, the return value of the method */
 	uint32_t    _ipc_argsz[IPC_ARGUMENT_MAX]; /** Size of each argument within the buffer */
 };
 
+/** The ID of a request to a one-way method, which the server does not answer */
+#define IPC_ID_ONEWAY UINT32_MAX
+
+/** Flags for limits on concurrent calls to a method */
+enum {
+	IPC_LIMIT_REJECT = 0, /* Calls over the limit fail with IPC_ERROR_LIMIT_EXCEEDED */
+	IPC_LIMIT_QUEUE = 1,  /* Calls over the limit wait for a call in progress to finish */
+};
+
+/** A limit on concurrent calls to a method. Skeletons export a table of
+ * these, ending with an entry where max is 0. */
+struct ipc_method_limit {
+	uint32_t    method; /** The unique ID of the method */
+	int         max;    /** The most calls that may be in progress at once */
+	int         flags;  /** One of the IPC_LIMIT_* constants */
+};
+
+/** Flags for the retry policy of a method */
+enum {
+	IPC_POLICY_HEDGE = 1, /* Also send a call to another replica if it is slower than usual */
+	IPC_POLICY_ONEWAY = 2, /* Calls are not answered, and may be spooled while the server is down */
+};
+
+/** How a client retries calls to an idempotent method, or that a method is
+ * one-way. Stubs export a table of these, ending with an entry where retries
+ * and flags are 0. */
+struct ipc_method_policy {
+	uint32_t    method;  /** The unique ID of the method */
+	int         retries; /** The most times that a failed call is sent again */
+	int         flags;   /** IPC_POLICY_* flags */
+};
+
 struct ipc_server;
 struct ipc_client;
 struct ipc_session;
+struct ipc_response;
 
 /** A dummy return type to be used when returning a function pointer. See dlfunc(3) for the reason. */
 typedef void (*ipc_function_t)(struct ipc_message);
 
-/** An opaque object that encapsulates all server-side functions */
+/**
+ * An opaque object that encapsulates all server-side functions.
+ *
+ * Every connection uses a descriptor, and the library leaves RLIMIT_NOFILE
+ * alone, so a server with many clients must raise the limit itself.
+ */
 struct ipc_server * ipc_server();
 
 /** An opaque object that encapsulates all server-side functions */
@@ -79,9 +138,101 @@ int ipc_server_get_pollfd(struct ipc_server *);
 
 /** 
  Bind to a procedure name in the global namespace. Example: "myapp.my_procedure"
+
+ This may be called more than once to serve several services from the
+ same event loop.
  */
 int ipc_server_bind(struct ipc_server *server, int domain, const char *service);
 
+/**
+ * Bind to a service at a transport address, instead of a name in the
+ * statedir of a domain. The address is "unix:<path>", "abstract:<name>"
+ * for a socket in the abstract namespace on Linux, or "tcp:<host>:<port>",
+ * with IPv6 hosts in brackets and an empty host meaning every local
+ * address. A service whose interface definition has an address is bound
+ * there by ipc_server_bind().
+ */
+int ipc_server_bind_address(struct ipc_server *server, const char *address, const char *service);
+
+/**
+ * Bind to a service that forwards every call to another session, without
+ * a skeleton. Requests are passed along with only their ID changed, and the
+ * responses are relayed back the same way, so the proxy never unmarshals
+ * the arguments or results. The service is bound in the domain, or at the
+ * address if it is not NULL. The session must outlive the server.
+ *
+ * Calls are forwarded from the thread pool of blocking methods, so that
+ * the event loop does not wait for the upstream. The retry policies and
+ * circuit breaker of the session apply, and a call that cannot be
+ * forwarded fails with the error of the session.
+ */
+int ipc_server_bind_proxy(struct ipc_server *server, int domain, const char *service,
+		const char *address, struct ipc_session *upstream);
+
+/**
+ * Serve a service over a socket that is already connected, such as one end
+ * of a socketpair(2) shared with a child process. Nothing is bound, and the
+ * service need not be bound to the server otherwise. The connection is never
+ * closed for being idle, since the client cannot reconnect. The server owns
+ * the descriptor from then on, and closes it if this fails.
+ *
+ * This should be called before dispatching requests, or from the thread
+ * that dispatches them.
+ */
+int ipc_server_adopt_fd(struct ipc_server *server, const char *service, int fd);
+
+/**
+ * Limit the number of calls to a method of a bound service that may be in
+ * progress at once. A max of 0 removes the limit. This overrides any limit
+ * in the interface definition, and should be called before dispatching
+ * requests.
+ */
+int ipc_server_set_limit(struct ipc_server *server, const char *service,
+		uint32_t method, int max, int flags);
+
+/** Applies a rate limit to every user without one of their own */
+#define IPC_RATE_ANY_UID ((uid_t) -1)
+
+/**
+ * Limit the requests that clients running as a user may send, across all of
+ * their connections. Requests over the limit fail with IPC_ERROR_RATE_LIMITED
+ * without being unmarshalled. A rate of 0 means no limit, and up to one
+ * second's worth of requests may be sent in a burst.
+ *
+ * The limit applies to connections accepted after it is first set, and may
+ * be changed from any thread.
+ */
+int ipc_server_set_rate_limit(struct ipc_server *server, uid_t uid,
+		unsigned int requests_per_sec, unsigned int bytes_per_sec);
+
+/**
+ * Set the timeouts of a server, in milliseconds. Connections that send no
+ * request for idle_ms are closed, and TCP connections that are quiet for
+ * keepalive_ms are sent a keepalive. Calls that are deferred or waiting for
+ * a slot fail with IPC_ERROR_TIMED_OUT after deadline_ms. A timeout of 0
+ * turns it off. By default, only idle connections are closed, after five
+ * minutes.
+ *
+ * This should be called before dispatching requests, or from the thread
+ * that dispatches them.
+ */
+int ipc_server_set_timeouts(struct ipc_server *server, unsigned int idle_ms,
+		unsigned int keepalive_ms, unsigned int deadline_ms);
+
+/**
+ * Fork nworkers processes that accept connections for the services the
+ * server is bound to, each with an event loop of its own. This is called
+ * after binding, and before dispatching any requests.
+ *
+ * Returns 0 in each worker, which then dispatches requests as usual. The
+ * calling process becomes a supervisor that restarts workers that crash,
+ * and stops them when it receives SIGTERM or SIGINT. It returns 1 once every
+ * worker has exited, or a negative error code; either way, it should then
+ * free the server and exit. Limits, rate limits and timeouts apply to each
+ * worker on its own.
+ */
+int ipc_server_prefork(struct ipc_server *server, int nworkers);
+
 /**
  * Free resources associated with a server
  */
@@ -90,9 +241,98 @@ void ipc_server_free(struct ipc_server *server);
 /** Dispatch an incoming IPC request. */
 int ipc_server_dispatch(struct ipc_server *server);
 
-/** Connect to an IPC service. Example: "com.example.myservice" */
+/** Connect to an IPC service. Example: "com.example.myservice"
+
+ If the service is bound by an ipc_server in the calling process, the session
+ calls the server's functions directly instead of using a socket. Otherwise,
+ if the service is listed in the directory file named by the IPC_DIRECTORY
+ environment variable, the session connects to one of the endpoints listed
+ there, chosen by weight. If its interface definition has an address, the
+ session connects there.
+
+ If client is NULL, a client shared by the whole process is used, so that
+ every call to the service goes over the same connection.
+ */
 struct ipc_session * ipc_client_connect(struct ipc_client *client, int domain, const char *service);
 
+/** Connect to a service at a transport address; see ipc_server_bind_address() */
+struct ipc_session * ipc_client_connect_address(struct ipc_client *client,
+		const char *address, const char *service);
+
+/**
+ * Make a session out of a socket that is already connected to a server,
+ * such as one inherited from a parent process; see ipc_server_adopt_fd().
+ * The session is cached by the client like any other, so ipc_client_connect()
+ * and generated stubs use it. It is not reopened if it fails. Returns NULL
+ * if the client already has a session to the service. On success, the
+ * session owns the descriptor.
+ */
+struct ipc_session * ipc_session_from_fd(struct ipc_client *client, int domain,
+		const char *service, int fd);
+
+/**
+ * Wait until a service can be connected to, for up to timeout_ms
+ * milliseconds, or for ever if timeout_ms is negative. Returns 0 once it
+ * can, or IPC_ERROR_TIMED_OUT. Sockets that appear in the statedir of the
+ * domain are noticed right away, and other addresses are tried every so
+ * often. A service in the directory is up once any of its endpoints is.
+ *
+ * The connection is kept by the client shared by the whole process, so the
+ * first call to the service does not need to open another.
+ */
+int ipc_client_wait_for_service(int domain, const char *service, int timeout_ms);
+
+/**
+ * Wait until the server at an address, given as for
+ * ipc_client_connect_address(), accepts connections, for up to timeout_ms
+ * milliseconds, or for ever if timeout_ms is negative. Returns 0 once it
+ * does, or IPC_ERROR_TIMED_OUT. The connection is not kept, so each of the
+ * endpoints of a service in the directory can be waited for in turn.
+ */
+int ipc_client_wait_for_address(const char *address, const char *service,
+		int timeout_ms);
+
+/**
+ * Send a request, and wait for the response. request[0] holds the header,
+ * and the rest hold the arguments. Any number of threads may make calls on
+ * a session at once; the requests are pipelined over a single connection,
+ * which is reopened after it fails. The body of the response is returned
+ * in a buffer that the caller must free. Used by generated stubs.
+ *
+ * Once half of the recent calls on a session have failed or taken over a
+ * second, further calls fail right away with IPC_ERROR_UNAVAILABLE. After a
+ * second, one call is let through, and if it succeeds, calls resume.
+ */
+int ipc_session_call(struct ipc_session *session, struct iovec *request, int iovcnt,
+		struct ipc_message *response, char **body);
+
+/**
+ * Send a request to a one-way method, without waiting for it to run. The
+ * server does not answer, so errors on its side go unreported. If the
+ * session has a spool, the request is added to it, and this never blocks on
+ * the server. Used by generated stubs.
+ */
+int ipc_session_send(struct ipc_session *session, struct iovec *request, int iovcnt);
+
+/**
+ * Keep one-way calls made on a session in a spool, a ring of up to size
+ * bytes in the file at path, and send them from a background thread in
+ * batches. Each call stays in the file until the server has answered it, so
+ * calls made while the service is down are sent once it is back, and calls
+ * left by a process that exited are sent by the next one to open the file.
+ * A call may therefore run more than once. Once the spool is full, calls
+ * fail with IPC_ERROR_SPOOL_FULL. Call this before making any one-way calls
+ * on the session.
+ */
+int ipc_session_spool(struct ipc_session *session, const char *path, size_t size);
+
+/**
+ * Wait until every call in the spool of a session has been answered, for up
+ * to timeout_ms milliseconds, or for ever if timeout_ms is negative. Returns
+ * 0 once the spool is empty, or IPC_ERROR_TIMED_OUT.
+ */
+int ipc_session_flush(struct ipc_session *session, int timeout_ms);
+
 /** Get a pointer to the stub function for a method */
 ipc_function_t ipc_session_stub(struct ipc_session *session, uint32_t method_id);
 
@@ -114,6 +354,112 @@ int ipc_message_validate(struct ipc_message *msg);
 /** Get the socket descriptor for a session */
 int ipc_session_fd(struct ipc_session *session);
 
+/**
+ * Send the response to the request being dispatched. Each iovec holds one
+ * result. Used by generated skeletons.
+ */
+int ipc_response_send(struct ipc_message *request, int status, const struct iovec *results, int nresults);
+
+/**
+ * Send a response whose results include files. The bits of the files mask
+ * say which results point to a struct ipc_file instead of holding data. The
+ * contents of each file are sent straight from the page cache where the
+ * system allows, and the descriptors are closed. Used by generated skeletons.
+ */
+int ipc_response_send_files(struct ipc_message *request, int status,
+		const struct iovec *results, int nresults, uint32_t files);
+
+/**
+ * Get a token for completing the request being dispatched at a later time,
+ * possibly from another thread. Used by generated skeletons for asynchronous
+ * methods.
+ */
+struct ipc_response * ipc_response_token(struct ipc_message *request);
+
+/**
+ * Complete a call, and release the token. Asynchronous methods normally use
+ * the typed <method>_complete() wrappers in the generated skeleton header.
+ */
+int ipc_response_complete(struct ipc_response *token, int status, const struct iovec *results, int nresults);
+
+/** Complete a call with results that include files; see ipc_response_send_files() */
+int ipc_response_complete_files(struct ipc_response *token, int status,
+		const struct iovec *results, int nresults, uint32_t files);
+
+/**
+ * Run a blocking method on libipc's thread pool, so it does not hold up the
+ * event loop. The request is copied, and the function is called with a token
+ * that it must complete. Used by generated skeletons.
+ */
+int ipc_response_offload(struct ipc_message *request, char *body,
+		void (*func)(struct ipc_response *, struct ipc_message *, char *));
+
+/** Get a token for a call to an asynchronous method from within this process */
+struct ipc_response * ipc_response_local(void);
+
+/**
+ * Wait for a call from within this process to complete, and release the token.
+ * The results are returned in a malloc'd buffer that the caller must free.
+ */
+int ipc_response_wait(struct ipc_response *token, struct ipc_message *response, char **body);
+
+/**
+ * A range of a buffer in shared memory, for passing bulk data to a server
+ * without copying it through the socket. Only the index, offset and length
+ * are sent, in that order; the server sees the same memory at its own data
+ * pointer.
+ */
+struct ipc_buffer {
+	uint32_t index;
+	uint32_t offset;
+	uint32_t length;
+	void *data;
+};
+
+/**
+ * Allocate a buffer of up to IPC_BUFFER_SIZE bytes from the pool of a
+ * session. The pool is created the first time, and handed to the server
+ * over each connection the session makes. Fails with IPC_ERROR_NO_MEMORY
+ * if every buffer is in use, and IPC_ERROR_ARGUMENT_INVALID for sessions
+ * over TCP, where there is no memory to share.
+ */
+int ipc_buffer_alloc(struct ipc_session *session, size_t size, struct ipc_buffer *buf);
+
+/** Return a buffer to the pool of the session, so it can be allocated again */
+void ipc_buffer_free(struct ipc_session *session, struct ipc_buffer *buf);
+
+/**
+ * Find the memory that a reference sent by the client points to. The token
+ * is NULL while the request is being dispatched. Used by generated skeletons.
+ */
+int ipc_buffer_resolve(struct ipc_response *token, const void *ref, size_t len,
+		struct ipc_buffer *buf);
+
+/**
+ * Narrow a buffer to the range that the server returned, which must lie
+ * within it. Used by generated stubs.
+ */
+int ipc_buffer_update(struct ipc_buffer *buf, const void *ref);
+
+/**
+ * A range of a file returned by a method. The method fills in fd, offset
+ * and length, and libipc sends the contents and closes the descriptor, so
+ * that they are never copied into the server's memory. The client gets the
+ * contents in data, a malloc'd buffer that it must free, and fd is -1.
+ */
+struct ipc_file {
+	int fd;
+	uint64_t offset;
+	uint64_t length;
+	void *data;
+};
+
+/**
+ * Read the range of a file into data, and close the descriptor. Used by
+ * generated skeletons for callers in the same process as the server.
+ */
+int ipc_file_load(struct ipc_file *file);
+
 /* TODO:
 
 // wrap the FD sending functions
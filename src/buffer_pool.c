@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/ipc.h"
+#include "buffer_pool.h"
+#include "log.h"
+
+/*
+ * Where the system can seal shared memory, the client seals the size of the
+ * pool before passing it, so that a server that has mapped it can rely on
+ * every page staying there. Otherwise the client could shrink the pool, and
+ * the server would crash on its next access to it.
+ */
+#if defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define BUFFER_POOL_SEALING 1
+#define BUFFER_POOL_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+#endif
+
+void
+buffer_pool_init(struct buffer_pool *pool)
+{
+	pool->fd = -1;
+	pool->base = NULL;
+	pool->nbuffers = 0;
+	pool->used = 0;
+}
+
+/* Create an anonymous shared memory object */
+static int
+shared_memory_open(void)
+{
+#if defined(BUFFER_POOL_SEALING)
+	return memfd_create("ipc-buffers", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#elif defined(SHM_ANON)
+	return shm_open(SHM_ANON, O_RDWR | O_CLOEXEC, 0600);
+#else
+	char name[64];
+	int fd;
+
+	snprintf(name, sizeof(name), "/ipc-buffers.%d.%ld", (int) getpid(), random());
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0)
+		(void) shm_unlink(name);
+	return fd;
+#endif
+}
+
+/* Create a pool of buffers, for a client to share with the server */
+int
+buffer_pool_create(struct buffer_pool *pool, uint32_t nbuffers)
+{
+	size_t size = (size_t) nbuffers * IPC_BUFFER_SIZE;
+	int rv;
+
+	pool->fd = shared_memory_open();
+	if (pool->fd < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("unable to create shared memory");
+		return rv;
+	}
+	/* The pages are only allocated once they are used */
+	if (ftruncate(pool->fd, size) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("ftruncate(2)");
+		buffer_pool_free(pool);
+		return rv;
+	}
+#if defined(BUFFER_POOL_SEALING)
+	if (fcntl(pool->fd, F_ADD_SEALS, BUFFER_POOL_SEALS | F_SEAL_SEAL) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("fcntl(2)");
+		buffer_pool_free(pool);
+		return rv;
+	}
+#endif
+	pool->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+	if (pool->base == MAP_FAILED) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("mmap(2)");
+		pool->base = NULL;
+		buffer_pool_free(pool);
+		return rv;
+	}
+	pool->nbuffers = nbuffers;
+	pool->used = 0;
+	log_debug("created a pool of %u buffers on fd %d", nbuffers, pool->fd);
+	return 0;
+}
+
+/*
+ * Map a pool that a client has passed to the server. The descriptor is
+ * closed. A pool whose size is not sealed is only accepted from a trusted
+ * client, which could do the server harm in other ways anyway.
+ */
+int
+buffer_pool_map(struct buffer_pool *pool, int fd, int trusted)
+{
+	struct stat sb;
+	void *base;
+	int sealed = 0;
+	int rv;
+
+#if defined(BUFFER_POOL_SEALING)
+	rv = fcntl(fd, F_GET_SEALS);
+	sealed = rv >= 0 && (rv & BUFFER_POOL_SEALS) == BUFFER_POOL_SEALS;
+#endif
+	if (!sealed && !trusted) {
+		log_error("refusing a buffer pool whose size can change");
+		(void) close(fd);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+
+	/* Checked after the seals, so the size stays as it is */
+	if (fstat(fd, &sb) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("fstat(2)");
+		(void) close(fd);
+		return rv;
+	}
+	if (sb.st_size <= 0 || sb.st_size % IPC_BUFFER_SIZE != 0 ||
+			sb.st_size / IPC_BUFFER_SIZE > BUFFER_POOL_MAX) {
+		log_error("a pool of %lld bytes is not a valid size", (long long) sb.st_size);
+		(void) close(fd);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+	base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (base == MAP_FAILED) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("mmap(2)");
+		return rv;
+	}
+
+	buffer_pool_free(pool);
+	pool->base = base;
+	pool->nbuffers = sb.st_size / IPC_BUFFER_SIZE;
+	log_debug("mapped a pool of %u buffers", pool->nbuffers);
+	return 0;
+}
+
+void
+buffer_pool_free(struct buffer_pool *pool)
+{
+	if (pool->base)
+		(void) munmap(pool->base, (size_t) pool->nbuffers * IPC_BUFFER_SIZE);
+	if (pool->fd >= 0)
+		(void) close(pool->fd);
+	buffer_pool_init(pool);
+}
+
+/* Returns the index of a free buffer, or -1 if they are all in use */
+int
+buffer_pool_alloc(struct buffer_pool *pool)
+{
+	uint32_t i;
+
+	for (i = 0; i < pool->nbuffers; i++) {
+		if (!(pool->used & (1ULL << i))) {
+			pool->used |= 1ULL << i;
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+buffer_pool_release(struct buffer_pool *pool, uint32_t index)
+{
+	if (index < pool->nbuffers)
+		pool->used &= ~(1ULL << index);
+}
+
+/* Returns where a range of a buffer is mapped, or NULL if it is not in the pool */
+char *
+buffer_pool_resolve(const struct buffer_pool *pool, uint32_t index,
+		uint32_t offset, uint32_t length)
+{
+	if (!pool->base || index >= pool->nbuffers ||
+			offset > IPC_BUFFER_SIZE || length > IPC_BUFFER_SIZE - offset)
+		return NULL;
+	return pool->base + (size_t) index * IPC_BUFFER_SIZE + offset;
+}
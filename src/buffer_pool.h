@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stdint.h>
+
+/*
+ * Shared memory for passing bulk data between a client and a server. The
+ * client creates the pool and hands it to the server once for each
+ * connection; after that, calls refer to data in it by the index of a
+ * buffer, an offset and a length, and nothing needs to be mapped or copied.
+ * Each buffer is IPC_BUFFER_SIZE bytes.
+ */
+
+/* The number of buffers in the pool of a session */
+#define BUFFER_POOL_BUFFERS 16
+
+/* The most buffers that a server will map for a connection */
+#define BUFFER_POOL_MAX 64
+
+struct buffer_pool {
+	int fd; /** The shared memory object, or -1 */
+	char *base; /** Where the pool is mapped, or NULL */
+	uint32_t nbuffers;
+	uint64_t used; /** A bit for each buffer that is allocated */
+};
+
+void buffer_pool_init(struct buffer_pool *pool);
+int buffer_pool_create(struct buffer_pool *pool, uint32_t nbuffers);
+int buffer_pool_map(struct buffer_pool *pool, int fd, int trusted);
+void buffer_pool_free(struct buffer_pool *pool);
+int buffer_pool_alloc(struct buffer_pool *pool);
+void buffer_pool_release(struct buffer_pool *pool, uint32_t index);
+char *buffer_pool_resolve(const struct buffer_pool *pool, uint32_t index,
+		uint32_t offset, uint32_t length);
+
+#endif /* BUFFER_POOL_H_ */
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The service directory is a text file that maps service names to the
+ * addresses of the nodes that provide them, so that services can move
+ * between nodes without rebuilding their clients. Each line holds a service
+ * name, an address, and an optional weight:
+ *
+ *   # service              address                  weight
+ *   com.example.inventory  tcp:db1.example.com:7400  3
+ *   com.example.inventory  tcp:db2.example.com:7400  1
+ *   com.example.cache      abstract:cache
+ *
+ * The file is mapped into memory the first time it is needed, and never
+ * read again. Only an index of the entries is built; names and addresses
+ * are used where they lie in the mapping.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "log.h"
+
+struct directory_entry {
+	const char *name;
+	size_t      namelen;
+	const char *address;
+	size_t      addrlen;
+	unsigned    weight;
+	unsigned    line;    /** Keeps the entries of a service in file order */
+};
+
+static struct {
+	const char *map;
+	size_t      size;
+	struct directory_entry *entries; /** Sorted by name */
+	size_t      count;
+	uint64_t    seed;    /** Advanced by every call to directory_pick() */
+} directory;
+
+static pthread_once_t directory_once = PTHREAD_ONCE_INIT;
+
+static int
+is_blank(char c)
+{
+	return (c == ' ' || c == '\t' || c == '\r');
+}
+
+/* Find the next field of a line, and return its length */
+static size_t
+next_field(const char **p, const char *end)
+{
+	const char *start;
+
+	while (*p < end && is_blank(**p))
+		(*p)++;
+	start = *p;
+	while (*p < end && !is_blank(**p))
+		(*p)++;
+	return *p - start;
+}
+
+/* Parse a line into an entry. Returns 1 for an entry, 0 for a blank line */
+static int
+parse_line(const char *p, const char *end, struct directory_entry *entry)
+{
+	const char *weight;
+	size_t len;
+
+	/* Comments run to the end of the line */
+	if (memchr(p, '#', end - p))
+		end = memchr(p, '#', end - p);
+
+	len = next_field(&p, end);
+	if (len == 0)
+		return 0;
+	entry->name = p - len;
+	entry->namelen = len;
+
+	entry->addrlen = next_field(&p, end);
+	entry->address = p - entry->addrlen;
+	if (entry->addrlen == 0)
+		return -1;
+
+	entry->weight = 1;
+	len = next_field(&p, end);
+	if (len > 0) {
+		weight = p - len;
+		if (len > 6)
+			return -1;
+		entry->weight = 0;
+		while (weight < p) {
+			if (*weight < '0' || *weight > '9')
+				return -1;
+			entry->weight = entry->weight * 10 + (*weight++ - '0');
+		}
+	}
+	if (next_field(&p, end) > 0)
+		return -1;
+	return 1;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	const struct directory_entry *x = a, *y = b;
+	size_t len = x->namelen < y->namelen ? x->namelen : y->namelen;
+	int rv;
+
+	rv = memcmp(x->name, y->name, len);
+	if (rv == 0)
+		rv = (x->namelen > y->namelen) - (x->namelen < y->namelen);
+	if (rv == 0)
+		rv = (x->line > y->line) - (x->line < y->line);
+	return rv;
+}
+
+static void
+build_index(void)
+{
+	const char *p = directory.map;
+	const char *end = directory.map + directory.size;
+	const char *eol;
+	size_t nlines = 0;
+	unsigned line = 0;
+	int rv;
+
+	for (eol = p; eol < end; eol++) {
+		if (*eol == '\n')
+			nlines++;
+	}
+	directory.entries = calloc(nlines + 1, sizeof(struct directory_entry));
+	if (!directory.entries) {
+		log_error("out of memory");
+		return;
+	}
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		line++;
+		rv = parse_line(p, eol, &directory.entries[directory.count]);
+		if (rv < 0) {
+			log_warning("ignoring line %u of the service directory", line);
+		} else if (rv > 0) {
+			directory.entries[directory.count].line = line;
+			directory.count++;
+		}
+		p = eol + 1;
+	}
+
+	qsort(directory.entries, directory.count, sizeof(struct directory_entry),
+			compare_entries);
+}
+
+static void
+directory_load(void)
+{
+	struct timespec ts;
+	struct stat sb;
+	const char *path;
+	void *map;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	directory.seed = ((uint64_t) getpid() << 32) ^ ts.tv_sec ^ ts.tv_nsec;
+
+	path = getenv("IPC_DIRECTORY");
+	if (!path || !*path)
+		return;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_errno("open(2) of %s", path);
+		return;
+	}
+	if (fstat(fd, &sb) < 0) {
+		log_errno("fstat(2) of %s", path);
+		(void) close(fd);
+		return;
+	}
+	if (sb.st_size == 0) {
+		(void) close(fd);
+		return;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close(fd);
+	if (map == MAP_FAILED) {
+		log_errno("mmap(2) of %s", path);
+		return;
+	}
+	directory.map = map;
+	directory.size = sb.st_size;
+
+	build_index();
+	log_debug("loaded %zu entries from the service directory %s",
+			directory.count, path);
+}
+
+int
+directory_lookup(const char *service, struct directory_endpoint *endpoints, int max)
+{
+	struct directory_entry key, *entry;
+	size_t lo, hi, mid;
+	int count = 0;
+
+	pthread_once(&directory_once, directory_load);
+	if (directory.count == 0)
+		return 0;
+
+	/* Find the first entry for the service */
+	key.name = service;
+	key.namelen = strlen(service);
+	key.line = 0;
+	lo = 0;
+	hi = directory.count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (compare_entries(&directory.entries[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (entry = &directory.entries[lo];
+			entry < directory.entries + directory.count && count < max;
+			entry++) {
+		if (entry->namelen != key.namelen ||
+				memcmp(entry->name, service, key.namelen) != 0)
+			break;
+		endpoints[count].address = entry->address;
+		endpoints[count].addrlen = entry->addrlen;
+		endpoints[count].weight = entry->weight;
+		count++;
+	}
+	return count;
+}
+
+int
+directory_pick(const struct directory_endpoint *endpoints, int count)
+{
+	uint64_t total = 0;
+	uint64_t x;
+	int i;
+
+	for (i = 0; i < count; i++)
+		total += endpoints[i].weight;
+	if (total == 0)
+		return 0;
+
+	/* splitmix64, so that concurrent callers need no lock */
+	x = __atomic_add_fetch(&directory.seed, 0x9e3779b97f4a7c15ULL, __ATOMIC_RELAXED);
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	x = (x ^ (x >> 31)) % total;
+
+	for (i = 0; i < count; i++) {
+		if (x < endpoints[i].weight)
+			return i;
+		x -= endpoints[i].weight;
+	}
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DIRECTORY_H_
+#define DIRECTORY_H_
+
+#include <stddef.h>
+
+/* The most endpoints that one service can have in the directory */
+#define DIRECTORY_ENDPOINT_MAX 16
+
+/* An endpoint of a service; the address points into the directory file */
+struct directory_endpoint {
+	const char *address;
+	size_t      addrlen;
+	unsigned    weight;
+};
+
+/*
+ * Get the endpoints of a service from the directory named by the
+ * IPC_DIRECTORY environment variable, in the order they appear there.
+ * Returns the number of endpoints, or 0 if the service is not listed.
+ */
+int directory_lookup(const char *service, struct directory_endpoint *endpoints, int max);
+
+/* Choose an endpoint at random, in proportion to the weights */
+int directory_pick(const struct directory_endpoint *endpoints, int count);
+
+#endif /* DIRECTORY_H_ */
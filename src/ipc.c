@@ -16,20 +16,42 @@
 
 #include <dlfcn.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/event.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#endif
 
 #include "../include/ipc.h"
 #include "ipc_private.h"
+#include "buffer_pool.h"
+#include "directory.h"
 #include "fdpass.h"
 #include "log.h"
+#include "spool.h"
+#include "timer_wheel.h"
 
 /** TEMPORARY: move this to a compatibility shim */
 #ifndef dlfunc
@@ -43,33 +65,379 @@
             (var) = (tvar))
 #endif
 
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar)                       \
+        for ((var) = LIST_FIRST((head));                                \
+            (var) && ((tvar) = LIST_NEXT((var), field), 1);             \
+            (var) = (tvar))
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 /**** END: compatibility stuff */
 
 static void service_name_to_libname(char *name);
 static int validate_service_name(const char *service);
 static int setup_directories(char *statedir, mode_t mode);
+struct client_connection;
+struct ipc_server;
+static void client_connection_close(struct ipc_server *, struct client_connection *);
+struct method_limit;
+struct service_binding;
+struct server_connection;
+static void method_limit_flush(struct method_limit *);
+static void method_limit_free(struct method_limit *);
+static int service_binding_load_limits(struct ipc_server *, struct service_binding *);
+static int client_connection_start(struct ipc_server *, struct service_binding *, int, int);
+static uint64_t monotonic_ns(void);
+static void ns_to_timespec(uint64_t, struct timespec *);
+static void ipc_response_release(struct ipc_response *);
+static int server_register_wakeup(struct ipc_server *);
+static int server_register_timer(struct ipc_server *);
+static int server_retry_changes(struct ipc_server *);
+static int message_validate(const struct ipc_message *, uint32_t);
+static int proxy_dispatch(int, struct ipc_message *, char *);
 
 /* Types of kevent callbacks */
 enum {
 	event_type_client_read,
 	event_type_client_accept,
+	event_type_wakeup,
+	event_type_timer,
 };
 
-struct client_connection {
-	SLIST_ENTRY(client_connection) sle;
-	int fd;
+/* The identifier of the EVFILT_USER event that wakes up the event loop */
+#define WAKEUP_IDENT 1
+
+/* The identifier of the EVFILT_TIMER event that drives the timers */
+#define TIMER_IDENT 2
+
+/* The resolution of the server's timers */
+#define TIMER_TICK_MS 10
+#define TIMER_TICK_NS (TIMER_TICK_MS * 1000000ULL)
+
+/*
+ * When the caller waits on the pollfd, the event loop cannot sleep until the
+ * next timer is due, so a coarser periodic timer drives the timers instead.
+ */
+#define EXTERNAL_POLL_TICK_MS 100
+
+/* Connections that have not sent a request for this long are closed */
+#define IDLE_TIMEOUT_DEFAULT_MS (5 * 60 * 1000)
+
+/* How often a client waiting for a service tries to connect */
+#define WAIT_RETRY_MIN_MS 1
+#define WAIT_RETRY_MAX_MS 250
+
+/*
+ * A client makes sure that a connection idle for this long is still open
+ * before using it. Calls in quick succession skip the check.
+ */
+#define CONNECTION_CHECK_NSEC (NSEC_PER_SEC / 10)
+
+/*
+ * A worker that dies this soon after it was started is restarted after the
+ * same delay, so that one that crashes on startup does not keep the
+ * supervisor forking.
+ */
+#define PREFORK_RESPAWN_DELAY_NSEC NSEC_PER_SEC
+
+/* The most connections to accept in response to a single event */
+#define ACCEPT_BATCH_MAX 64
+
+/* The initial size of the kevent changelist */
+#define CHANGELIST_SIZE_MIN 16
+
+/* The size of the buffer that requests are read into. It must be able
+ * to hold at least one message of the largest possible size.
+ */
+#define READ_BUFFER_SIZE (64 * 1024)
+
+/* The largest response: the results, plus the contents of any files */
+#define RESPONSE_SIZE_MAX (IPC_MESSAGE_SIZE_MAX + IPC_FILE_SIZE_MAX)
+
+/* The size of the buffer used to copy files where sendfile(2) is not available */
+#define FILE_COPY_SIZE 8192
+
+/* Arguments are accessed in place, so message bodies need this alignment */
+#define BODY_ALIGNMENT sizeof(uint64_t)
+
+/* How many bytes of requests a connection may dispatch in each turn. A
+ * client that sends more than this at once waits for its next turn, so
+ * that other clients are served in the meantime. */
+#define SCHED_QUANTUM 4096
+
+/* The number of users that can have a rate limit of their own. Users beyond
+ * that share the limit of IPC_RATE_ANY_UID. Must be a power of two. */
+#define RATE_TABLE_SIZE 256
+
+/* Marks a free slot in the rate limit table */
+#define RATE_UID_FREE ((uid_t) -2)
+
+#define NSEC_PER_SEC 1000000000LL
+
+/* The domain of bindings and sessions that were given a transport address */
+#define DOMAIN_ADDRESS -1
+
+/* The size of a buffer for the name of a symbol generated by ipcc, such as ipc_dispatch__<service> */
+#define SYMBOL_NAME_MAX 255
+
+/* The name of the symbol that holds the address from the interface definition */
+#define ADDRESS_SYMBOL "ipc_address__%s"
+
+/* Where to start reading within the read buffer, so that the body of the
+ * first message is aligned. */
+#define READ_BUFFER_OFFSET \
+	((BODY_ALIGNMENT - sizeof(struct ipc_message) % BODY_ALIGNMENT) % BODY_ALIGNMENT)
+
+/* Every object registered with the kqueue begins with one of these,
+ * so the dispatcher can tell what kind of object the udata points to.
+ */
+struct event_source {
+	int type; /** One of the event_type_* constants */
 };
 
-struct ipc_server {
+/* A service that the server accepts connections for. A server may have any
+ * number of these, all sharing the same kqueue and event loop.
+ */
+struct service_binding {
+	struct event_source evsrc; /** Accept events on listenfd */
+	LIST_ENTRY(service_binding) entries;
+	LIST_ENTRY(service_binding) local_entries; /** Entry in local_bindings */
+	int is_local; /** If true, the binding is in local_bindings */
 	char *service; /** The IPC service name */
+	int domain; /** The IPC domain */
 	char *libname;  /** The unique portion of the shared object name; e.g. com_example_myservice */
 	int (*dispatch_cb)(int, struct ipc_message *, char *);
 	void *skeleton_dlh; /** A handle created by dlopen(3) to the skeleton library */
-	int pollfd;
 	int listenfd;
-	struct sockaddr_un sock;
+	struct sockaddr_un sock; /** If the address is a path, it is unlinked when the binding is freed */
+	pid_t owner; /** The process that bound; workers forked from it leave the path alone */
+	int is_tcp; /** If true, accepted connections are TCP sockets */
+	int paused; /** Accepting stopped for want of a descriptor; see shed_connection() */
+	struct method_limit **limits; /** Limits on concurrent calls to each method */
+	int nlimits;
+	struct server_connection *upstream; /** For a proxy, the session that calls are forwarded to */
+	struct ipc_server *server;
+};
+
+struct client_connection {
+	struct event_source evsrc;
+	LIST_ENTRY(client_connection) entries;
+	struct service_binding *binding; /** The service the client connected to */
+	int fd;
+	char *partial; /** Data left over from the last read, not yet dispatched */
+	size_t partial_len;
+	TAILQ_ENTRY(client_connection) runq_entries;
+	int runnable; /** If true, partial holds a complete request, and the connection is on the run queue */
+	size_t deficit; /** Bytes of requests the connection may still dispatch in its turn */
+	struct rate_bucket *bucket; /** The rate limit of the client's user, if any */
+	int refcnt; /** One for the event loop, plus one for each outstanding ipc_response */
+	int closed; /** If true, the event loop is done with the connection */
+	int registered; /** If true, the read filter is in the kqueue, or queued to be added */
+	pthread_mutex_t write_lock; /** Held while writing a response */
+	struct timer timer; /** Closes the connection when idle, and sends keepalives */
+	uint64_t last_active; /** The tick of the last request */
+	uint64_t last_ping; /** The tick of the last keepalive */
+	int adopted; /** Given to ipc_server_adopt_fd(); the client cannot reconnect, so it is never idle */
+	struct buffer_pool pool; /** The buffers the client shares with the server, if it has passed them */
+};
+
+/*
+ * Token buckets for the requests of a user. Slots are claimed with an atomic
+ * compare-and-swap of the uid and never released, so lookups need no lock.
+ * The credit is only spent by the event loop; it is kept in billionths of a
+ * request or byte, so that it can be refilled with integer arithmetic.
+ */
+struct rate_bucket {
+	uid_t uid; /** RATE_UID_FREE if the slot is unused */
+	unsigned int requests_per_sec; /** 0 means no limit */
+	unsigned int bytes_per_sec; /** 0 means no limit */
+	int64_t request_credit;
+	int64_t byte_credit;
+	int64_t refilled_ns; /** When the credit was last refilled */
+};
+
+/* A call that has to wait until fewer calls to its method are in progress */
+struct waiting_call {
+	TAILQ_ENTRY(waiting_call) entries;
+	struct client_connection *conn; /** Holds a reference */
+	struct timer deadline; /** Answers the call with IPC_ERROR_TIMED_OUT if it waits too long */
+	struct ipc_message request;
+	char *body; /** Points to a copy of the body, after the call */
+};
+
+/*
+ * A limit on how many calls to a method may be in progress at once. The
+ * counters are updated atomically, so calls can finish on any thread without
+ * taking a lock.
+ */
+struct method_limit {
+	uint32_t method;
+	int max;
+	int flags; /** One of the IPC_LIMIT_* constants */
+	int active; /** The number of calls in progress */
+	int nwaiting; /** The number of calls in the waiting queue */
+	TAILQ_HEAD(, waiting_call) waiting; /** Protected by the server's waiting_mtx */
+	struct ipc_server *server;
+};
+
+/* A call that the method will complete later, with ipc_response_complete() */
+struct ipc_response {
+	struct client_connection *conn; /** NULL for a call from within this process */
+	struct ipc_server *server; /** Holds a reference; NULL for a call from within this process */
+	struct method_limit *limit; /** The limit to release when the call completes */
+	uint32_t method;
+	uint32_t id;
+	struct timer deadline; /** Answers the call with IPC_ERROR_TIMED_OUT if it takes too long */
+	int answered; /** Set atomically by whichever answers the call first */
+	int refcnt; /** One for the method, plus one while the deadline is pending */
+
+	/* The rest is only used for calls from within this process */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+	struct ipc_message message;
+	char *body;
+};
+
+/* The connection whose request is being dispatched by this thread */
+static __thread struct client_connection *current_connection;
+
+/* The limit to release once the request being dispatched has completed */
+static __thread struct method_limit *current_limit;
+
+/* The default number of threads that run blocking methods */
+#define BLOCKING_THREADS_DEFAULT 4
+
+/* The most calls to blocking methods that may wait for a thread */
+#define BLOCKING_QUEUE_MAX 1024
+
+/* A call to a blocking method, waiting for a pool thread */
+struct blocking_job {
+	STAILQ_ENTRY(blocking_job) entries;
+	void (*func)(struct ipc_response *, struct ipc_message *, char *);
+	struct ipc_response *token;
+	struct ipc_message request;
+	char *body; /** Points to a copy of the body, after the job */
+};
+
+/* Threads that run blocking methods. They are shared by all servers in the
+ * process, and started when the first blocking method is called.
+ */
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	STAILQ_HEAD(, blocking_job) jobs;
+	int njobs;
+	int nthreads;
+} blocking_pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.jobs = STAILQ_HEAD_INITIALIZER(blocking_pool.jobs),
+};
+
+struct ipc_server {
+	LIST_HEAD(, service_binding) bindings;
+	int pollfd;
+	int reserve_fd; /** Held open so it can be given up when we run out of descriptors */
+	int npaused; /** Bindings that stopped accepting until a descriptor frees up */
+	struct kevent *changes; /** Registrations to submit with the next call to kevent(2) */
+	int nchanges;
+	int changes_max;
+	int external_poll; /** The caller waits on pollfd itself, so changes cannot wait */
+	char *readbuf; /** Shared by all connections; see client_connection_read() */
+	char *bodybuf; /** Holds a message body that is not suitably aligned in readbuf */
 	int last_error; /** The most recent error code */
-	SLIST_HEAD(, client_connection) clients;
+	LIST_HEAD(, client_connection) clients;
+	TAILQ_HEAD(, client_connection) runq; /** Connections with requests waiting for their turn */
+	struct rate_bucket *rates; /** RATE_TABLE_SIZE slots, or NULL if no rate limit is set */
+	struct event_source wakeup_evsrc; /** Signals that waiting calls may be able to run */
+	int wakeup_registered;
+	pthread_mutex_t waiting_mtx; /** Protects the waiting calls of every method_limit */
+	struct timer_wheel timers; /** Idle connections, keepalives and call deadlines */
+	uint64_t epoch_ns; /** When tick 0 of the timers was, on the monotonic clock */
+	uint64_t tick; /** The current tick, as of the last event */
+	uint64_t idle_ticks; /** 0 means that idle connections are kept open */
+	uint64_t keepalive_ticks; /** 0 means that no keepalives are sent */
+	uint64_t deadline_ticks; /** 0 means that calls have no deadline */
+	struct event_source timer_evsrc; /** Drives the timers when the caller waits on pollfd */
+	int timer_registered;
+	int refcnt; /** One for the caller until ipc_server_free(), plus one for each ipc_response */
+	int stopped; /** Set by ipc_server_free(); the kqueue is only kept for server_wakeup() */
+};
+
+/* A call that is waiting for its response */
+struct pending_call {
+	LIST_ENTRY(pending_call) entries;
+	uint32_t id;
+	int fd; /** The connection that the request was sent on */
+	struct ipc_message *response;
+	char *body;
+	int done;
+	int error; /** Set if the connection failed before the response arrived */
+};
+
+/* The number of recent latencies kept for each hedged method */
+#define LATENCY_SAMPLES 64
+
+/* Hedging starts once this many latencies have been seen */
+#define HEDGE_MIN_SAMPLES 20
+
+/* How long a hedged call waits on one connection before checking the other */
+#define HEDGE_POLL_NSEC 1000000
+
+/* Retries wait for a random time up to this, doubling from the minimum */
+#define BACKOFF_MIN_NSEC 10000000
+#define BACKOFF_MAX_NSEC 1000000000
+
+/* The most spooled calls that are sent in one write */
+#define SPOOL_BATCH_MAX 64
+
+/*
+ * A session stops sending calls for a while once half of its recent calls
+ * have failed or been very slow, and then lets a single call through to see
+ * if the service has recovered.
+ */
+#define BREAKER_WINDOW 20
+#define BREAKER_MIN_CALLS 10
+#define BREAKER_FAILURE_PCT 50
+#define BREAKER_SLOW_NSEC NSEC_PER_SEC
+#define BREAKER_OPEN_NSEC NSEC_PER_SEC
+
+enum {
+	BREAKER_CLOSED = 0, /* Calls are sent */
+	BREAKER_OPEN,       /* Calls fail with IPC_ERROR_UNAVAILABLE until reopen */
+	BREAKER_HALF_OPEN,  /* A probe is in progress, and other calls fail until reopen */
+};
+
+struct circuit_breaker {
+	int state;
+	uint32_t outcomes; /** One bit for each call in the window, set if it failed */
+	unsigned int ncalls; /** The number of calls in the window */
+	uint64_t reopen; /** When an open breaker lets a probe through */
+};
+
+/* The retry policy of a method, from the table in its stub library */
+struct method_policy {
+	uint32_t method;
+	int retries;
+	int flags;
+	uint64_t latency[LATENCY_SAMPLES]; /** Recent latencies, in nanoseconds */
+	unsigned int nsamples; /** The number of latencies ever recorded */
+};
+
+/* One-way calls that a session keeps until the server has answered them */
+struct session_spool {
+	struct spool ring;
+	pthread_mutex_t lock; /** Protects ring and stopping */
+	pthread_cond_t cond; /** Signalled when a call is added, or the spool is emptied */
+	pthread_t drainer; /** The thread that sends the calls */
+	int stopping;
 };
 
 struct server_connection {
@@ -77,15 +445,49 @@ struct server_connection {
 	char *service; /** The name of the service */
 	char *libname;  /** The unique portion of the stub library name; e.g. com_example_myservice */
 	int domain; /** The IPC domain */
-	int fd;    /** Socket descriptor connected to the server */
+	int fd;    /** Socket descriptor connected to the server, or -1 to reconnect */
 	void *stub_dlh; /** Handle returned by dlopen() */
+	void *local_dlh; /** If the server is in this process, a handle to its skeleton library */
+	struct sockaddr_storage addr; /** The address of the server */
+	socklen_t addrlen;
+	int in_directory; /** If true, addr is chosen from the service directory on every connect */
+	int adopted; /** Given to ipc_session_from_fd(); there is no address to reconnect to */
+	struct sockaddr_storage avoid; /** An endpoint to pass over when choosing one, if avoidlen > 0 */
+	socklen_t avoidlen;
+	struct method_policy *policies; /** Retry policies of methods; protected by lock */
+	int npolicies;
+	struct server_connection *hedge; /** A connection to another replica, for hedged calls */
+	struct circuit_breaker breaker; /** Protected by lock */
+	pthread_mutex_t lock; /** Protects the fields below */
+	pthread_cond_t cond; /** Signalled when a response arrives, or the reader is done */
+	pthread_mutex_t write_lock; /** Held while writing a request; fd changes under both locks */
+	LIST_HEAD(, pending_call) pending;
+	uint32_t next_id;
+	int reading; /** If true, a thread is reading responses on behalf of the others */
+	int stale_fd; /** A failed connection that the reading thread is still using */
+	uint64_t last_used; /** When the last call was sent, on the monotonic clock */
+	struct buffer_pool pool; /** Buffers shared with the server; the bitmap is protected by lock */
+	uint64_t generation; /** Counts the sockets the session has had, to tell them apart */
+	uint64_t pool_generation; /** The socket the pool was last passed over */
+	struct session_spool *spool; /** One-way calls waiting to be sent, or NULL */
 };
 
+/* Every service bound by an ipc_server in this process. Clients use this to
+ * call the server directly, instead of going through a socket.
+ */
+static LIST_HEAD(, service_binding) local_bindings = LIST_HEAD_INITIALIZER(local_bindings);
+static pthread_mutex_t local_bindings_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 struct ipc_client {
 	SLIST_HEAD(, server_connection) servers;
+	pthread_mutex_t lock; /** Protects servers */
 	int last_error; /** The most recent error code */
 };
 
+/* The client used when none is given, so that sessions are reused */
+static struct ipc_client *default_client;
+static pthread_once_t default_client_once = PTHREAD_ONCE_INIT;
+
 static void
 service_name_to_libname(char *name)
 {
@@ -179,28 +581,28 @@ get_library_path(char *dest, size_t sz, const char *libname, const char *suffix)
 }
 
 static int
-lookup_dispatch_callback(struct ipc_server *server)
+lookup_dispatch_callback(struct ipc_server *server, struct service_binding *binding)
 {
 	char path[PATH_MAX];
-	char ident[255]; /* FIXME: magic number */
+	char ident[SYMBOL_NAME_MAX];
 	int len;
 	int rv;
 	void *sym;
 
-	rv = get_library_path(path, sizeof(path), server->libname, "skeleton");
+	rv = get_library_path(path, sizeof(path), binding->libname, "skeleton");
 	if (rv < 0) {
 		log_error("unable to determine the skeleton path");
 		return rv;
 	}
 
-	server->skeleton_dlh = dlopen(path, RTLD_LAZY);
-	if (!server->skeleton_dlh) {
+	binding->skeleton_dlh = dlopen(path, RTLD_LAZY);
+	if (!binding->skeleton_dlh) {
 		server->last_error = IPC_CAPTURE_ERRNO;
 		log_errno("dlopen(3) of `%s'", path);
 		return server->last_error;
 	}
 
-	len = snprintf(ident, sizeof(ident), "ipc_dispatch__%s", server->libname);
+	len = snprintf(ident, sizeof(ident), "ipc_dispatch__%s", binding->libname);
 	if (len >= sizeof(ident) || len < 0) {
 		log_error("buffer allocation error");
 		return -IPC_ERROR_NAME_TOO_LONG;
@@ -208,52 +610,176 @@ lookup_dispatch_callback(struct ipc_server *server)
 
 	log_debug("loaded shared object %s", path);
 
-	sym = dlfunc(server->skeleton_dlh, ident);
+	sym = dlfunc(binding->skeleton_dlh, ident);
 	if (!sym) {
 		server->last_error = IPC_CAPTURE_ERRNO;
 		log_error("dlfunc(3) of `%s': %s", ident, dlerror());
 		return server->last_error;
 	}
-	server->dispatch_cb = (int (*)(int, struct ipc_message *, char *)) sym;
+	binding->dispatch_cb = (int (*)(int, struct ipc_message *, char *)) sym;
 
 	return 0;
 }
 
+/*
+ * Convert an address of the form "unix:<path>", "abstract:<name>" or
+ * "tcp:<host>:<port>" into a socket address. IPv6 hosts are written in
+ * brackets, and an empty host means every local address.
+ */
 static int
-bind_to_name(struct ipc_server *server, const char *statedir, const char *name)
+parse_address(const char *address, struct sockaddr_storage *ss, socklen_t *sslen)
 {
-	struct sockaddr_un *sock = &server->sock;
-	int fd = -1;
-	int len;
+	struct sockaddr_un *sun;
+	struct addrinfo hints, *res;
+	char host[NI_MAXHOST];
+	const char *p, *port;
+	size_t hostlen;
 	int rv;
 
-	sock->sun_family = AF_LOCAL;
-	len = snprintf(sock->sun_path, sizeof(sock->sun_path),
-			"%s/services/%s", statedir, name);
-	if (len >= sizeof(sock->sun_path) || len < 0) {
-		log_error("buffer allocation error");
+	memset(ss, 0, sizeof(*ss));
+	if (strncmp(address, "unix:", 5) == 0) {
+		sun = (struct sockaddr_un *) ss;
+		sun->sun_family = AF_LOCAL;
+		if (strlen(address + 5) >= sizeof(sun->sun_path))
+			return -IPC_ERROR_NAME_TOO_LONG;
+		strcpy(sun->sun_path, address + 5);
+		*sslen = SUN_LEN(sun);
+		return 0;
+	}
+	if (strncmp(address, "abstract:", 9) == 0) {
+#ifdef __linux__
+		/* A name in the abstract namespace starts with a NUL byte */
+		sun = (struct sockaddr_un *) ss;
+		sun->sun_family = AF_LOCAL;
+		if (strlen(address + 9) >= sizeof(sun->sun_path) - 1)
+			return -IPC_ERROR_NAME_TOO_LONG;
+		memcpy(sun->sun_path + 1, address + 9, strlen(address + 9));
+		*sslen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(address + 9);
+		return 0;
+#else
+		log_error("abstract socket names are not supported: %s", address);
+		return -IPC_ERROR_NAME_INVALID;
+#endif
+	}
+	if (strncmp(address, "tcp:", 4) != 0) {
+		log_error("unsupported address: %s", address);
+		return -IPC_ERROR_NAME_INVALID;
+	}
+
+	p = address + 4;
+	if (*p == '[') {
+		p++;
+		port = strchr(p, ']');
+		if (!port || port[1] != ':')
+			return -IPC_ERROR_NAME_INVALID;
+		hostlen = port - p;
+		port += 2;
+	} else {
+		port = strrchr(p, ':');
+		if (!port)
+			return -IPC_ERROR_NAME_INVALID;
+		hostlen = port - p;
+		port++;
+	}
+	if (hostlen >= sizeof(host))
 		return -IPC_ERROR_NAME_TOO_LONG;
+	memcpy(host, p, hostlen);
+	host[hostlen] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | (hostlen == 0 ? AI_PASSIVE : 0);
+	rv = getaddrinfo(hostlen == 0 ? NULL : host, port, &hints, &res);
+	if (rv != 0) {
+		log_error("unable to resolve %s: %s", address, gai_strerror(rv));
+		return -IPC_ERROR_NAME_INVALID;
 	}
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*sslen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* Get the address of a service from its interface definition, if it has one */
+static const char *
+lookup_address(void *dlh, const char *libname)
+{
+	char ident[SYMBOL_NAME_MAX];
+	int len;
+
+	len = snprintf(ident, sizeof(ident), ADDRESS_SYMBOL, libname);
+	if (len >= sizeof(ident) || len < 0)
+		return NULL;
+	return (const char *) dlsym(dlh, ident);
+}
+
+static int
+bind_to_address(struct service_binding *binding, const struct sockaddr_storage *ss,
+		socklen_t sslen)
+{
+	int fd = -1;
+	int one = 1;
+	int rv;
 
-	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (ss->ss_family == AF_LOCAL)
+		memcpy(&binding->sock, ss, sizeof(binding->sock));
+	binding->is_tcp = (ss->ss_family == AF_INET || ss->ss_family == AF_INET6);
+
+	fd = socket(ss->ss_family, SOCK_STREAM, 0);
 	if (fd < 0) {
 		rv = IPC_CAPTURE_ERRNO;
 		log_errno("socket(2)");
 		return rv;
 	}
 
-	if (bind(fd, (struct sockaddr *) sock, SUN_LEN(sock)) < 0) {
+	/* The accept loop relies on a non-blocking socket to know when to stop */
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("fcntl(2)");
+		(void) close(fd);
+		return rv;
+	}
+
+	/* Let a restarted server bind while old connections are in TIME_WAIT */
+	if (binding->is_tcp && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("setsockopt(2)");
+		(void) close(fd);
+		return rv;
+	}
+
+	if (bind(fd, (const struct sockaddr *) ss, sslen) < 0) {
 		rv = IPC_CAPTURE_ERRNO;
 		log_errno("bind(2)");
 		(void) close(fd);
 		return rv;
 	}
 
-	log_debug("service name `%s' bound to server fd %d", name, fd);
+	log_debug("service `%s' bound to server fd %d", binding->service, fd);
+
+	return fd;
+}
+
+static int
+bind_to_name(struct service_binding *binding, const char *statedir, const char *name)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_un *sock = (struct sockaddr_un *) &ss;
+	int len;
+
+	memset(&ss, 0, sizeof(ss));
+	sock->sun_family = AF_LOCAL;
+	len = snprintf(sock->sun_path, sizeof(sock->sun_path),
+			"%s/services/%s", statedir, name);
+	if (len >= sizeof(sock->sun_path) || len < 0) {
+		log_error("buffer allocation error");
+		return -IPC_ERROR_NAME_TOO_LONG;
+	}
 
 	/* TODO: write a pidfile to statedir/pidfiles using the pidfile_* functions */
 
-	return fd;
+	return bind_to_address(binding, &ss, SUN_LEN(sock));
 }
 
 static int
@@ -338,6 +864,49 @@ server_connection_load_stub(struct server_connection *server)
 	return 0;
 }
 
+/* Get the retry policies from the stub library */
+static int
+server_connection_load_policies(struct server_connection *conn)
+{
+	const struct ipc_method_policy *table, *entry;
+	char ident[SYMBOL_NAME_MAX];
+	int len;
+
+	len = snprintf(ident, sizeof(ident), "ipc_policies__%s", conn->libname);
+	if (len >= sizeof(ident) || len < 0)
+		return -IPC_ERROR_NAME_TOO_LONG;
+
+	table = (const struct ipc_method_policy *) dlsym(conn->stub_dlh, ident);
+	if (!table)
+		return 0;
+	for (entry = table; entry->retries > 0 || entry->flags != 0; entry++)
+		conn->npolicies++;
+	if (conn->npolicies == 0)
+		return 0;
+
+	conn->policies = calloc(conn->npolicies, sizeof(struct method_policy));
+	if (!conn->policies)
+		return -IPC_ERROR_NO_MEMORY;
+	for (len = 0; len < conn->npolicies; len++) {
+		conn->policies[len].method = table[len].method;
+		conn->policies[len].retries = table[len].retries;
+		conn->policies[len].flags = table[len].flags;
+	}
+	return 0;
+}
+
+/* Initialize a condition variable that is waited on with a deadline on the monotonic clock */
+static void
+monotonic_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
 static struct server_connection *
 server_connection_new(const char *service)
 {
@@ -358,18 +927,93 @@ server_connection_new(const char *service)
 	service_name_to_libname(conn->libname);
 	conn->fd = -1;
 	conn->stub_dlh = NULL;
+	conn->stale_fd = -1;
+	pthread_mutex_init(&conn->lock, NULL);
+	/* Hedged calls wait on the condition with a deadline */
+	monotonic_cond_init(&conn->cond);
+	pthread_mutex_init(&conn->write_lock, NULL);
+	LIST_INIT(&conn->pending);
+	buffer_pool_init(&conn->pool);
 
 	return conn;
 }
 
+static void
+session_spool_free(struct session_spool *sp)
+{
+	pthread_mutex_lock(&sp->lock);
+	sp->stopping = 1;
+	pthread_cond_broadcast(&sp->cond);
+	pthread_mutex_unlock(&sp->lock);
+	(void) pthread_join(sp->drainer, NULL);
+	spool_close(&sp->ring);
+	pthread_mutex_destroy(&sp->lock);
+	pthread_cond_destroy(&sp->cond);
+	free(sp);
+}
+
 static void
 server_connection_free(struct server_connection *conn)
 {
 	if (conn) {
+		/* The drainer uses the session, so it stops first */
+		if (conn->spool)
+			session_spool_free(conn->spool);
 		free(conn->service);
+		free(conn->libname);
 		if (conn->fd >= 0) close(conn->fd);
 		if (conn->stub_dlh) dlclose(conn->stub_dlh);
+		if (conn->local_dlh) dlclose(conn->local_dlh);
+		server_connection_free(conn->hedge);
+		free(conn->policies);
+		buffer_pool_free(&conn->pool);
+		pthread_mutex_destroy(&conn->lock);
+		pthread_cond_destroy(&conn->cond);
+		pthread_mutex_destroy(&conn->write_lock);
+		free(conn);
+	}
+}
+
+/*
+ * If the service is bound by a server in this process, open another handle to
+ * its skeleton library. The handle keeps the library loaded for as long as the
+ * session exists, even if the server goes away first.
+ *
+ * Returns 1 if the service is local, 0 if not, or a negative error code.
+ */
+static int
+server_connection_find_local(struct server_connection *conn)
+{
+	struct service_binding *binding;
+	char path[PATH_MAX];
+	int found = 0;
+	int rv;
+
+	pthread_mutex_lock(&local_bindings_mtx);
+	LIST_FOREACH(binding, &local_bindings, local_entries) {
+		/* A service bound at an address can be found by its name alone */
+		if ((binding->domain == conn->domain || binding->domain == DOMAIN_ADDRESS ||
+				conn->domain == DOMAIN_ADDRESS) &&
+				strcmp(binding->service, conn->service) == 0) {
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&local_bindings_mtx);
+	if (!found)
+		return 0;
+
+	rv = get_library_path(path, sizeof(path), conn->libname, "skeleton");
+	if (rv < 0)
+		return rv;
+	conn->local_dlh = dlopen(path, RTLD_LAZY);
+	if (!conn->local_dlh) {
+		log_error("dlopen(3) of `%s': %s", path, dlerror());
+		return -IPC_ERROR_CONNECTION_FAILED;
 	}
+
+	log_debug("service `%s' is in this process; calling it directly", conn->service);
+	return 1;
 }
 
 
@@ -381,9 +1025,22 @@ ipc_client()
 	if (!client) return NULL;
 	client->last_error = 0;
 	SLIST_INIT(&client->servers);
+	pthread_mutex_init(&client->lock, NULL);
 	return client;
 }
 
+static void
+default_client_init(void)
+{
+	default_client = ipc_client();
+}
+
+static int
+open_reserve_fd(void)
+{
+	return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 struct ipc_server VISIBLE *
 ipc_server()
 {
@@ -391,355 +1048,3970 @@ ipc_server()
 
 	if (!srv) return NULL;
 	srv->pollfd = kqueue();
-	if (!srv->pollfd) {
+	if (srv->pollfd < 0) {
 		free(srv);
 		return NULL;
 	}
-	srv->service = NULL;
-	srv->libname = NULL;
-	srv->listenfd = -1;
-	srv->skeleton_dlh = NULL;
-	SLIST_INIT(&srv->clients);
+	srv->reserve_fd = open_reserve_fd();
+	if (srv->reserve_fd < 0) {
+		log_errno("open(2) of /dev/null");
+		close(srv->pollfd);
+		free(srv);
+		return NULL;
+	}
+	srv->readbuf = malloc(READ_BUFFER_OFFSET + READ_BUFFER_SIZE);
+	srv->bodybuf = malloc(IPC_MESSAGE_SIZE_MAX);
+	if (!srv->readbuf || !srv->bodybuf) {
+		free(srv->readbuf);
+		free(srv->bodybuf);
+		close(srv->reserve_fd);
+		close(srv->pollfd);
+		free(srv);
+		return NULL;
+	}
+	srv->changes = NULL;
+	srv->nchanges = 0;
+	srv->changes_max = 0;
+	srv->external_poll = 0;
+	srv->npaused = 0;
+	LIST_INIT(&srv->bindings);
+	LIST_INIT(&srv->clients);
+	TAILQ_INIT(&srv->runq);
+	srv->rates = NULL;
+	srv->wakeup_evsrc.type = event_type_wakeup;
+	srv->wakeup_registered = 0;
+	pthread_mutex_init(&srv->waiting_mtx, NULL);
+	timer_wheel_init(&srv->timers);
+	srv->epoch_ns = monotonic_ns();
+	srv->tick = 0;
+	srv->idle_ticks = (IDLE_TIMEOUT_DEFAULT_MS + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	srv->keepalive_ticks = 0;
+	srv->deadline_ticks = 0;
+	srv->timer_evsrc.type = event_type_timer;
+	srv->timer_registered = 0;
+	srv->refcnt = 1;
+	srv->stopped = 0;
 	return srv;
 }
 
-void VISIBLE
-ipc_server_free(struct ipc_server *server)
+/*
+ * Queue a change to the kqueue. Changes are submitted in the same kevent(2)
+ * call that waits for the next event, which saves a system call for every
+ * registration.
+ */
+static int
+server_add_change(struct ipc_server *server, int fd, short filter, u_short flags, void *udata)
 {
-	struct client_connection *client, *client_tmp;
+	struct kevent *changes;
+	int max;
 
-	if (server) {
-		if (server->pollfd >= 0) {
-			close(server->pollfd);
-		}
-		if (server->listenfd >= 0) {
-			close(server->listenfd);
-			unlink(server->sock.sun_path);
+	if (server->nchanges == server->changes_max) {
+		max = server->changes_max ? server->changes_max * 2 : CHANGELIST_SIZE_MIN;
+		changes = realloc(server->changes, max * sizeof(*changes));
+		if (!changes) {
+			log_error("out of memory");
+			return -IPC_ERROR_NO_MEMORY;
 		}
-	    SLIST_FOREACH_SAFE(client, &server->clients, sle, client_tmp) {
-	    	close(client->fd);
-	    	free(client);
-	    }
-	    free(server->service);
-	    free(server->libname);
-	    dlclose(server->skeleton_dlh);
-		free(server);
+		server->changes = changes;
+		server->changes_max = max;
 	}
+	EV_SET(&server->changes[server->nchanges], fd, filter, flags, 0, 0, udata);
+	server->nchanges++;
+	return 0;
 }
 
-int VISIBLE
-ipc_server_get_pollfd(struct ipc_server *server)
+/* Submit all pending changes without waiting for events */
+static int
+server_flush_changes(struct ipc_server *server)
 {
-	return server->pollfd;
+	int rv;
+
+	if (server->nchanges == 0)
+		return 0;
+	rv = kevent(server->pollfd, server->changes, server->nchanges, NULL, 0, NULL);
+	if (rv < 0)
+		return server_retry_changes(server);
+	server->nchanges = 0;
+	return 0;
 }
 
-int VISIBLE
-ipc_server_bind(struct ipc_server *server, int domain, const char *name)
+/*
+ * Submit the changes again after kevent(2) gave up part way through the list.
+ * Only the failures that fit in the eventlist are reported, and the changes
+ * after the first unreported one are not applied at all, so each change is
+ * resubmitted with a receipt. Every queued change can be applied twice.
+ */
+static int
+server_retry_changes(struct ipc_server *server)
 {
-	struct kevent kev;
-	char statedir[PATH_MAX];
-	int rv = 0;
-	int fd;
+	static const struct timespec poll_only = { 0, 0 };
+	struct event_source *evsrc;
+	struct kevent *receipts;
+	int i, j, n, rv;
 
-	rv = validate_service_name(name);
-	if (rv < 0) {
-		log_error("invalid service name");
-		return rv;
+	n = server->nchanges;
+	receipts = calloc(n, sizeof(*receipts));
+	if (!receipts) {
+		log_error("out of memory");
+		return -IPC_ERROR_NO_MEMORY;
 	}
+	for (i = 0; i < n; i++)
+		server->changes[i].flags |= EV_RECEIPT;
+	rv = kevent(server->pollfd, server->changes, n, receipts, n, &poll_only);
+	server->nchanges = 0;
+	if (rv < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("kevent(2)");
+		free(receipts);
+		return rv;
+	}
+
+	for (i = 0; i < n; i++) {
+		evsrc = (struct event_source *) receipts[i].udata;
+		if (receipts[i].data == 0 || !evsrc)
+			continue;
+		log_error("kevent(2) registration of fd %d: %s",
+				(int) receipts[i].ident, strerror((int) receipts[i].data));
+		if (evsrc->type != event_type_client_read)
+			continue;
+		if (receipts[i].flags & EV_ADD)
+			((struct client_connection *) evsrc)->registered = 0;
+		/* Closing the connection cancels its other changes, so forget their receipts too */
+		for (j = i + 1; j < n; j++) {
+			if (receipts[j].udata == evsrc)
+				receipts[j].udata = NULL;
+		}
+		client_connection_close(server, (struct client_connection *) evsrc);
+	}
+	free(receipts);
+	return 0;
+}
+
+/*
+ * If the caller is waiting on the pollfd instead of inside ipc_server_dispatch(),
+ * nothing will submit the pending changes, so it has to be done right away.
+ */
+static int
+server_commit_changes(struct ipc_server *server)
+{
+	return server->external_poll ? server_flush_changes(server) : 0;
+}
+
+/*
+ * Drop the changes for an object that have not been submitted yet. Returns 1
+ * if one of them would have added its filter, which is then not in the kqueue.
+ */
+static int
+server_cancel_changes(struct ipc_server *server, void *udata)
+{
+	int added = 0;
+	int i, j;
+
+	for (i = j = 0; i < server->nchanges; i++) {
+		if (server->changes[i].udata != udata)
+			server->changes[j++] = server->changes[i];
+		else if (server->changes[i].flags & EV_ADD)
+			added = 1;
+	}
+	server->nchanges = j;
+	return added;
+}
+
+/* Stop accepting connections for a service, and drop the calls waiting for a slot */
+static void
+service_binding_close(struct service_binding *binding)
+{
+	int i;
+
+	if (binding->is_local) {
+		pthread_mutex_lock(&local_bindings_mtx);
+		LIST_REMOVE(binding, local_entries);
+		pthread_mutex_unlock(&local_bindings_mtx);
+		binding->is_local = 0;
+	}
+	if (binding->listenfd >= 0) {
+		close(binding->listenfd);
+		if (binding->sock.sun_path[0] != '\0' && binding->owner == getpid())
+			unlink(binding->sock.sun_path);
+		binding->listenfd = -1;
+	}
+	if (binding->paused) {
+		binding->paused = 0;
+		binding->server->npaused--;
+	}
+	for (i = 0; i < binding->nlimits; i++)
+		method_limit_flush(binding->limits[i]);
+}
+
+static void
+service_binding_free(struct service_binding *binding)
+{
+	int i;
+
+	service_binding_close(binding);
+	for (i = 0; i < binding->nlimits; i++)
+		method_limit_free(binding->limits[i]);
+	free(binding->limits);
+	if (binding->skeleton_dlh)
+		dlclose(binding->skeleton_dlh);
+	free(binding->service);
+	free(binding->libname);
+	free(binding);
+}
+
+/*
+ * Drop a reference to a server. Calls that are still in progress when the
+ * server is freed hold on to its limits, its bindings and the skeleton code
+ * they run, so those are only freed along with the last of them.
+ */
+static void
+server_release(struct ipc_server *server)
+{
+	struct service_binding *binding, *binding_tmp;
+
+	if (__atomic_sub_fetch(&server->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	LIST_FOREACH_SAFE(binding, &server->bindings, entries, binding_tmp) {
+		service_binding_free(binding);
+	}
+	if (server->pollfd >= 0)
+		close(server->pollfd);
+	pthread_mutex_destroy(&server->waiting_mtx);
+	free(server->rates);
+	free(server);
+}
+
+void VISIBLE
+ipc_server_free(struct ipc_server *server)
+{
+	struct client_connection *client, *client_tmp;
+	struct service_binding *binding;
+	struct timer *timer;
+
+	if (server) {
+		server->stopped = 1;
+		if (server->reserve_fd >= 0) {
+			close(server->reserve_fd);
+			server->reserve_fd = -1;
+		}
+	    LIST_FOREACH_SAFE(client, &server->clients, entries, client_tmp) {
+	    	client_connection_close(server, client);
+	    }
+	    free(server->changes);
+	    server->changes = NULL;
+	    server->nchanges = 0;
+	    server->changes_max = 0;
+	    free(server->readbuf);
+	    server->readbuf = NULL;
+	    free(server->bodybuf);
+	    server->bodybuf = NULL;
+	    LIST_FOREACH(binding, &server->bindings, entries) {
+	    	service_binding_close(binding);
+	    }
+		/* Only the deadlines of calls in progress are left */
+		while ((timer = timer_wheel_pop(&server->timers)) != NULL)
+			ipc_response_release((struct ipc_response *)
+					((char *) timer - offsetof(struct ipc_response, deadline)));
+		server_release(server);
+	}
+}
+
+int VISIBLE
+ipc_server_get_pollfd(struct ipc_server *server)
+{
+	server->external_poll = 1;
+	(void) server_flush_changes(server);
+	return server->pollfd;
+}
+
+static struct service_binding *
+server_find_binding(struct ipc_server *server, const char *name)
+{
+	struct service_binding *binding;
+
+	LIST_FOREACH(binding, &server->bindings, entries) {
+		if (strcmp(binding->service, name) == 0)
+			return binding;
+	}
+	return NULL;
+}
+
+/* Load the skeleton of a service, without a socket to listen on yet */
+static int
+service_binding_new(struct service_binding **result, struct ipc_server *server,
+		int domain, const char *name, struct server_connection *upstream)
+{
+	struct service_binding *binding;
+	int rv;
+
+	rv = validate_service_name(name);
+	if (rv < 0) {
+		log_error("invalid service name");
+		return rv;
+	}
+
+	binding = calloc(1, sizeof(*binding));
+	if (!binding) {
+		return -IPC_ERROR_NO_MEMORY;
+	}
+	binding->evsrc.type = event_type_client_accept;
+	binding->server = server;
+	binding->domain = domain;
+	binding->listenfd = -1;
+	binding->owner = getpid();
+
+	binding->service = strdup(name);
+	binding->libname = strdup(name);
+	if (!binding->service || !binding->libname) {
+		service_binding_free(binding);
+		return -IPC_ERROR_NO_MEMORY;
+	}
+	service_name_to_libname(binding->libname);
+
+	/* A proxy has no skeleton; calls are passed along as they are */
+	if (upstream) {
+		binding->upstream = upstream;
+		binding->dispatch_cb = proxy_dispatch;
+		*result = binding;
+		return 0;
+	}
+
+	rv = lookup_dispatch_callback(server, binding);
+	if (rv < 0) {
+		log_error("unable to lookup dispatcher symbol");
+		service_binding_free(binding);
+		return rv;
+	}
+
+	rv = service_binding_load_limits(server, binding);
+	if (rv < 0) {
+		log_error("unable to apply the method limits");
+		service_binding_free(binding);
+		return rv;
+	}
+
+	*result = binding;
+	return 0;
+}
+
+/* Make a binding part of the server, and callable from within this process */
+static void
+server_add_binding(struct ipc_server *server, struct service_binding *binding)
+{
+	LIST_INSERT_HEAD(&server->bindings, binding, entries);
+
+	/* There is no skeleton for clients in this process to call directly */
+	if (binding->upstream)
+		return;
+
+	pthread_mutex_lock(&local_bindings_mtx);
+	LIST_INSERT_HEAD(&local_bindings, binding, local_entries);
+	binding->is_local = 1;
+	pthread_mutex_unlock(&local_bindings_mtx);
+}
+
+/*
+ * Bind to a service at an address, or else at the address from its interface
+ * definition, or else at a name in the statedir of the domain.
+ */
+static int
+server_bind(struct ipc_server *server, int domain, const char *name, const char *address,
+		struct server_connection *upstream)
+{
+	struct service_binding *binding;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	char statedir[PATH_MAX];
+	int rv = 0;
+	int fd;
+
+	if (server_find_binding(server, name)) {
+		log_error("service `%s' is already bound to this server", name);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+
+	rv = service_binding_new(&binding, server, domain, name, upstream);
+	if (rv < 0)
+		return rv;
+
+	if (!address && binding->skeleton_dlh)
+		address = lookup_address(binding->skeleton_dlh, binding->libname);
+	if (address) {
+		rv = parse_address(address, &ss, &sslen);
+		if (rv < 0) {
+			service_binding_free(binding);
+			return rv;
+		}
+		fd = bind_to_address(binding, &ss, sslen);
+	} else {
+		rv = get_statedir(domain, statedir, sizeof(statedir));
+		if (rv < 0) {
+			log_error("unable to get statedir");
+			service_binding_free(binding);
+			return rv;
+		}
+		fd = bind_to_name(binding, statedir, name);
+	}
+	if (fd < 0) {
+		log_error("failed to bind");
+		service_binding_free(binding);
+		return fd;
+	}
+	binding->listenfd = fd;
+
+	log_info("bound to `%s' on fd %d%s%s", name, fd, address ? " at " : "",
+			address ? address : "");
+
+	if (listen(fd, 1024) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("listen(2) on %d", fd);
+		service_binding_free(binding);
+		return rv;
+	}
+
+	rv = server_add_change(server, fd, EVFILT_READ, EV_ADD | EV_ENABLE, binding);
+	if (rv < 0) {
+		service_binding_free(binding);
+		return rv;
+	}
+	server_add_binding(server, binding);
+
+	return server_commit_changes(server);
+}
+
+int VISIBLE
+ipc_server_bind(struct ipc_server *server, int domain, const char *name)
+{
+	return server_bind(server, domain, name, NULL, NULL);
+}
+
+int VISIBLE
+ipc_server_bind_address(struct ipc_server *server, const char *address, const char *name)
+{
+	return server_bind(server, DOMAIN_ADDRESS, name, address, NULL);
+}
+
+/*
+ * Runs on a pool thread: forward a call to the upstream session, and relay
+ * its response. Only the ID of the request is changed on the way, by the
+ * session; the arguments and results are passed along without being looked
+ * at.
+ */
+static void
+proxy_forward(struct ipc_response *token, struct ipc_message *request, char *body)
+{
+	struct ipc_session *upstream = (struct ipc_session *) token->conn->binding->upstream;
+	struct ipc_message header, response;
+	struct iovec iov[2];
+	struct iovec results[IPC_ARGUMENT_MAX];
+	char *rbody, *pos;
+	int i;
+	int rv;
+
+	memcpy(&header, request, sizeof(header));
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = body;
+	iov[1].iov_len = request->_ipc_bufsz;
+	rv = ipc_session_call(upstream, iov, request->_ipc_bufsz > 0 ? 2 : 1, &response, &rbody);
+	if (rv < 0) {
+		log_debug("unable to forward a call to method %u: %s", request->_ipc_method,
+				ipc_strerror(rv));
+		(void) ipc_response_complete(token, rv, NULL, 0);
+		return;
+	}
+	if (response._ipc_bufsz > IPC_MESSAGE_SIZE_MAX) {
+		/* Such as the contents of a file, which only go one hop */
+		log_error("the response to method %u is too large to relay", request->_ipc_method);
+		(void) ipc_response_complete(token, -IPC_ERROR_MESSAGE_INVALID, NULL, 0);
+		free(rbody);
+		return;
+	}
+
+	/* The response was validated when it was read, so the sizes add up */
+	for (pos = rbody, i = 0; i < response._ipc_argc; i++) {
+		results[i].iov_base = pos;
+		results[i].iov_len = response._ipc_argsz[i];
+		pos += response._ipc_argsz[i];
+	}
+	(void) ipc_response_complete(token, response._ipc_status, results, response._ipc_argc);
+	free(rbody);
+}
+
+/* The dispatcher of a proxy, which does not wait for the upstream on the event loop */
+static int
+proxy_dispatch(int s, struct ipc_message *request, char *body)
+{
+	(void) s;
+	return ipc_response_offload(request, body, proxy_forward);
+}
+
+int VISIBLE
+ipc_server_bind_proxy(struct ipc_server *server, int domain, const char *service,
+		const char *address, struct ipc_session *upstream)
+{
+	struct server_connection *conn = (struct server_connection *) upstream;
+
+	/* A session to a server in this process calls its skeleton directly */
+	if (!conn || conn->local_dlh) {
+		log_error("a proxy needs a session to a server in another process");
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+	return server_bind(server, address ? DOMAIN_ADDRESS : domain, service, address, conn);
+}
+
+int VISIBLE
+ipc_server_adopt_fd(struct ipc_server *server, const char *service, int fd)
+{
+	struct service_binding *binding;
+	int rv;
+
+	if (fd < 0)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	/* A service that is only reached through adopted descriptors has no socket */
+	binding = server_find_binding(server, service);
+	if (!binding) {
+		rv = service_binding_new(&binding, server, DOMAIN_ADDRESS, service, NULL);
+		if (rv < 0) {
+			(void) close(fd);
+			return rv;
+		}
+		server_add_binding(server, binding);
+	}
+
+	rv = client_connection_start(server, binding, fd, 1);
+	if (rv < 0)
+		return rv;
+
+	log_debug("adopted fd %d as a connection to `%s'", fd, service);
+	return server_commit_changes(server);
+}
+
+/* A worker process started by ipc_server_prefork() */
+struct prefork_worker {
+	pid_t pid; /** 0 once the worker has exited */
+	uint64_t started; /** When it was started, on the monotonic clock */
+};
+
+/* The workers of the supervisor in this process; read by its signal handler */
+static struct prefork_worker *prefork_workers;
+static int prefork_nworkers;
+static volatile sig_atomic_t prefork_stopping;
+
+/* Shut down the workers along with the supervisor */
+static void
+prefork_signal(int signo)
+{
+	int saved_errno = errno;
+	int i;
+
+	prefork_stopping = 1;
+	for (i = 0; i < prefork_nworkers; i++) {
+		if (prefork_workers[i].pid > 0)
+			(void) kill(prefork_workers[i].pid, SIGTERM);
+	}
+	errno = saved_errno;
+}
+
+/* Forget the state of a client connection that the parent of a worker made */
+static void
+prefork_reset_connection(struct server_connection *conn)
+{
+	for (; conn; conn = conn->hedge) {
+		pthread_mutex_init(&conn->lock, NULL);
+		monotonic_cond_init(&conn->cond);
+		pthread_mutex_init(&conn->write_lock, NULL);
+		if (conn->fd >= 0)
+			close(conn->fd);
+		if (conn->stale_fd >= 0)
+			close(conn->stale_fd);
+		conn->fd = -1;
+		conn->stale_fd = -1;
+		LIST_INIT(&conn->pending);
+		conn->reading = 0;
+		/* The pages are shared with the parent, so the buffers cannot be told apart */
+		buffer_pool_free(&conn->pool);
+		/* The parent's drainer owns the spool; the worker sends its calls directly */
+		conn->spool = NULL;
+	}
+}
+
+/*
+ * Put the state of the library in order in a new worker. Only the thread
+ * that called fork(2) is left, so the locks other threads may have held are
+ * initialized again, the blocking pool starts afresh when it is needed, and
+ * the sessions of the default client reconnect, so that the worker and its
+ * parent do not read each other's responses. Calls that were queued or in
+ * progress belong to the parent, and are dropped.
+ */
+static void
+prefork_reset_library(void)
+{
+	static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+	struct server_connection *conn;
+
+	pthread_mutex_init(&local_bindings_mtx, NULL);
+
+	pthread_mutex_init(&blocking_pool.mtx, NULL);
+	pthread_cond_init(&blocking_pool.cond, NULL);
+	STAILQ_INIT(&blocking_pool.jobs);
+	blocking_pool.njobs = 0;
+	blocking_pool.nthreads = 0;
+	memcpy(&blocking_pool.once, &once_init, sizeof(once_init));
+
+	if (default_client) {
+		pthread_mutex_init(&default_client->lock, NULL);
+		SLIST_FOREACH(conn, &default_client->servers, sle)
+			prefork_reset_connection(conn);
+	}
+}
+
+/*
+ * Give a new worker a kqueue of its own that watches the listening sockets
+ * it shares with the other workers. Descriptors registered with a kqueue
+ * are not inherited, and with libkqueue the parent's would be shared.
+ */
+static int
+prefork_reset_server(struct ipc_server *server)
+{
+	struct service_binding *binding;
+	int wakeup = server->wakeup_registered;
+	int timer = server->timer_registered;
+	int rv;
+
+	(void) close(server->pollfd);
+	server->pollfd = kqueue();
+	if (server->pollfd < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("kqueue(2)");
+		return rv;
+	}
+	pthread_mutex_init(&server->waiting_mtx, NULL);
+
+	server->nchanges = 0;
+	server->wakeup_registered = 0;
+	server->timer_registered = 0;
+	server->npaused = 0;
+	LIST_FOREACH(binding, &server->bindings, entries) {
+		binding->paused = 0;
+		if (binding->listenfd < 0)
+			continue;
+		rv = server_add_change(server, binding->listenfd, EVFILT_READ,
+				EV_ADD | EV_ENABLE, binding);
+		if (rv < 0)
+			return rv;
+	}
+	if (wakeup && (rv = server_register_wakeup(server)) < 0)
+		return rv;
+	if (timer && (rv = server_register_timer(server)) < 0)
+		return rv;
+	return server_commit_changes(server);
+}
+
+/*
+ * Start a worker. Returns its pid in the supervisor, 0 in the worker, or a
+ * negative error code.
+ */
+static int
+prefork_spawn(struct ipc_server *server, struct prefork_worker *worker,
+		const struct sigaction *old_term, const struct sigaction *old_int)
+{
+	pid_t supervisor = getpid();
+	pid_t pid;
+	int rv;
+
+	pid = fork();
+	if (pid < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("fork(2)");
+		return rv;
+	}
+	if (pid > 0) {
+		worker->pid = pid;
+		worker->started = monotonic_ns();
+		/* The signal handler may have missed a worker started just now */
+		if (prefork_stopping)
+			(void) kill(pid, SIGTERM);
+		log_info("started worker %d", (int) pid);
+		return pid;
+	}
+
+	(void) sigaction(SIGTERM, old_term, NULL);
+	(void) sigaction(SIGINT, old_int, NULL);
+	free(prefork_workers);
+	prefork_workers = NULL;
+	prefork_nworkers = 0;
+
+#ifdef __linux__
+	/* Do not outlive the supervisor */
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM) < 0)
+		log_errno("prctl(2)");
+	if (getppid() != supervisor)
+		_exit(EXIT_FAILURE);
+#else
+	(void) supervisor;
+#endif
 
-	rv = get_statedir(domain, statedir, sizeof(statedir));
+	prefork_reset_library();
+	rv = prefork_reset_server(server);
 	if (rv < 0) {
-		log_error("unable to get statedir");
+		log_error("worker %d is unable to watch its sockets", (int) getpid());
 		return rv;
 	}
+	return 0;
+}
+
+int VISIBLE
+ipc_server_prefork(struct ipc_server *server, int nworkers)
+{
+	struct sigaction sa, old_term, old_int;
+	struct prefork_worker *worker;
+	struct timespec delay;
+	uint64_t uptime;
+	int status;
+	int alive = 0;
+	int error = 0;
+	int rv = 1;
+	int i;
+	pid_t pid;
+
+	if (!server || nworkers <= 0 || prefork_workers ||
+			LIST_EMPTY(&server->bindings) || !LIST_EMPTY(&server->clients)) {
+		log_error("the server must be bound, and not yet dispatching, to prefork");
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+	prefork_workers = calloc(nworkers, sizeof(*prefork_workers));
+	if (!prefork_workers)
+		return -IPC_ERROR_NO_MEMORY;
+	prefork_nworkers = nworkers;
+	prefork_stopping = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = prefork_signal;
+	sigemptyset(&sa.sa_mask);
+	(void) sigaction(SIGTERM, &sa, &old_term);
+	(void) sigaction(SIGINT, &sa, &old_int);
+
+	for (i = 0; i < nworkers && !prefork_stopping; i++) {
+		rv = prefork_spawn(server, &prefork_workers[i], &old_term, &old_int);
+		if (rv <= 0)
+			break;
+		alive++;
+	}
+	if (rv == 0 || (rv < 0 && alive == 0)) {
+		if (rv < 0) {
+			free(prefork_workers);
+			prefork_workers = NULL;
+			prefork_nworkers = 0;
+			(void) sigaction(SIGTERM, &old_term, NULL);
+			(void) sigaction(SIGINT, &old_int, NULL);
+		}
+		return rv;
+	}
+	if (rv < 0) {
+		error = rv;
+		prefork_signal(SIGTERM);
+	}
+	log_info("supervising %d workers", alive);
+
+	while (alive > 0) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			log_errno("waitpid(2)");
+			break;
+		}
+		worker = NULL;
+		for (i = 0; i < nworkers && !worker; i++) {
+			if (prefork_workers[i].pid == pid)
+				worker = &prefork_workers[i];
+		}
+		if (!worker)
+			continue;
+		worker->pid = 0;
+		alive--;
+
+		if (prefork_stopping || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+			log_info("worker %d has exited", (int) pid);
+			continue;
+		}
+		if (WIFSIGNALED(status))
+			log_warning("worker %d was killed by signal %d", (int) pid, WTERMSIG(status));
+		else
+			log_warning("worker %d exited with status %d", (int) pid, WEXITSTATUS(status));
+
+		uptime = monotonic_ns() - worker->started;
+		if (uptime < PREFORK_RESPAWN_DELAY_NSEC) {
+			ns_to_timespec(PREFORK_RESPAWN_DELAY_NSEC - uptime, &delay);
+			while (nanosleep(&delay, &delay) < 0 && errno == EINTR && !prefork_stopping)
+				;
+			if (prefork_stopping)
+				continue;
+		}
+		rv = prefork_spawn(server, worker, &old_term, &old_int);
+		if (rv == 0)
+			return 0;
+		if (rv > 0)
+			alive++;
+	}
+
+	(void) sigaction(SIGTERM, &old_term, NULL);
+	(void) sigaction(SIGINT, &old_int, NULL);
+	free(prefork_workers);
+	prefork_workers = NULL;
+	prefork_nworkers = 0;
+	log_info("all workers have exited");
+	return error ? error : 1;
+}
+
+/* Open a connection to the server; called with both locks held, or before the session is shared */
+static int
+server_connection_dial(struct server_connection *conn)
+{
+	int one = 1;
+	int fd;
+	int rv;
+
+	fd = socket(conn->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("socket(2)");
+		return rv;
+	}
+
+	/* Requests are written in one piece, so there is nothing to wait for */
+	if (conn->addr.ss_family != AF_LOCAL &&
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("setsockopt(2)");
+		(void) close(fd);
+		return rv;
+	}
+
+	if (connect(fd, (struct sockaddr *) &conn->addr, conn->addrlen) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("connect(2) to `%s'", conn->service);
+		(void) close(fd);
+		return rv;
+	}
+	conn->fd = fd;
+	conn->generation++;
+	conn->last_used = monotonic_ns();
+
+	log_debug("service `%s' connected to fd %d", conn->service, fd);
+	return 0;
+}
+
+/*
+ * Connect to the server. A service in the directory gets one of its
+ * endpoints, chosen by weight, and the others are tried in turn if it
+ * cannot be reached.
+ */
+static int
+server_connection_open(struct server_connection *conn)
+{
+	struct directory_endpoint endpoints[DIRECTORY_ENDPOINT_MAX];
+	char address[PATH_MAX];
+	int count, first, i;
+	int rv;
+
+	if (conn->adopted)
+		return -IPC_ERROR_CONNECTION_FAILED;
+	if (!conn->in_directory)
+		return server_connection_dial(conn);
+
+	count = directory_lookup(conn->service, endpoints, DIRECTORY_ENDPOINT_MAX);
+	if (count == 0)
+		return -IPC_ERROR_NAME_INVALID;
+	first = directory_pick(endpoints, count);
+	rv = -IPC_ERROR_CONNECTION_FAILED;
+	for (i = 0; i < count; i++) {
+		const struct directory_endpoint *ep = &endpoints[(first + i) % count];
+
+		if (ep->addrlen >= sizeof(address)) {
+			rv = -IPC_ERROR_NAME_TOO_LONG;
+			continue;
+		}
+		memcpy(address, ep->address, ep->addrlen);
+		address[ep->addrlen] = '\0';
+		rv = parse_address(address, &conn->addr, &conn->addrlen);
+		if (rv < 0)
+			continue;
+		if (conn->avoidlen > 0 && conn->avoidlen == conn->addrlen &&
+				memcmp(&conn->avoid, &conn->addr, conn->addrlen) == 0) {
+			rv = -IPC_ERROR_CONNECTION_FAILED;
+			continue;
+		}
+		rv = server_connection_dial(conn);
+		if (rv == 0) {
+			log_debug("service `%s' is at %s", conn->service, address);
+			return 0;
+		}
+	}
+	return rv;
+}
+
+/*
+ * Find the address of a service: the one given, or else its entry in the
+ * service directory, or else the one from its interface definition, or else
+ * its name in the statedir of the domain.
+ */
+static int
+server_connection_resolve(struct server_connection *conn, const char *address)
+{
+	struct sockaddr_un *sock = (struct sockaddr_un *) &conn->addr;
+	struct directory_endpoint endpoint;
+	char statedir[PATH_MAX];
+	int len;
+	int rv;
+
+	if (!address && directory_lookup(conn->service, &endpoint, 1) > 0) {
+		conn->in_directory = 1;
+		return 0;
+	}
+	if (!address)
+		address = lookup_address(conn->stub_dlh, conn->libname);
+	if (address)
+		return parse_address(address, &conn->addr, &conn->addrlen);
+
+	rv = get_statedir(conn->domain, statedir, sizeof(statedir));
+	if (rv < 0)
+		return rv;
+
+	memset(&conn->addr, 0, sizeof(conn->addr));
+	sock->sun_family = AF_LOCAL;
+	len = snprintf(sock->sun_path, sizeof(sock->sun_path),
+			"%s/services/%s", statedir, conn->service);
+	if (len >= sizeof(sock->sun_path))
+		return -IPC_ERROR_NAME_TOO_LONG;
+	if (len < 0)
+		return IPC_CAPTURE_ERRNO;
+	conn->addrlen = SUN_LEN(sock);
+	return 0;
+}
+
+static struct ipc_session *
+client_connect(struct ipc_client *client, int domain, const char *service,
+		const char *address, int *error)
+{
+	struct server_connection *conn = NULL;
+	int rv = 0;
+
+	if (!client) {
+		pthread_once(&default_client_once, default_client_init);
+		client = default_client;
+		if (!client) {
+			if (error)
+				*error = -IPC_ERROR_NO_MEMORY;
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&client->lock);
+
+	/* Check if we already have a cached entry to the service */
+	SLIST_FOREACH(conn, &client->servers, sle) {
+		if (conn->domain == domain && strcmp(conn->service, service) == 0) {
+			pthread_mutex_unlock(&client->lock);
+			return ((struct ipc_session *) conn);
+		}
+	}
+
+	rv = validate_service_name(service);
+	if (rv < 0) {
+		goto err_out;
+	}
+
+	conn = server_connection_new(service);
+	if (!conn) {
+		rv = -IPC_ERROR_NO_MEMORY;
+		goto err_out;
+	}
+	conn->domain = domain;
+
+	rv = server_connection_find_local(conn);
+	if (rv < 0) {
+		goto err_out;
+	}
+	if (rv == 1)
+		goto out;
+
+	rv = server_connection_load_stub(conn);
+	if (rv < 0) {
+		log_error("unable to load the stub library");
+		goto err_out;
+	}
+
+	rv = server_connection_load_policies(conn);
+	if (rv < 0) {
+		goto err_out;
+	}
+
+	rv = server_connection_resolve(conn, address);
+	if (rv < 0) {
+		goto err_out;
+	}
+
+	/* If calls can be retried or spooled, the first one connects when the server is back */
+	rv = server_connection_open(conn);
+	if (rv < 0 && conn->npolicies == 0) {
+		goto err_out;
+	}
+
+out:
+	SLIST_INSERT_HEAD(&client->servers, conn, sle);
+	pthread_mutex_unlock(&client->lock);
+	return (struct ipc_session *) conn;
+
+err_out:
+	client->last_error = rv;
+	if (error)
+		*error = rv;
+	pthread_mutex_unlock(&client->lock);
+	server_connection_free(conn);
+	return NULL;
+}
+
+struct ipc_session VISIBLE *
+ipc_client_connect(struct ipc_client *client, int domain, const char *service)
+{
+	return client_connect(client, domain, service, NULL, NULL);
+}
+
+struct ipc_session VISIBLE *
+ipc_client_connect_address(struct ipc_client *client, const char *address, const char *service)
+{
+	return client_connect(client, DOMAIN_ADDRESS, service, address, NULL);
+}
+
+struct ipc_session VISIBLE *
+ipc_session_from_fd(struct ipc_client *client, int domain, const char *service, int fd)
+{
+	struct server_connection *conn, *other;
+	int rv;
+
+	if (!client) {
+		pthread_once(&default_client_once, default_client_init);
+		client = default_client;
+		if (!client) {
+			return NULL;
+		}
+	}
+
+	rv = (fd < 0) ? -IPC_ERROR_ARGUMENT_INVALID : validate_service_name(service);
+	if (rv < 0) {
+		client->last_error = rv;
+		return NULL;
+	}
+
+	conn = server_connection_new(service);
+	if (!conn) {
+		client->last_error = -IPC_ERROR_NO_MEMORY;
+		return NULL;
+	}
+	conn->domain = domain;
+
+	rv = server_connection_load_stub(conn);
+	if (rv == 0)
+		rv = server_connection_load_policies(conn);
+	if (rv < 0) {
+		log_error("unable to load the stub library");
+		client->last_error = rv;
+		server_connection_free(conn);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&client->lock);
+	SLIST_FOREACH(other, &client->servers, sle) {
+		if (other->domain == domain && strcmp(other->service, service) == 0) {
+			pthread_mutex_unlock(&client->lock);
+			log_error("the client already has a session to `%s'", service);
+			client->last_error = -IPC_ERROR_ARGUMENT_INVALID;
+			server_connection_free(conn);
+			return NULL;
+		}
+	}
+	conn->fd = fd;
+	conn->generation = 1;
+	conn->adopted = 1;
+	conn->last_used = monotonic_ns();
+	SLIST_INSERT_HEAD(&client->servers, conn, sle);
+	pthread_mutex_unlock(&client->lock);
+
+	log_debug("service `%s' is on inherited fd %d", service, fd);
+	return (struct ipc_session *) conn;
+}
+
+/*
+ * Watches the services directory of a domain, so that a client waiting for
+ * a service can try again as soon as a socket appears there.
+ */
+struct service_watch {
+	int fd; /** An inotify(7) instance or a kqueue, or -1 if there is no watch */
+	int dirfd; /** The directory, for EVFILT_VNODE */
+};
+
+static void
+service_watch_open(struct service_watch *watch, int domain)
+{
+	char statedir[PATH_MAX];
+	char path[PATH_MAX];
+	int len;
+#ifndef __linux__
+	struct kevent kev;
+#endif
+
+	watch->fd = -1;
+	watch->dirfd = -1;
+	if (get_statedir(domain, statedir, sizeof(statedir)) < 0)
+		return;
+	len = snprintf(path, sizeof(path), "%s/services", statedir);
+	if (len >= sizeof(path) || len < 0)
+		return;
+
+#ifdef __linux__
+	/* libkqueue does not report new entries in a directory, so use inotify directly */
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		log_errno("inotify_init1(2)");
+		return;
+	}
+	if (inotify_add_watch(watch->fd, path, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+		log_errno("inotify_add_watch(2) of %s", path);
+		(void) close(watch->fd);
+		watch->fd = -1;
+	}
+#else
+	watch->dirfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (watch->dirfd < 0) {
+		log_errno("open(2) of %s", path);
+		return;
+	}
+	watch->fd = kqueue();
+	EV_SET(&kev, watch->dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+	if (watch->fd < 0 || kevent(watch->fd, &kev, 1, NULL, 0, NULL) < 0) {
+		log_errno("kevent(2) on %s", path);
+		if (watch->fd >= 0)
+			(void) close(watch->fd);
+		(void) close(watch->dirfd);
+		watch->fd = -1;
+		watch->dirfd = -1;
+	}
+#endif
+}
+
+/* Wait for up to timeout_ms. Returns 1 if the directory changed, or 0 */
+static int
+service_watch_wait(struct service_watch *watch, int timeout_ms)
+{
+	struct pollfd pfd;
+#ifdef __linux__
+	char buf[4096];
+#else
+	static const struct timespec poll_only = { 0, 0 };
+	struct kevent kev;
+#endif
+
+	if (watch->fd < 0) {
+		(void) poll(NULL, 0, timeout_ms);
+		return 0;
+	}
+	pfd.fd = watch->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout_ms) <= 0)
+		return 0;
+#ifdef __linux__
+	while (read(watch->fd, buf, sizeof(buf)) > 0)
+		;
+#else
+	(void) kevent(watch->fd, NULL, 0, &kev, 1, &poll_only);
+#endif
+	return 1;
+}
+
+static void
+service_watch_close(struct service_watch *watch)
+{
+	if (watch->fd >= 0)
+		(void) close(watch->fd);
+	if (watch->dirfd >= 0)
+		(void) close(watch->dirfd);
+}
+
+/*
+ * Connect the shared client to a service, or dial the given address of it
+ * without keeping the connection. Returns 0 once it is connected, 1 if the
+ * server may not be up yet, or a negative error code.
+ */
+static int
+service_try_connect(int domain, const char *service, const char *address)
+{
+	struct server_connection *conn;
+	int rv = 0;
+
+	if (address) {
+		conn = server_connection_new(service);
+		if (!conn)
+			return -IPC_ERROR_NO_MEMORY;
+		conn->domain = DOMAIN_ADDRESS;
+		rv = parse_address(address, &conn->addr, &conn->addrlen);
+		if (rv == 0)
+			rv = server_connection_dial(conn);
+		server_connection_free(conn);
+	} else {
+		conn = (struct server_connection *) client_connect(NULL, domain, service,
+				NULL, &rv);
+		if (conn && !conn->local_dlh) {
+			/* A session whose calls can be retried exists even while the server is down */
+			pthread_mutex_lock(&conn->lock);
+			if (conn->fd < 0) {
+				pthread_mutex_lock(&conn->write_lock);
+				rv = server_connection_open(conn);
+				pthread_mutex_unlock(&conn->write_lock);
+			}
+			pthread_mutex_unlock(&conn->lock);
+		}
+	}
+	if (rv == -IPC_ERROR_CONNECTION_FAILED || rv == IPC_ERRNO(ENOENT) ||
+			rv == IPC_ERRNO(ECONNREFUSED))
+		return 1;
+	return rv;
+}
+
+static int
+wait_for_service(int domain, const char *service, const char *address, int timeout_ms)
+{
+	struct service_watch watch;
+	uint64_t deadline = 0;
+	uint64_t now;
+	int retry_ms = WAIT_RETRY_MIN_MS;
+	int wait_ms;
+	int rv;
+
+	rv = service_try_connect(domain, service, address);
+	if (rv <= 0)
+		return rv;
+
+	log_debug("waiting for service `%s'", service);
+	service_watch_open(&watch, domain);
+	if (timeout_ms >= 0)
+		deadline = monotonic_ns() + (uint64_t) timeout_ms * 1000000;
+	for (;;) {
+		/* The socket may have appeared before the watch was set up */
+		rv = service_try_connect(domain, service, address);
+		if (rv <= 0)
+			break;
+		wait_ms = retry_ms;
+		if (timeout_ms >= 0) {
+			now = monotonic_ns();
+			if (now >= deadline) {
+				rv = -IPC_ERROR_TIMED_OUT;
+				break;
+			}
+			wait_ms = MIN(wait_ms, (deadline - now + 999999) / 1000000);
+		}
+		/*
+		 * A server binds its socket before it listens on it, so connecting
+		 * can still fail right after the socket appears. Keep trying, less
+		 * often as time goes by; the watch only makes it sooner.
+		 */
+		if (service_watch_wait(&watch, wait_ms))
+			retry_ms = WAIT_RETRY_MIN_MS;
+		else
+			retry_ms = MIN(retry_ms * 2, WAIT_RETRY_MAX_MS);
+	}
+	service_watch_close(&watch);
+	return rv;
+}
+
+int VISIBLE
+ipc_client_wait_for_service(int domain, const char *service, int timeout_ms)
+{
+	return wait_for_service(domain, service, NULL, timeout_ms);
+}
+
+int VISIBLE
+ipc_client_wait_for_address(const char *address, const char *service, int timeout_ms)
+{
+	return wait_for_service(DOMAIN_ADDRESS, service, address, timeout_ms);
+}
+
+/*
+ * Write all of a request, without raising SIGPIPE if the server has gone away.
+ * If passfd is not -1, the descriptor is passed along with the first byte.
+ */
+static int
+send_all(int fd, struct iovec *iov, int iovcnt, int passfd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	ssize_t bytes;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if (passfd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), &passfd, sizeof(passfd));
+	}
+	while (msg.msg_iovlen > 0) {
+		bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return IPC_CAPTURE_ERRNO;
+		}
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while (msg.msg_iovlen > 0 && (size_t) bytes >= msg.msg_iov->iov_len) {
+			bytes -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + bytes;
+			msg.msg_iov->iov_len -= bytes;
+		}
+	}
+	return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+	ssize_t bytes;
+	size_t pos = 0;
+
+	while (pos < len) {
+		bytes = read(fd, (char *) buf + pos, len - pos);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return IPC_CAPTURE_ERRNO;
+		}
+		if (bytes == 0)
+			return -IPC_ERROR_CONNECTION_FAILED;
+		pos += bytes;
+	}
+	return 0;
+}
+
+/* Read the next response from the server */
+static int
+read_response(int fd, struct ipc_message *response, char **body)
+{
+	int rv;
+
+	*body = NULL;
+	rv = read_all(fd, response, sizeof(*response));
+	if (rv < 0)
+		return rv;
+	/* Files returned by the server can take it over IPC_MESSAGE_SIZE_MAX */
+	rv = message_validate(response, RESPONSE_SIZE_MAX);
+	if (rv < 0)
+		return rv;
+	if (response->_ipc_bufsz == 0)
+		return 0;
+
+	*body = malloc(response->_ipc_bufsz);
+	if (!*body)
+		return -IPC_ERROR_NO_MEMORY;
+	rv = read_all(fd, *body, response->_ipc_bufsz);
+	if (rv < 0) {
+		free(*body);
+		*body = NULL;
+	}
+	return rv;
+}
+
+/*
+ * Give up on a connection, and fail every call waiting on it. The next call
+ * opens a new one. Called with conn->lock held.
+ */
+static void
+server_connection_fail(struct server_connection *conn, int fd, int error)
+{
+	struct pending_call *call;
+
+	pthread_mutex_lock(&conn->write_lock);
+	if (conn->fd == fd) {
+		log_error("connection to `%s' failed: %s", conn->service, ipc_strerror(error));
+		/* Wake up the reading thread, which closes the descriptor once it is done */
+		(void) shutdown(fd, SHUT_RDWR);
+		if (conn->reading)
+			conn->stale_fd = fd;
+		else
+			(void) close(fd);
+		conn->fd = -1;
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	LIST_FOREACH(call, &conn->pending, entries) {
+		if (call->fd == fd && !call->done) {
+			call->done = 1;
+			call->error = error;
+		}
+	}
+	pthread_cond_broadcast(&conn->cond);
+}
+
+static uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+/*
+ * Servers close connections that have been idle for a while, so make sure
+ * that one is still open before using it again. Keepalives and late
+ * responses are read and discarded along the way. Called with conn->lock
+ * held, when no calls are waiting and nobody is reading.
+ */
+static void
+server_connection_check(struct server_connection *conn)
+{
+	struct ipc_message header;
+	struct pollfd pfd;
+	char *buf;
+	ssize_t bytes;
+
+	pfd.fd = conn->fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0) {
+		bytes = recv(conn->fd, &header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+		if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (bytes > 0 && bytes < sizeof(header))
+			return;
+		if (bytes <= 0 || read_response(conn->fd, &header, &buf) < 0) {
+			log_debug("connection to `%s' was closed by the server; reconnecting",
+					conn->service);
+			pthread_mutex_lock(&conn->write_lock);
+			(void) close(conn->fd);
+			conn->fd = -1;
+			pthread_mutex_unlock(&conn->write_lock);
+			return;
+		}
+		free(buf);
+	}
+}
+
+/*
+ * Make sure that the session has an open connection before sending on it.
+ * Called with conn->lock held.
+ */
+static int
+server_connection_ready(struct server_connection *conn)
+{
+	uint64_t now;
+	int rv = 0;
+
+	now = monotonic_ns();
+	if (conn->fd >= 0 && LIST_EMPTY(&conn->pending) && !conn->reading &&
+			now - conn->last_used >= CONNECTION_CHECK_NSEC)
+		server_connection_check(conn);
+	conn->last_used = now;
+	if (conn->fd < 0) {
+		pthread_mutex_lock(&conn->write_lock);
+		rv = server_connection_open(conn);
+		pthread_mutex_unlock(&conn->write_lock);
+	}
+	return rv;
+}
+
+/*
+ * Send a request, and add it to the calls waiting for a response. Returns a
+ * negative error code if the server could not be reached, in which case the
+ * call is not added.
+ */
+static int
+pending_call_start(struct server_connection *conn, struct pending_call *call,
+		struct iovec *request, int iovcnt, struct ipc_message *response)
+{
+	int fd, passfd;
+	int rv;
+
+	memset(call, 0, sizeof(*call));
+	call->response = response;
+
+	pthread_mutex_lock(&conn->lock);
+	rv = server_connection_ready(conn);
+	if (rv < 0) {
+		pthread_mutex_unlock(&conn->lock);
+		return rv;
+	}
+	fd = conn->fd;
+	call->fd = fd;
+	do {
+		call->id = ++conn->next_id;
+	} while (call->id == 0 || call->id == IPC_ID_ONEWAY);
+	LIST_INSERT_HEAD(&conn->pending, call, entries);
+	pthread_mutex_unlock(&conn->lock);
+
+	pthread_mutex_lock(&conn->write_lock);
+	if (conn->fd == fd) {
+		/* Responses are matched to requests by their ID */
+		((struct ipc_message *) request[0].iov_base)->_ipc_id = call->id;
+		/* The first request on a connection hands the server the buffer pool */
+		passfd = -1;
+		if (conn->pool.fd >= 0 && conn->pool_generation != conn->generation &&
+				conn->addr.ss_family != AF_INET && conn->addr.ss_family != AF_INET6)
+			passfd = conn->pool.fd;
+		rv = send_all(fd, request, iovcnt, passfd);
+		if (rv == 0 && passfd >= 0)
+			conn->pool_generation = conn->generation;
+	} else {
+		rv = -IPC_ERROR_CONNECTION_FAILED;
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	if (rv < 0) {
+		pthread_mutex_lock(&conn->lock);
+		server_connection_fail(conn, fd, rv);
+		pthread_mutex_unlock(&conn->lock);
+	}
+	return 0;
+}
+
+/*
+ * Wait for the response to a call, until the deadline on the monotonic clock
+ * if there is one. One thread at a time reads responses, and hands them to
+ * their callers. Returns 1 once the call is done, or 0 if time ran out.
+ */
+static int
+pending_call_wait(struct server_connection *conn, struct pending_call *call,
+		const struct timespec *deadline)
+{
+	struct pending_call *cur;
+	struct ipc_message header;
+	struct pollfd pfd;
+	char *buf;
+	int fd = call->fd;
+	int done;
+	int rv;
+
+	pthread_mutex_lock(&conn->lock);
+	while (!call->done) {
+		if (conn->reading) {
+			if (!deadline)
+				pthread_cond_wait(&conn->cond, &conn->lock);
+			else if (pthread_cond_timedwait(&conn->cond, &conn->lock, deadline) == ETIMEDOUT)
+				break;
+			continue;
+		}
+		conn->reading = 1;
+		pthread_mutex_unlock(&conn->lock);
+		rv = 1;
+		if (deadline) {
+			uint64_t now = monotonic_ns();
+			uint64_t until = (uint64_t) deadline->tv_sec * NSEC_PER_SEC + deadline->tv_nsec;
+
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			rv = poll(&pfd, 1, until > now ? (until - now + 999999) / 1000000 : 0);
+		}
+		if (rv != 0)
+			rv = read_response(fd, &header, &buf);
+		else
+			rv = 1;
+		pthread_mutex_lock(&conn->lock);
+		conn->reading = 0;
+		if (conn->stale_fd == fd) {
+			(void) close(fd);
+			conn->stale_fd = -1;
+		}
+		if (rv == 1) {
+			/* Nothing arrived in time; let another thread read */
+			pthread_cond_broadcast(&conn->cond);
+			break;
+		}
+		if (rv < 0) {
+			server_connection_fail(conn, fd, rv);
+			break;
+		}
+		LIST_FOREACH(cur, &conn->pending, entries) {
+			if (cur->id == header._ipc_id && !cur->done)
+				break;
+		}
+		if (cur) {
+			memcpy(cur->response, &header, sizeof(header));
+			cur->body = buf;
+			cur->done = 1;
+		} else {
+			/* Such as the slower half of a hedged call */
+			log_debug("discarding a response to call %u, which is no longer waiting",
+					header._ipc_id);
+			free(buf);
+		}
+		pthread_cond_broadcast(&conn->cond);
+	}
+	done = call->done;
+	pthread_mutex_unlock(&conn->lock);
+	return done;
+}
+
+/* Stop waiting for a call, and return its result */
+static int
+pending_call_finish(struct server_connection *conn, struct pending_call *call, char **body)
+{
+	pthread_mutex_lock(&conn->lock);
+	LIST_REMOVE(call, entries);
+	pthread_mutex_unlock(&conn->lock);
+
+	if (call->error < 0) {
+		*body = NULL;
+		return call->error;
+	}
+	*body = call->body;
+	return 0;
+}
+
+/* Give up on a call; any response that arrives later is discarded */
+static void
+pending_call_cancel(struct server_connection *conn, struct pending_call *call)
+{
+	pthread_mutex_lock(&conn->lock);
+	LIST_REMOVE(call, entries);
+	if (call->done)
+		free(call->body);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static int
+session_call(struct server_connection *conn, struct iovec *request, int iovcnt,
+		struct ipc_message *response, char **body)
+{
+	struct pending_call call;
+	int rv;
+
+	rv = pending_call_start(conn, &call, request, iovcnt, response);
+	if (rv < 0)
+		return rv;
+	(void) pending_call_wait(conn, &call, NULL);
+	return pending_call_finish(conn, &call, body);
+}
+
+static struct method_policy *
+server_connection_policy(struct server_connection *conn, uint32_t method)
+{
+	int i;
+
+	for (i = 0; i < conn->npolicies; i++) {
+		if (conn->policies[i].method == method)
+			return &conn->policies[i];
+	}
+	return NULL;
+}
+
+static int
+compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* The 95th percentile of recent latencies, or 0 if too few are known */
+static uint64_t
+method_policy_p95(struct server_connection *conn, struct method_policy *policy)
+{
+	uint64_t sorted[LATENCY_SAMPLES];
+	unsigned int n;
+
+	pthread_mutex_lock(&conn->lock);
+	n = policy->nsamples < LATENCY_SAMPLES ? policy->nsamples : LATENCY_SAMPLES;
+	memcpy(sorted, policy->latency, n * sizeof(uint64_t));
+	pthread_mutex_unlock(&conn->lock);
+
+	if (n < HEDGE_MIN_SAMPLES)
+		return 0;
+	qsort(sorted, n, sizeof(uint64_t), compare_latency);
+	return sorted[(n * 95 + 99) / 100 - 1];
+}
+
+static void
+method_policy_record(struct server_connection *conn, struct method_policy *policy,
+		uint64_t latency)
+{
+	pthread_mutex_lock(&conn->lock);
+	policy->latency[policy->nsamples++ % LATENCY_SAMPLES] = latency;
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Get a connection to a replica of the service other than the one that conn
+ * is connected to. Replicas come from the service directory.
+ */
+static struct server_connection *
+server_connection_hedge(struct server_connection *conn)
+{
+	struct server_connection *hedge;
+
+	if (!conn->in_directory)
+		return NULL;
+
+	pthread_mutex_lock(&conn->lock);
+	if (!conn->hedge) {
+		conn->hedge = server_connection_new(conn->service);
+		if (conn->hedge) {
+			conn->hedge->domain = conn->domain;
+			conn->hedge->in_directory = 1;
+		}
+	}
+	hedge = conn->hedge;
+	if (hedge) {
+		pthread_mutex_lock(&hedge->lock);
+		if (hedge->fd < 0) {
+			memcpy(&hedge->avoid, &conn->addr, sizeof(hedge->avoid));
+			hedge->avoidlen = conn->addrlen;
+		}
+		pthread_mutex_unlock(&hedge->lock);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return hedge;
+}
+
+/*
+ * Make a call, and if it has not been answered by the 95th percentile of the
+ * method's latency, send it again to another replica. Whichever response
+ * arrives first is used.
+ */
+static int
+session_call_hedged(struct server_connection *conn, struct method_policy *policy,
+		struct iovec *request, int iovcnt, struct ipc_message *response, char **body)
+{
+	struct server_connection *hedge;
+	struct pending_call first, second;
+	struct ipc_message second_response;
+	struct timespec deadline;
+	uint64_t delay;
+	int rv;
+
+	delay = method_policy_p95(conn, policy);
+	if (delay == 0)
+		return session_call(conn, request, iovcnt, response, body);
+
+	rv = pending_call_start(conn, &first, request, iovcnt, response);
+	if (rv < 0)
+		return rv;
+	ns_to_timespec(monotonic_ns() + delay, &deadline);
+	if (pending_call_wait(conn, &first, &deadline))
+		return pending_call_finish(conn, &first, body);
+
+	hedge = server_connection_hedge(conn);
+	if (!hedge || pending_call_start(hedge, &second, request, iovcnt, &second_response) < 0) {
+		(void) pending_call_wait(conn, &first, NULL);
+		return pending_call_finish(conn, &first, body);
+	}
+	log_debug("hedging call to method %u of `%s' after %llu ns", policy->method,
+			conn->service, (unsigned long long) delay);
+
+	/* Take the first response, or the other one if a connection fails */
+	for (;;) {
+		ns_to_timespec(monotonic_ns() + HEDGE_POLL_NSEC, &deadline);
+		if (pending_call_wait(conn, &first, &deadline) &&
+				(first.error == 0 || second.done)) {
+			pending_call_cancel(hedge, &second);
+			return pending_call_finish(conn, &first, body);
+		}
+		ns_to_timespec(monotonic_ns() + HEDGE_POLL_NSEC, &deadline);
+		if (pending_call_wait(hedge, &second, &deadline) &&
+				(second.error == 0 || first.done)) {
+			pending_call_cancel(conn, &first);
+			rv = pending_call_finish(hedge, &second, body);
+			if (rv == 0)
+				memcpy(response, &second_response, sizeof(*response));
+			return rv;
+		}
+	}
+}
+
+/*
+ * Decide whether a call may be sent. If the breaker has been open long
+ * enough, the call is sent as a probe, and *probe is set.
+ */
+static int
+breaker_admit(struct server_connection *conn, int *probe)
+{
+	struct circuit_breaker *b = &conn->breaker;
+	int rv = 0;
+
+	*probe = 0;
+	pthread_mutex_lock(&conn->lock);
+	/* A probe that hangs is given up on, and another one is sent */
+	if (b->state != BREAKER_CLOSED && monotonic_ns() >= b->reopen) {
+		log_debug("probing `%s'", conn->service);
+		b->state = BREAKER_HALF_OPEN;
+		b->reopen = monotonic_ns() + BREAKER_OPEN_NSEC;
+		*probe = 1;
+	} else if (b->state != BREAKER_CLOSED) {
+		rv = -IPC_ERROR_UNAVAILABLE;
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return rv;
+}
+
+static void
+breaker_record(struct server_connection *conn, int probe, int failed)
+{
+	struct circuit_breaker *b = &conn->breaker;
+	unsigned int nfailures;
+
+	pthread_mutex_lock(&conn->lock);
+	if (probe) {
+		if (failed) {
+			b->state = BREAKER_OPEN;
+			b->reopen = monotonic_ns() + BREAKER_OPEN_NSEC;
+		} else {
+			log_notice("`%s' has recovered", conn->service);
+			memset(b, 0, sizeof(*b));
+		}
+	} else if (b->state == BREAKER_CLOSED) {
+		b->outcomes = ((b->outcomes << 1) | (failed ? 1 : 0)) & ((1U << BREAKER_WINDOW) - 1);
+		if (b->ncalls < BREAKER_WINDOW)
+			b->ncalls++;
+		nfailures = __builtin_popcount(b->outcomes);
+		if (b->ncalls >= BREAKER_MIN_CALLS &&
+				nfailures * 100 >= b->ncalls * BREAKER_FAILURE_PCT) {
+			log_warning("%u of the last %u calls to `%s' failed; not sending calls for a while",
+					nfailures, b->ncalls, conn->service);
+			b->state = BREAKER_OPEN;
+			b->reopen = monotonic_ns() + BREAKER_OPEN_NSEC;
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/* Wait before trying a call again, for a random time that grows with each try */
+static void
+backoff_sleep(int attempt)
+{
+	static __thread unsigned int seed;
+	struct timespec ts;
+	uint64_t max, ns;
+
+	if (seed == 0)
+		seed = (unsigned int) (getpid() ^ monotonic_ns() ^ (uintptr_t) &ts);
+	max = BACKOFF_MIN_NSEC;
+	while (attempt-- > 0 && max < BACKOFF_MAX_NSEC)
+		max *= 2;
+	if (max > BACKOFF_MAX_NSEC)
+		max = BACKOFF_MAX_NSEC;
+	ns = (uint64_t) rand_r(&seed) * max / ((uint64_t) RAND_MAX + 1);
+	ns_to_timespec(ns, &ts);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+int VISIBLE
+ipc_session_call(struct ipc_session *session, struct iovec *request, int iovcnt,
+		struct ipc_message *response, char **body)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	struct ipc_message *header = (struct ipc_message *) request[0].iov_base;
+	struct method_policy *policy;
+	uint64_t start, elapsed;
+	int attempt, probe;
+	int rv;
+
+	*body = NULL;
+	policy = server_connection_policy(conn, header->_ipc_method);
+
+	/* Calls to idempotent methods can be sent again if anything goes wrong */
+	for (attempt = 0; ; attempt++) {
+		rv = breaker_admit(conn, &probe);
+		if (rv < 0)
+			return rv;
+
+		start = monotonic_ns();
+		if (policy && (policy->flags & IPC_POLICY_HEDGE))
+			rv = session_call_hedged(conn, policy, request, iovcnt, response, body);
+		else
+			rv = session_call(conn, request, iovcnt, response, body);
+		elapsed = monotonic_ns() - start;
+
+		/* An overloaded server counts as a failure, but a rejected call does not */
+		breaker_record(conn, probe, rv < 0 || elapsed > BREAKER_SLOW_NSEC ||
+				response->_ipc_status == -IPC_ERROR_BUSY);
+		if (rv == 0) {
+			if (policy)
+				method_policy_record(conn, policy, elapsed);
+			return 0;
+		}
+		if (!policy || rv == -IPC_ERROR_NO_MEMORY || attempt >= policy->retries)
+			return rv;
+		log_debug("retrying call to method %u of `%s': %s", policy->method,
+				conn->service, ipc_strerror(rv));
+		backoff_sleep(attempt);
+	}
+}
+
+int VISIBLE
+ipc_session_send(struct ipc_session *session, struct iovec *request, int iovcnt)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	struct session_spool *sp = conn->spool;
+	int fd;
+	int rv;
+
+	((struct ipc_message *) request[0].iov_base)->_ipc_id = IPC_ID_ONEWAY;
+
+	if (sp) {
+		pthread_mutex_lock(&sp->lock);
+		rv = spool_append(&sp->ring, request, iovcnt);
+		if (rv == 0)
+			pthread_cond_broadcast(&sp->cond);
+		pthread_mutex_unlock(&sp->lock);
+		return rv;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	rv = server_connection_ready(conn);
+	fd = conn->fd;
+	pthread_mutex_unlock(&conn->lock);
+	if (rv < 0)
+		return rv;
+
+	pthread_mutex_lock(&conn->write_lock);
+	if (conn->fd == fd)
+		rv = send_all(fd, request, iovcnt, -1);
+	else
+		rv = -IPC_ERROR_CONNECTION_FAILED;
+	pthread_mutex_unlock(&conn->write_lock);
+
+	if (rv < 0) {
+		pthread_mutex_lock(&conn->lock);
+		server_connection_fail(conn, fd, rv);
+		pthread_mutex_unlock(&conn->lock);
+	}
+	return rv;
+}
+
+/* Whether a server turned a call away without running it, so it can be sent again */
+static int
+spool_call_rejected(int status)
+{
+	return status == -IPC_ERROR_BUSY || status == -IPC_ERROR_LIMIT_EXCEEDED ||
+		status == -IPC_ERROR_RATE_LIMITED || status == -IPC_ERROR_TIMED_OUT;
+}
+
+/*
+ * Send a batch of spooled calls in one write, each with an ID so that the
+ * server answers it, and wait for the answers. Returns the length of the
+ * calls at the start of the batch that the server ran, which can be taken
+ * out of the spool; the rest are sent again later.
+ */
+static size_t
+session_spool_send(struct server_connection *conn, char *batch, size_t len, int count)
+{
+	struct pending_call *calls;
+	struct ipc_message *responses;
+	struct ipc_message header;
+	struct iovec iov;
+	size_t done = 0;
+	char *pos, *body;
+	int failed = 0;
+	int fd, i;
+	int rv;
+
+	calls = calloc(count, sizeof(*calls));
+	responses = calloc(count, sizeof(*responses));
+	if (!calls || !responses) {
+		free(calls);
+		free(responses);
+		return 0;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	rv = server_connection_ready(conn);
+	if (rv < 0) {
+		pthread_mutex_unlock(&conn->lock);
+		free(calls);
+		free(responses);
+		return 0;
+	}
+	fd = conn->fd;
+	pos = batch;
+	for (i = 0; i < count; i++) {
+		calls[i].response = &responses[i];
+		calls[i].fd = fd;
+		do {
+			calls[i].id = ++conn->next_id;
+		} while (calls[i].id == 0 || calls[i].id == IPC_ID_ONEWAY);
+		/* The ring has no alignment to speak of */
+		memcpy(&header, pos, sizeof(header));
+		header._ipc_id = calls[i].id;
+		memcpy(pos, &header, sizeof(header));
+		pos += sizeof(header) + header._ipc_bufsz;
+		LIST_INSERT_HEAD(&conn->pending, &calls[i], entries);
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	iov.iov_base = batch;
+	iov.iov_len = len;
+	pthread_mutex_lock(&conn->write_lock);
+	if (conn->fd == fd)
+		rv = send_all(fd, &iov, 1, -1);
+	else
+		rv = -IPC_ERROR_CONNECTION_FAILED;
+	pthread_mutex_unlock(&conn->write_lock);
+	if (rv < 0) {
+		pthread_mutex_lock(&conn->lock);
+		server_connection_fail(conn, fd, rv);
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	pos = batch;
+	for (i = 0; i < count; i++) {
+		(void) pending_call_wait(conn, &calls[i], NULL);
+		rv = pending_call_finish(conn, &calls[i], &body);
+		free(body);
+		memcpy(&header, pos, sizeof(header));
+		pos += sizeof(header) + header._ipc_bufsz;
+		if (rv < 0 || spool_call_rejected(responses[i]._ipc_status))
+			failed = 1;
+		if (!failed)
+			done = pos - batch;
+	}
+
+	free(calls);
+	free(responses);
+	return done;
+}
+
+/*
+ * Send the calls in the spool of a session as they are added, in batches,
+ * and keep trying while the server is unreachable.
+ */
+static void *
+session_spool_drain(void *arg)
+{
+	struct server_connection *conn = (struct server_connection *) arg;
+	struct session_spool *sp = conn->spool;
+	struct timespec deadline;
+	uint64_t delay = 0;
+	char *batch;
+	ssize_t len;
+	size_t done;
+	int count;
+
+	pthread_mutex_lock(&sp->lock);
+	while (!sp->stopping) {
+		len = spool_peek(&sp->ring, &batch, SPOOL_BATCH_MAX, &count);
+		if (len < 0) {
+			log_error("the spool of `%s' is damaged; discarding its calls", conn->service);
+			spool_discard(&sp->ring);
+			continue;
+		}
+		if (len == 0) {
+			pthread_cond_broadcast(&sp->cond);
+			pthread_cond_wait(&sp->cond, &sp->lock);
+			continue;
+		}
+
+		/* Calls are added after the batch, so it can be sent without the lock */
+		pthread_mutex_unlock(&sp->lock);
+		done = session_spool_send(conn, batch, len, count);
+		pthread_mutex_lock(&sp->lock);
+		spool_consume(&sp->ring, done);
+		if (done == (size_t) len) {
+			delay = 0;
+			continue;
+		}
+
+		/* Wait for the server to come back, for longer each time */
+		delay = delay ? MIN(delay * 2, BACKOFF_MAX_NSEC) : BACKOFF_MIN_NSEC;
+		log_debug("unable to send spooled calls to `%s'; trying again in %llu ms",
+				conn->service, (unsigned long long) (delay / 1000000));
+		ns_to_timespec(monotonic_ns() + delay, &deadline);
+		while (!sp->stopping &&
+				pthread_cond_timedwait(&sp->cond, &sp->lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
+
+int VISIBLE
+ipc_session_spool(struct ipc_session *session, const char *path, size_t size)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	struct session_spool *sp;
+	int rv;
+
+	/* Calls to a server in this process are not sent anywhere */
+	if (!conn || !path || conn->local_dlh || conn->spool)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return -IPC_ERROR_NO_MEMORY;
+	spool_init(&sp->ring);
+	rv = spool_open(&sp->ring, path, size);
+	if (rv < 0) {
+		free(sp);
+		return rv;
+	}
+	pthread_mutex_init(&sp->lock, NULL);
+	/* The drainer waits with a deadline to try again */
+	monotonic_cond_init(&sp->cond);
+
+	conn->spool = sp;
+	errno = pthread_create(&sp->drainer, NULL, session_spool_drain, conn);
+	if (errno != 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("pthread_create(3)");
+		conn->spool = NULL;
+		spool_close(&sp->ring);
+		pthread_mutex_destroy(&sp->lock);
+		pthread_cond_destroy(&sp->cond);
+		free(sp);
+		return rv;
+	}
+	log_debug("spooling one-way calls to `%s' in `%s'", conn->service, path);
+	return 0;
+}
+
+int VISIBLE
+ipc_session_flush(struct ipc_session *session, int timeout_ms)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	struct session_spool *sp = conn->spool;
+	struct timespec deadline;
+	int rv = 0;
+
+	if (!sp)
+		return 0;
+
+	ns_to_timespec(monotonic_ns() + (uint64_t) timeout_ms * 1000000, &deadline);
+	pthread_mutex_lock(&sp->lock);
+	while (!spool_empty(&sp->ring)) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&sp->cond, &sp->lock);
+		} else if (pthread_cond_timedwait(&sp->cond, &sp->lock, &deadline) == ETIMEDOUT) {
+			rv = spool_empty(&sp->ring) ? 0 : -IPC_ERROR_TIMED_OUT;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return rv;
+}
+
+ipc_function_t VISIBLE
+ipc_session_stub(struct ipc_session *session, uint32_t method_id)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	ipc_function_t retfunc;
+	char symbol[PATH_MAX];
+	void *dlh;
+	int len;
+
+	/* Local functions take the same arguments as the stubs */
+	len = snprintf(symbol, sizeof(symbol), "ipc_%s__%s__method_%u",
+			conn->local_dlh ? "local" : "stub", conn->libname, method_id);
+	if (len >= sizeof(symbol) || len < 0) {
+		return ((ipc_function_t) NULL);
+	}
+
+	dlh = conn->local_dlh ? conn->local_dlh : conn->stub_dlh;
+	retfunc = (ipc_function_t) dlfunc(dlh, symbol);
+	if (!retfunc) {
+		log_error("cannot resolve method; dlh=%p method=%s error=%s\n",
+				dlh, symbol, dlerror());
+	}
+	return retfunc;
+}
+
+static int
+accept_cloexec(int s)
+{
+#ifdef SOCK_CLOEXEC
+	return accept4(s, NULL, NULL, SOCK_CLOEXEC);
+#else
+	int fd = accept(s, NULL, NULL);
+	if (fd >= 0) (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+#endif
+}
+
+/*
+ * Called when accept(2) fails because the process is out of descriptors.
+ *
+ * The pending connection would otherwise keep the listen socket readable,
+ * and the event loop would spin. Give up the reserve descriptor long enough
+ * to accept the connection and close it, so the client sees a clean failure.
+ * If the reserve cannot be had back, stop watching the listen socket until
+ * a connection is closed; see server_resume_accept().
+ */
+static void
+shed_connection(struct ipc_server *server, struct service_binding *binding)
+{
+	int fd;
+
+	log_warning("out of file descriptors; dropping a connection");
+	if (server->reserve_fd >= 0) {
+		close(server->reserve_fd);
+		fd = accept(binding->listenfd, NULL, NULL);
+		if (fd >= 0)
+			close(fd);
+	}
+	server->reserve_fd = open_reserve_fd();
+	if (server->reserve_fd >= 0 || binding->paused)
+		return;
+
+	log_warning("no descriptor to spare; not accepting connections to `%s'",
+			binding->service);
+	if (server_add_change(server, binding->listenfd, EVFILT_READ, EV_DISABLE,
+				binding) < 0)
+		return;
+	binding->paused = 1;
+	server->npaused++;
+	(void) server_commit_changes(server);
+}
+
+/* Accept connections again once the reserve descriptor can be reopened */
+static void
+server_resume_accept(struct ipc_server *server)
+{
+	struct service_binding *binding;
+
+	if (server->reserve_fd < 0)
+		server->reserve_fd = open_reserve_fd();
+	if (server->reserve_fd < 0)
+		return;
+	LIST_FOREACH(binding, &server->bindings, entries) {
+		if (!binding->paused)
+			continue;
+		if (server_add_change(server, binding->listenfd, EVFILT_READ, EV_ENABLE,
+					binding) < 0)
+			break;
+		binding->paused = 0;
+		server->npaused--;
+	}
+	(void) server_commit_changes(server);
+}
+
+static void
+client_connection_release(struct client_connection *conn)
+{
+	if (__atomic_sub_fetch(&conn->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	log_debug("closing connection on fd %d", conn->fd);
+	close(conn->fd);
+	free(conn->partial);
+	buffer_pool_free(&conn->pool);
+	pthread_mutex_destroy(&conn->write_lock);
+	free(conn);
+}
+
+/*
+ * Stop serving a connection. If some responses are still outstanding, the
+ * descriptor stays open until they are completed, so that it cannot be
+ * reused for another connection in the meantime.
+ */
+static void
+client_connection_close(struct ipc_server *server, struct client_connection *conn)
+{
+	struct kevent kev;
+
+	LIST_REMOVE(conn, entries);
+	if (conn->runnable)
+		TAILQ_REMOVE(&server->runq, conn, runq_entries);
+	timer_cancel(&server->timers, &conn->timer);
+	if (server_cancel_changes(server, conn))
+		conn->registered = 0;
+	pthread_mutex_lock(&conn->write_lock);
+	conn->closed = 1;
+	pthread_mutex_unlock(&conn->write_lock);
+
+	/*
+	 * The descriptor may stay open until outstanding responses are sent,
+	 * and libkqueue keeps the knote of a closed descriptor, so the event
+	 * has to be removed from the kqueue explicitly, unless it never got there.
+	 */
+	if (conn->registered && server->pollfd >= 0 && !server->stopped) {
+		EV_SET(&kev, conn->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		if (kevent(server->pollfd, &kev, 1, NULL, 0, NULL) < 0)
+			log_errno("kevent(2)");
+	}
+	client_connection_release(conn);
+	if (server->npaused > 0 && !server->stopped)
+		server_resume_accept(server);
+}
+
+/* Close the descriptors of the file results of a response */
+static void
+file_results_close(const struct iovec *results, int nresults, uint32_t files)
+{
+	struct ipc_file *file;
+	int i;
+
+	for (i = 0; i < nresults; i++) {
+		if (!(files & (1U << i)))
+			continue;
+		file = (struct ipc_file *) results[i].iov_base;
+		if (file->fd >= 0) {
+			(void) close(file->fd);
+			file->fd = -1;
+		}
+	}
+}
+
+/* Make sure that the range of each file result can be read in full */
+static int
+file_results_check(const struct iovec *results, int nresults, uint32_t files)
+{
+	const struct ipc_file *file;
+	struct stat sb;
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < nresults; i++) {
+		if (!(files & (1U << i)))
+			continue;
+		file = (const struct ipc_file *) results[i].iov_base;
+		if (file->length == 0)
+			continue;
+		if (file->fd < 0 || fstat(file->fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+			log_error("result %d is not a regular file", i);
+			return -IPC_ERROR_ARGUMENT_INVALID;
+		}
+		if (file->offset > (uint64_t) sb.st_size ||
+				file->length > (uint64_t) sb.st_size - file->offset) {
+			log_error("result %d is past the end of its file", i);
+			return -IPC_ERROR_ARGUMENT_INVALID;
+		}
+		total += file->length;
+	}
+	if (total > IPC_FILE_SIZE_MAX) {
+		log_error("files too large: %llu bytes", (unsigned long long) total);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+	return 0;
+}
+
+/*
+ * Copy a range of a file into a socket. Where the system allows, the data
+ * goes straight from the page cache, without passing through user space.
+ */
+static int
+send_file_range(int s, int fd, uint64_t offset, uint64_t length)
+{
+#if defined(__linux__)
+	off_t pos = offset;
+	ssize_t bytes;
+
+	while (length > 0) {
+		bytes = sendfile(s, fd, &pos, length);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return IPC_CAPTURE_ERRNO;
+		}
+		/* The file was truncated after it was checked */
+		if (bytes == 0)
+			return -IPC_ERROR_MESSAGE_INVALID;
+		length -= bytes;
+	}
+	return 0;
+#elif defined(__FreeBSD__)
+	off_t bytes;
+	int rv;
+
+	while (length > 0) {
+		bytes = 0;
+		rv = sendfile(fd, s, offset, length, NULL, &bytes, 0);
+		if (rv < 0 && errno != EINTR && errno != EAGAIN)
+			return IPC_CAPTURE_ERRNO;
+		if (rv == 0 && bytes == 0)
+			return -IPC_ERROR_MESSAGE_INVALID;
+		offset += bytes;
+		length -= bytes;
+	}
+	return 0;
+#else
+	char buf[FILE_COPY_SIZE];
+	struct iovec iov;
+	ssize_t bytes;
+	int rv;
+
+	while (length > 0) {
+		bytes = pread(fd, buf, MIN(length, sizeof(buf)), offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return IPC_CAPTURE_ERRNO;
+		}
+		if (bytes == 0)
+			return -IPC_ERROR_MESSAGE_INVALID;
+		iov.iov_base = buf;
+		iov.iov_len = bytes;
+		rv = send_all(s, &iov, 1, -1);
+		if (rv < 0)
+			return rv;
+		offset += bytes;
+		length -= bytes;
+	}
+	return 0;
+#endif
+}
+
+/*
+ * Send the contents of a file result. sendfile(2) has no way to suppress
+ * SIGPIPE, so the signal is blocked while it runs, and consumed if the
+ * client has gone away.
+ */
+static int
+send_file_result(int s, const struct ipc_file *file)
+{
+	static const struct timespec zero = { 0, 0 };
+	sigset_t pipe_set, old_set;
+	int rv;
+
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	rv = send_file_range(s, file->fd, file->offset, file->length);
+	if (rv == IPC_ERRNO(EPIPE))
+		(void) sigtimedwait(&pipe_set, NULL, &zero);
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return rv;
+}
+
+/*
+ * Write a response, with the results given by an array of iovecs. The
+ * results in the files mask point to a struct ipc_file instead; their
+ * contents are sent straight from the file, and the descriptors are closed.
+ */
+static int
+client_connection_send_files(struct client_connection *conn, uint32_t method, uint32_t id,
+		int status, const struct iovec *results, int nresults, uint32_t files)
+{
+	struct ipc_message response;
+	struct iovec iov[IPC_ARGUMENT_MAX + 1];
+	const struct ipc_file *file;
+	uint32_t inline_size = 0;
+	int rv = 0;
+	int i, n;
+
+	if (nresults < 0 || nresults > IPC_ARGUMENT_MAX)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	/* One-way calls are not answered */
+	if (id == IPC_ID_ONEWAY) {
+		file_results_close(results, nresults, files);
+		return 0;
+	}
+
+	if (files && file_results_check(results, nresults, files) < 0) {
+		/* The client still gets an answer, without the results */
+		file_results_close(results, nresults, files);
+		status = -IPC_ERROR_ARGUMENT_INVALID;
+		nresults = 0;
+		files = 0;
+	}
+
+	memset(&response, 0, sizeof(response));
+	response._ipc_method = method;
+	response._ipc_id = id;
+	response._ipc_argc = nresults;
+	response._ipc_status = status;
+	for (i = 0; i < nresults; i++) {
+		if (files & (1U << i)) {
+			file = (const struct ipc_file *) results[i].iov_base;
+			response._ipc_argsz[i] = file->length;
+		} else {
+			response._ipc_argsz[i] = results[i].iov_len;
+			inline_size += results[i].iov_len;
+		}
+		response._ipc_bufsz += response._ipc_argsz[i];
+	}
+	if (inline_size > IPC_MESSAGE_SIZE_MAX) {
+		log_error("response too large: %u bytes", inline_size);
+		file_results_close(results, nresults, files);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+
+	/* Responses may be completed by several threads at once */
+	pthread_mutex_lock(&conn->write_lock);
+	if (conn->closed) {
+		log_debug("connection on fd %d closed before the response was sent", conn->fd);
+		rv = -IPC_ERROR_CONNECTION_FAILED;
+	}
+
+	/* Gather the results between files, and write them in one go */
+	iov[0].iov_base = &response;
+	iov[0].iov_len = sizeof(response);
+	n = 1;
+	for (i = 0; rv == 0 && i <= nresults; i++) {
+		if (i < nresults && !(files & (1U << i))) {
+			iov[n++] = results[i];
+			continue;
+		}
+		if (n > 0)
+			rv = send_all(conn->fd, iov, n, -1);
+		n = 0;
+		if (rv == 0 && i < nresults)
+			rv = send_file_result(conn->fd, (const struct ipc_file *) results[i].iov_base);
+	}
+	if (rv < 0 && rv != -IPC_ERROR_CONNECTION_FAILED) {
+		log_error("unable to send a response on fd %d: %s", conn->fd, ipc_strerror(rv));
+		/* Part of the response may have been written, so the stream is lost */
+		if (files)
+			(void) shutdown(conn->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	file_results_close(results, nresults, files);
+	return rv;
+}
+
+/* Write a response, with the results given by an array of iovecs */
+static int
+client_connection_send(struct client_connection *conn, uint32_t method, uint32_t id,
+		int status, const struct iovec *results, int nresults)
+{
+	return client_connection_send_files(conn, method, id, status, results, nresults, 0);
+}
+
+/* Drive the timers with a periodic tick, for a caller that waits on the pollfd */
+static int
+server_register_timer(struct ipc_server *server)
+{
+	int rv;
+
+	if (server->timer_registered)
+		return 0;
+	rv = server_add_change(server, TIMER_IDENT, EVFILT_TIMER, EV_ADD | EV_ENABLE,
+			&server->timer_evsrc);
+	if (rv < 0)
+		return rv;
+	server->changes[server->nchanges - 1].data = EXTERNAL_POLL_TICK_MS;
+	server->timer_registered = 1;
+	return server_commit_changes(server);
+}
+
+/* Set a timer to fire on the given tick, or on the next one if that has passed */
+static void
+server_timer_at(struct ipc_server *server, struct timer *timer, uint64_t tick)
+{
+	timer_add(&server->timers, timer,
+			tick > server->timers.now ? tick - server->timers.now : 1);
+	if (server->external_poll)
+		(void) server_register_timer(server);
+}
+
+/*
+ * Set the timer of a connection for when it would become idle, or is due
+ * a keepalive. The timer is not moved on every request: when it fires
+ * early, it is simply set again.
+ */
+static void
+client_connection_schedule(struct ipc_server *server, struct client_connection *conn)
+{
+	uint64_t next = TIMER_WHEEL_NEVER;
+	uint64_t ping;
+
+	if (server->idle_ticks && !conn->adopted)
+		next = conn->last_active + server->idle_ticks;
+	if (server->keepalive_ticks && conn->binding->is_tcp) {
+		ping = MAX(conn->last_active, conn->last_ping) + server->keepalive_ticks;
+		next = MIN(next, ping);
+	}
+	if (next == TIMER_WHEEL_NEVER)
+		timer_cancel(&server->timers, &conn->timer);
+	else
+		server_timer_at(server, &conn->timer, next);
+}
+
+static void
+client_connection_expire(struct timer *timer, void *arg)
+{
+	struct ipc_server *server = (struct ipc_server *) arg;
+	struct client_connection *conn = (struct client_connection *)
+		((char *) timer - offsetof(struct client_connection, timer));
+	uint64_t now = server->timers.now;
+
+	/* A connection with calls in progress or waiting for its turn is busy, not idle */
+	if (__atomic_load_n(&conn->refcnt, __ATOMIC_ACQUIRE) > 1 || conn->runnable)
+		conn->last_active = MAX(conn->last_active, now);
+
+	if (server->idle_ticks && !conn->adopted &&
+			now >= conn->last_active + server->idle_ticks) {
+		log_debug("closing connection on fd %d; idle for %llu ms", conn->fd,
+				(unsigned long long) (now - conn->last_active) * TIMER_TICK_MS);
+		client_connection_close(server, conn);
+		return;
+	}
+
+	/* A keepalive is a response to call 0, which clients discard */
+	if (server->keepalive_ticks && conn->binding->is_tcp &&
+			now >= MAX(conn->last_active, conn->last_ping) + server->keepalive_ticks) {
+		if (client_connection_send(conn, 0, 0, 0, NULL, 0) < 0) {
+			client_connection_close(server, conn);
+			return;
+		}
+		conn->last_ping = now;
+	}
+	client_connection_schedule(server, conn);
+}
+
+static uint64_t
+ms_to_ticks(unsigned int ms)
+{
+	return ((uint64_t) ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+int VISIBLE
+ipc_server_set_timeouts(struct ipc_server *server, unsigned int idle_ms,
+		unsigned int keepalive_ms, unsigned int deadline_ms)
+{
+	struct client_connection *conn;
+
+	server->idle_ticks = ms_to_ticks(idle_ms);
+	server->keepalive_ticks = ms_to_ticks(keepalive_ms);
+	server->deadline_ticks = ms_to_ticks(deadline_ms);
+	log_debug("timeouts: idle=%u ms keepalive=%u ms deadline=%u ms",
+			idle_ms, keepalive_ms, deadline_ms);
+
+	LIST_FOREACH(conn, &server->clients, entries)
+		client_connection_schedule(server, conn);
+	return 0;
+}
+
+/* Take a slot for a call to the method, if one is free */
+static int
+method_limit_acquire(struct method_limit *limit)
+{
+	int active;
+
+	active = __atomic_load_n(&limit->active, __ATOMIC_RELAXED);
+	do {
+		if (active >= __atomic_load_n(&limit->max, __ATOMIC_RELAXED))
+			return 0;
+	} while (!__atomic_compare_exchange_n(&limit->active, &active, active + 1,
+				1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return 1;
+}
+
+/* Let the event loop be woken up with server_wakeup() */
+static int
+server_register_wakeup(struct ipc_server *server)
+{
+	int rv;
+
+	if (server->wakeup_registered)
+		return 0;
+	rv = server_add_change(server, WAKEUP_IDENT, EVFILT_USER, EV_ADD | EV_CLEAR,
+			&server->wakeup_evsrc);
+	if (rv < 0)
+		return rv;
+	server->wakeup_registered = 1;
+	return server_commit_changes(server);
+}
+
+/* Wake up the event loop, from any thread */
+static void
+server_wakeup(struct ipc_server *server)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, WAKEUP_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, &server->wakeup_evsrc);
+	if (kevent(server->pollfd, &kev, 1, NULL, 0, NULL) < 0)
+		log_errno("kevent(2)");
+}
+
+/* Give up the slot of a call that has completed, on any thread */
+static void
+method_limit_release(struct method_limit *limit)
+{
+	__atomic_sub_fetch(&limit->active, 1, __ATOMIC_ACQ_REL);
+	if (__atomic_load_n(&limit->nwaiting, __ATOMIC_ACQUIRE) > 0)
+		server_wakeup(limit->server);
+}
+
+static struct method_limit *
+method_limit_find(struct service_binding *binding, uint32_t method)
+{
+	int i;
+
+	for (i = 0; i < binding->nlimits; i++) {
+		if (binding->limits[i]->method == method)
+			return binding->limits[i];
+	}
+	return NULL;
+}
+
+static int
+service_binding_set_limit(struct ipc_server *server, struct service_binding *binding,
+		uint32_t method, int max, int flags)
+{
+	struct method_limit *limit, **limits;
+
+	if (max < 0 || (flags != IPC_LIMIT_REJECT && flags != IPC_LIMIT_QUEUE))
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	limit = method_limit_find(binding, method);
+	if (!limit) {
+		if (max == 0)
+			return 0;
+		limit = calloc(1, sizeof(*limit));
+		limits = realloc(binding->limits, (binding->nlimits + 1) * sizeof(*limits));
+		if (!limit || !limits) {
+			free(limit);
+			if (limits)
+				binding->limits = limits;
+			return -IPC_ERROR_NO_MEMORY;
+		}
+		limit->method = method;
+		limit->server = server;
+		TAILQ_INIT(&limit->waiting);
+		limits[binding->nlimits++] = limit;
+		binding->limits = limits;
+	}
+
+	/* A limit of zero stays in place, so that waiting calls still run */
+	__atomic_store_n(&limit->max, max ? max : INT_MAX, __ATOMIC_RELEASE);
+	limit->flags = flags;
+	log_debug("limited method %u of `%s' to %d concurrent calls", method,
+			binding->service, max);
+
+	if (flags & IPC_LIMIT_QUEUE)
+		return server_register_wakeup(server);
+	return 0;
+}
+
+int VISIBLE
+ipc_server_set_limit(struct ipc_server *server, const char *service,
+		uint32_t method, int max, int flags)
+{
+	struct service_binding *binding;
+
+	LIST_FOREACH(binding, &server->bindings, entries) {
+		if (strcmp(binding->service, service) == 0)
+			return service_binding_set_limit(server, binding, method, max, flags);
+	}
+	log_error("service `%s' is not bound to this server", service);
+	return -IPC_ERROR_ARGUMENT_INVALID;
+}
+
+/*
+ * Find the slot for a uid, claiming a free one if create is true. Returns
+ * NULL if the uid has no slot, or if the table is full.
+ */
+static struct rate_bucket *
+rate_table_lookup(struct rate_bucket *rates, uid_t uid, int create)
+{
+	struct rate_bucket *bucket;
+	uid_t found;
+	unsigned int i, n;
+
+	i = (unsigned int) uid * 2654435761U;
+	for (n = 0; n < RATE_TABLE_SIZE; n++, i++) {
+		bucket = &rates[i & (RATE_TABLE_SIZE - 1)];
+		found = __atomic_load_n(&bucket->uid, __ATOMIC_ACQUIRE);
+		if (found == uid)
+			return bucket;
+		if (found != RATE_UID_FREE)
+			continue;
+		if (!create)
+			return NULL;
+		if (__atomic_compare_exchange_n(&bucket->uid, &found, uid, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || found == uid)
+			return bucket;
+	}
+	return NULL;
+}
+
+int VISIBLE
+ipc_server_set_rate_limit(struct ipc_server *server, uid_t uid,
+		unsigned int requests_per_sec, unsigned int bytes_per_sec)
+{
+	struct rate_bucket *rates, *expected, *bucket;
+	int i;
+
+	if (uid == RATE_UID_FREE)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	rates = __atomic_load_n(&server->rates, __ATOMIC_ACQUIRE);
+	if (!rates) {
+		rates = calloc(RATE_TABLE_SIZE, sizeof(*rates));
+		if (!rates)
+			return -IPC_ERROR_NO_MEMORY;
+		for (i = 0; i < RATE_TABLE_SIZE; i++)
+			rates[i].uid = RATE_UID_FREE;
+		expected = NULL;
+		if (!__atomic_compare_exchange_n(&server->rates, &expected, rates, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			/* Another thread got there first */
+			free(rates);
+			rates = expected;
+		}
+	}
+
+	bucket = rate_table_lookup(rates, uid, 1);
+	if (!bucket) {
+		log_error("no room for the rate limit of uid %u", (unsigned int) uid);
+		return -IPC_ERROR_NO_MEMORY;
+	}
+	__atomic_store_n(&bucket->requests_per_sec, requests_per_sec, __ATOMIC_RELEASE);
+	__atomic_store_n(&bucket->bytes_per_sec, bytes_per_sec, __ATOMIC_RELEASE);
+	log_debug("limited uid %u to %u requests and %u bytes per second",
+			(unsigned int) uid, requests_per_sec, bytes_per_sec);
+	return 0;
+}
+
+/* Find the rate limit that applies to the client on a new connection, or
+ * to a remote client if fd is -1 */
+static struct rate_bucket *
+rate_bucket_for_peer(struct ipc_server *server, int fd)
+{
+	struct rate_bucket *bucket, *any;
+	uid_t uid;
+	gid_t gid;
+
+	/* Remote peers have no uid that means anything here */
+	if (fd < 0 || ipc_getpeereid(fd, &uid, &gid) < 0)
+		return rate_table_lookup(server->rates, IPC_RATE_ANY_UID, 0);
+
+	bucket = rate_table_lookup(server->rates, uid, 0);
+	if (bucket)
+		return bucket;
+
+	/* Each user gets buckets of their own, with the default rates */
+	any = rate_table_lookup(server->rates, IPC_RATE_ANY_UID, 0);
+	if (!any)
+		return NULL;
+	bucket = rate_table_lookup(server->rates, uid, 1);
+	if (!bucket)
+		return any;
+	__atomic_store_n(&bucket->requests_per_sec,
+			__atomic_load_n(&any->requests_per_sec, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	__atomic_store_n(&bucket->bytes_per_sec,
+			__atomic_load_n(&any->bytes_per_sec, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	return bucket;
+}
+
+/* Add the credit earned since the last refill, up to one second's worth */
+static int64_t
+rate_credit_refill(int64_t credit, int64_t elapsed_ns, unsigned int rate, int64_t burst)
+{
+	credit += elapsed_ns * rate;
+	return credit < burst ? credit : burst;
+}
+
+/*
+ * Spend the credit for a request of the given size, if there is enough of it.
+ * Called on the event loop thread only.
+ */
+static int
+rate_bucket_take(struct rate_bucket *bucket, size_t size)
+{
+	struct timespec ts;
+	unsigned int rps, bps;
+	int64_t now, elapsed, requests, bytes, cost;
+
+	rps = __atomic_load_n(&bucket->requests_per_sec, __ATOMIC_ACQUIRE);
+	bps = __atomic_load_n(&bucket->bytes_per_sec, __ATOMIC_ACQUIRE);
+	if (rps == 0 && bps == 0)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (int64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+	elapsed = now - bucket->refilled_ns;
+	if (elapsed > NSEC_PER_SEC || bucket->refilled_ns == 0)
+		elapsed = NSEC_PER_SEC;
+	bucket->refilled_ns = now;
+
+	requests = rate_credit_refill(bucket->request_credit, elapsed, rps,
+			(int64_t) rps * NSEC_PER_SEC);
+	/* A message larger than one second's worth of bytes can still get through */
+	cost = (int64_t) size * NSEC_PER_SEC;
+	bytes = rate_credit_refill(bucket->byte_credit, elapsed, bps,
+			(int64_t) bps * NSEC_PER_SEC > cost ? (int64_t) bps * NSEC_PER_SEC : cost);
+
+	if ((rps && requests < NSEC_PER_SEC) || (bps && bytes < cost)) {
+		bucket->request_credit = requests;
+		bucket->byte_credit = bytes;
+		return 0;
+	}
+	bucket->request_credit = rps ? requests - NSEC_PER_SEC : 0;
+	bucket->byte_credit = bps ? bytes - cost : 0;
+	return 1;
+}
+
+/* Apply the limits from the interface definition, if the skeleton has any */
+static int
+service_binding_load_limits(struct ipc_server *server, struct service_binding *binding)
+{
+	const struct ipc_method_limit *table;
+	char ident[SYMBOL_NAME_MAX];
+	int len;
+	int rv;
+
+	len = snprintf(ident, sizeof(ident), "ipc_limits__%s", binding->libname);
+	if (len >= sizeof(ident) || len < 0)
+		return -IPC_ERROR_NAME_TOO_LONG;
+
+	table = (const struct ipc_method_limit *) dlsym(binding->skeleton_dlh, ident);
+	for (; table && table->max > 0; table++) {
+		rv = service_binding_set_limit(server, binding, table->method, table->max, table->flags);
+		if (rv < 0)
+			return rv;
+	}
+	return 0;
+}
+
+/* Drop the calls that are waiting for a slot */
+static void
+method_limit_flush(struct method_limit *limit)
+{
+	struct waiting_call *call;
+
+	while ((call = TAILQ_FIRST(&limit->waiting)) != NULL) {
+		TAILQ_REMOVE(&limit->waiting, call, entries);
+		timer_cancel(&limit->server->timers, &call->deadline);
+		client_connection_release(call->conn);
+		free(call);
+	}
+	__atomic_store_n(&limit->nwaiting, 0, __ATOMIC_RELEASE);
+}
+
+static void
+method_limit_free(struct method_limit *limit)
+{
+	method_limit_flush(limit);
+	free(limit);
+}
+
+int VISIBLE
+ipc_response_send(struct ipc_message *request, int status, const struct iovec *results, int nresults)
+{
+	return ipc_response_send_files(request, status, results, nresults, 0);
+}
+
+int VISIBLE
+ipc_response_send_files(struct ipc_message *request, int status,
+		const struct iovec *results, int nresults, uint32_t files)
+{
+	if (!current_connection) {
+		log_error("no request is being dispatched");
+		if (nresults > 0 && nresults <= IPC_ARGUMENT_MAX)
+			file_results_close(results, nresults, files);
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	}
+	return client_connection_send_files(current_connection, request->_ipc_method,
+			request->_ipc_id, status, results, nresults, files);
+}
+
+/* Called on the event loop thread when a call has not completed in time */
+static void
+ipc_response_expire(struct timer *timer, void *arg)
+{
+	struct ipc_response *token = (struct ipc_response *)
+		((char *) timer - offsetof(struct ipc_response, deadline));
+
+	(void) arg;
+	if (!__atomic_exchange_n(&token->answered, 1, __ATOMIC_ACQ_REL)) {
+		log_warning("call %u to method %u missed its deadline", token->id, token->method);
+		(void) client_connection_send(token->conn, token->method, token->id,
+				-IPC_ERROR_TIMED_OUT, NULL, 0);
+	}
+	ipc_response_release(token);
+}
+
+static void
+ipc_response_release(struct ipc_response *token)
+{
+	if (__atomic_sub_fetch(&token->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	client_connection_release(token->conn);
+	server_release(token->server);
+	free(token);
+}
+
+struct ipc_response VISIBLE *
+ipc_response_token(struct ipc_message *request)
+{
+	struct ipc_server *server;
+	struct ipc_response *token;
+
+	if (!current_connection) {
+		log_error("no request is being dispatched");
+		return NULL;
+	}
+	token = calloc(1, sizeof(*token));
+	if (!token)
+		return NULL;
+	token->conn = current_connection;
+	token->method = request->_ipc_method;
+	token->id = request->_ipc_id;
+	/* The call is no longer complete when the dispatcher returns */
+	token->limit = current_limit;
+	current_limit = NULL;
+	__atomic_add_fetch(&token->conn->refcnt, 1, __ATOMIC_ACQ_REL);
+	token->refcnt = 1;
+
+	/* Tokens are only handed out on the event loop thread, which owns the timers */
+	server = token->conn->binding->server;
+	__atomic_add_fetch(&server->refcnt, 1, __ATOMIC_ACQ_REL);
+	token->server = server;
+	if (server->deadline_ticks) {
+		timer_init(&token->deadline, ipc_response_expire);
+		token->refcnt++;
+		server_timer_at(server, &token->deadline, server->tick + server->deadline_ticks);
+	}
+	return token;
+}
+
+struct ipc_response VISIBLE *
+ipc_response_local(void)
+{
+	struct ipc_response *token;
+
+	token = calloc(1, sizeof(*token));
+	if (!token)
+		return NULL;
+	pthread_mutex_init(&token->lock, NULL);
+	pthread_cond_init(&token->cond, NULL);
+	return token;
+}
+
+static void *
+blocking_pool_thread(void *arg)
+{
+	struct blocking_job *job;
+	struct ipc_server *server;
+
+	for (;;) {
+		pthread_mutex_lock(&blocking_pool.mtx);
+		while (STAILQ_EMPTY(&blocking_pool.jobs))
+			pthread_cond_wait(&blocking_pool.cond, &blocking_pool.mtx);
+		job = STAILQ_FIRST(&blocking_pool.jobs);
+		STAILQ_REMOVE_HEAD(&blocking_pool.jobs, entries);
+		blocking_pool.njobs--;
+		pthread_mutex_unlock(&blocking_pool.mtx);
+
+		/*
+		 * The function is in the skeleton library, and completing the call
+		 * may release the last reference to the server, so hold one until
+		 * it has returned.
+		 */
+		server = job->token->server;
+		__atomic_add_fetch(&server->refcnt, 1, __ATOMIC_ACQ_REL);
+		(*job->func)(job->token, &job->request, job->body);
+		free(job);
+		server_release(server);
+	}
+	return NULL;
+}
+
+/* The number of threads can be set with the IPC_BLOCKING_THREADS variable */
+static void
+blocking_pool_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	const char *env;
+	int want = BLOCKING_THREADS_DEFAULT;
+	int i;
+
+	env = getenv("IPC_BLOCKING_THREADS");
+	if (env && atoi(env) > 0)
+		want = atoi(env);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < want; i++) {
+		if (pthread_create(&tid, &attr, blocking_pool_thread, NULL) != 0) {
+			log_error("unable to create a thread for blocking methods");
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	blocking_pool.nthreads = i;
+	log_debug("started %d threads for blocking methods", i);
+}
+
+int VISIBLE
+ipc_response_offload(struct ipc_message *request, char *body,
+		void (*func)(struct ipc_response *, struct ipc_message *, char *))
+{
+	struct blocking_job *job;
+	struct ipc_response *token;
+	size_t offset;
+
+	(void) pthread_once(&blocking_pool.once, blocking_pool_start);
+	if (blocking_pool.nthreads == 0)
+		return ipc_response_send(request, -IPC_ERROR_BUSY, NULL, 0);
+
+	/* The body is only valid until the dispatcher returns, so take a copy */
+	offset = roundup(sizeof(*job), BODY_ALIGNMENT);
+	job = malloc(offset + request->_ipc_bufsz);
+	if (!job)
+		return -IPC_ERROR_NO_MEMORY;
+	token = ipc_response_token(request);
+	if (!token) {
+		free(job);
+		return -IPC_ERROR_NO_MEMORY;
+	}
+	job->func = func;
+	job->token = token;
+	memcpy(&job->request, request, sizeof(*request));
+	job->body = (char *) job + offset;
+	if (request->_ipc_bufsz > 0)
+		memcpy(job->body, body, request->_ipc_bufsz);
+
+	pthread_mutex_lock(&blocking_pool.mtx);
+	if (blocking_pool.njobs >= BLOCKING_QUEUE_MAX) {
+		pthread_mutex_unlock(&blocking_pool.mtx);
+		log_warning("too many calls waiting for a thread; rejecting method %u",
+				request->_ipc_method);
+		free(job);
+		return ipc_response_complete(token, -IPC_ERROR_BUSY, NULL, 0);
+	}
+	STAILQ_INSERT_TAIL(&blocking_pool.jobs, job, entries);
+	blocking_pool.njobs++;
+	pthread_cond_signal(&blocking_pool.cond);
+	pthread_mutex_unlock(&blocking_pool.mtx);
+
+	return 0;
+}
+
+/* Keep a copy of the results of a call from within this process */
+static int
+local_response_complete(struct ipc_response *token, int status,
+		const struct iovec *results, int nresults)
+{
+	struct ipc_message *msg = &token->message;
+	char *pos;
+	int i;
+
+	if (nresults < 0 || nresults > IPC_ARGUMENT_MAX)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->_ipc_argc = nresults;
+	msg->_ipc_status = status;
+	for (i = 0; i < nresults; i++) {
+		msg->_ipc_argsz[i] = results[i].iov_len;
+		msg->_ipc_bufsz += results[i].iov_len;
+	}
+	if (msg->_ipc_bufsz > 0) {
+		token->body = malloc(msg->_ipc_bufsz);
+		if (!token->body) {
+			msg->_ipc_argc = 0;
+			msg->_ipc_bufsz = 0;
+			memset(&msg->_ipc_argsz, 0, sizeof(msg->_ipc_argsz));
+			msg->_ipc_status = -IPC_ERROR_NO_MEMORY;
+		}
+	}
+	for (pos = token->body, i = 0; token->body && i < nresults; i++) {
+		memcpy(pos, results[i].iov_base, results[i].iov_len);
+		pos += results[i].iov_len;
+	}
+
+	pthread_mutex_lock(&token->lock);
+	token->done = 1;
+	pthread_cond_signal(&token->cond);
+	pthread_mutex_unlock(&token->lock);
+	return 0;
+}
+
+int VISIBLE
+ipc_response_complete(struct ipc_response *token, int status,
+		const struct iovec *results, int nresults)
+{
+	return ipc_response_complete_files(token, status, results, nresults, 0);
+}
+
+int VISIBLE
+ipc_response_complete_files(struct ipc_response *token, int status,
+		const struct iovec *results, int nresults, uint32_t files)
+{
+	int rv;
+
+	if (!token || (files && (nresults < 0 || nresults > IPC_ARGUMENT_MAX)))
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	if (!token->conn) {
+		/* Local callers are given the contents by the generated code instead */
+		if (files) {
+			file_results_close(results, nresults, files);
+			return local_response_complete(token, -IPC_ERROR_ARGUMENT_INVALID, NULL, 0);
+		}
+		return local_response_complete(token, status, results, nresults);
+	}
+
+	if (!__atomic_exchange_n(&token->answered, 1, __ATOMIC_ACQ_REL)) {
+		rv = client_connection_send_files(token->conn, token->method, token->id,
+				status, results, nresults, files);
+	} else {
+		log_debug("call %u completed after its deadline; discarding the results", token->id);
+		file_results_close(results, nresults, files);
+		rv = -IPC_ERROR_TIMED_OUT;
+	}
+	/* The deadline does not free the slot, since the method was still running */
+	if (token->limit)
+		method_limit_release(token->limit);
+	ipc_response_release(token);
+	return rv;
+}
+
+int VISIBLE
+ipc_response_wait(struct ipc_response *token, struct ipc_message *response, char **body)
+{
+	if (!token || token->conn)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	pthread_mutex_lock(&token->lock);
+	while (!token->done)
+		pthread_cond_wait(&token->cond, &token->lock);
+	pthread_mutex_unlock(&token->lock);
+
+	memcpy(response, &token->message, sizeof(*response));
+	*body = token->body;
+	pthread_cond_destroy(&token->cond);
+	pthread_mutex_destroy(&token->lock);
+	free(token);
+	return 0;
+}
+
+int VISIBLE
+ipc_buffer_alloc(struct ipc_session *session, size_t size, struct ipc_buffer *buf)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+	int index;
+	int rv = 0;
+
+	if (!conn || !buf || size > IPC_BUFFER_SIZE)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+	/* There is no way to pass the pool to a server on another host */
+	if (conn->addr.ss_family == AF_INET || conn->addr.ss_family == AF_INET6)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	pthread_mutex_lock(&conn->lock);
+	if (!conn->pool.base) {
+		/* The pool is created on first use; the writer passes it to the server */
+		pthread_mutex_lock(&conn->write_lock);
+		rv = buffer_pool_create(&conn->pool, BUFFER_POOL_BUFFERS);
+		pthread_mutex_unlock(&conn->write_lock);
+	}
+	index = (rv == 0) ? buffer_pool_alloc(&conn->pool) : -1;
+	pthread_mutex_unlock(&conn->lock);
+	if (rv < 0)
+		return rv;
+	if (index < 0)
+		return -IPC_ERROR_NO_MEMORY;
+
+	buf->index = index;
+	buf->offset = 0;
+	buf->length = size;
+	buf->data = buffer_pool_resolve(&conn->pool, index, 0, size);
+	return 0;
+}
+
+void VISIBLE
+ipc_buffer_free(struct ipc_session *session, struct ipc_buffer *buf)
+{
+	struct server_connection *conn = (struct server_connection *) session;
+
+	if (!conn || !buf || !buf->data)
+		return;
+	pthread_mutex_lock(&conn->lock);
+	buffer_pool_release(&conn->pool, buf->index);
+	pthread_mutex_unlock(&conn->lock);
+	buf->data = NULL;
+}
+
+int VISIBLE
+ipc_buffer_resolve(struct ipc_response *token, const void *ref, size_t len,
+		struct ipc_buffer *buf)
+{
+	struct client_connection *conn = token ? token->conn : current_connection;
+
+	if (!conn || len != IPC_BUFFER_REF_SIZE)
+		return -IPC_ERROR_MESSAGE_INVALID;
+	memcpy(buf, ref, IPC_BUFFER_REF_SIZE);
+	buf->data = buffer_pool_resolve(&conn->pool, buf->index, buf->offset, buf->length);
+	if (!buf->data) {
+		log_error("buffer %u [%u, +%u) is not in the pool of the client",
+				buf->index, buf->offset, buf->length);
+		return -IPC_ERROR_MESSAGE_INVALID;
+	}
+	return 0;
+}
+
+int VISIBLE
+ipc_buffer_update(struct ipc_buffer *buf, const void *ref)
+{
+	uint32_t index, offset, length;
+
+	memcpy(&index, ref, sizeof(index));
+	memcpy(&offset, (const char *) ref + sizeof(index), sizeof(offset));
+	memcpy(&length, (const char *) ref + sizeof(index) + sizeof(offset), sizeof(length));
+
+	/* The server may only narrow the range it was lent */
+	if (index != buf->index || offset < buf->offset ||
+			offset - buf->offset > buf->length ||
+			length > buf->length - (offset - buf->offset))
+		return -IPC_ERROR_MESSAGE_INVALID;
+	buf->data = (char *) buf->data + (offset - buf->offset);
+	buf->offset = offset;
+	buf->length = length;
+	return 0;
+}
+
+int VISIBLE
+ipc_file_load(struct ipc_file *file)
+{
+	uint64_t pos = 0;
+	ssize_t bytes;
+	int rv = 0;
+
+	file->data = NULL;
+	if (file->fd < 0)
+		return (file->length > 0) ? -IPC_ERROR_ARGUMENT_INVALID : 0;
+
+	if (file->length > IPC_FILE_SIZE_MAX)
+		rv = -IPC_ERROR_ARGUMENT_INVALID;
+	else if (file->length > 0 && !(file->data = malloc(file->length)))
+		rv = -IPC_ERROR_NO_MEMORY;
+	while (rv == 0 && pos < file->length) {
+		bytes = pread(file->fd, (char *) file->data + pos, file->length - pos,
+				file->offset + pos);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			rv = IPC_CAPTURE_ERRNO;
+		} else if (bytes == 0) {
+			rv = -IPC_ERROR_ARGUMENT_INVALID;
+		} else {
+			pos += bytes;
+		}
+	}
+	(void) close(file->fd);
+	file->fd = -1;
+	file->offset = 0;
+	if (rv < 0) {
+		free(file->data);
+		file->data = NULL;
+		file->length = 0;
+	}
+	return rv;
+}
+
+/* Serve a connection to a service. The descriptor is closed if this fails. */
+static int
+client_connection_start(struct ipc_server *server, struct service_binding *binding,
+		int fd, int adopted)
+{
+	struct client_connection *conn;
+	int rv;
 
-	free(server->service); /* KLUDGE to avoid adding cleanup handling later */
-	server->service = strdup(name);
-	if (!server->service) {
+	conn = malloc(sizeof(*conn));
+	if (!conn) {
+		log_error("out of memory");
+		close(fd);
 		return -IPC_ERROR_NO_MEMORY;
 	}
+	conn->evsrc.type = event_type_client_read;
+	conn->binding = binding;
+	conn->fd = fd;
+	conn->partial = NULL;
+	conn->partial_len = 0;
+	conn->runnable = 0;
+	conn->deficit = 0;
+	conn->bucket = NULL;
+	conn->refcnt = 1;
+	conn->closed = 0;
+	conn->registered = 0;
+	pthread_mutex_init(&conn->write_lock, NULL);
+	timer_init(&conn->timer, client_connection_expire);
+	conn->last_active = server->tick;
+	conn->last_ping = server->tick;
+	conn->adopted = adopted;
+	buffer_pool_init(&conn->pool);
+	LIST_INSERT_HEAD(&server->clients, conn, entries);
+	client_connection_schedule(server, conn);
 
-	free(server->libname); /* KLUDGE to avoid adding cleanup handling later */
-	server->libname = strdup(name);
-	if (!server->libname) {
-		return -IPC_ERROR_NO_MEMORY;
-	}
-	service_name_to_libname(server->libname);
+	if (__atomic_load_n(&server->rates, __ATOMIC_ACQUIRE))
+		conn->bucket = rate_bucket_for_peer(server, binding->is_tcp ? -1 : fd);
 
-	rv = lookup_dispatch_callback(server);
+	rv = server_add_change(server, fd, EVFILT_READ, EV_ADD | EV_ENABLE, conn);
 	if (rv < 0) {
-		log_error("unable to lookup dispatcher symbol");
+		client_connection_close(server, conn);
 		return rv;
 	}
+	conn->registered = 1;
+	return 0;
+}
 
-	fd = bind_to_name(server, statedir, name);
-	if (fd < 0) {
-		log_error("failed to bind");
-		return fd;
-	}
+/* Accept all pending connections to a service, up to ACCEPT_BATCH_MAX.
+ * Returns the number of connections accepted, or a negative error code. */
+static int
+ipc_accept(struct ipc_server *server, struct service_binding *binding) {
+	int client_fd;
+	int one = 1;
+	int count;
+	int rv;
 
-	log_info("bound to `%s' on fd %d", name, fd);
+	for (count = 0; count < ACCEPT_BATCH_MAX; count++) {
+		client_fd = accept_cloexec(binding->listenfd);
+		if (client_fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+				break;
+			if (errno == EINTR)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				shed_connection(server, binding);
+				break;
+			}
+			rv = IPC_CAPTURE_ERRNO;
+			log_errno("accept(2)");
+			return rv;
+		}
 
-	if (listen(fd, 1024) < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		log_errno("listen(2) on %d", fd);
-		close(fd);
-		return rv;
-	}
+		/* Responses are written in one piece, so there is nothing to wait for */
+		if (binding->is_tcp && setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY,
+					&one, sizeof(one)) < 0)
+			log_errno("setsockopt(2)");
 
-	server->listenfd = fd;
+		rv = client_connection_start(server, binding, client_fd, 0);
+		if (rv < 0)
+			return rv;
 
-	EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, (void *)event_type_client_accept);
-	if (kevent(server->pollfd, &kev, 1, NULL, 0, NULL) < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		log_errno("kevent(2)");
-		close(fd);
-		server->listenfd = -1;
-		return rv;
+		log_debug("accepted a connection on fd %d", client_fd);
 	}
 
-	return 0;
+	return count;
 }
 
-struct ipc_session VISIBLE *
-ipc_client_connect(struct ipc_client *client, int domain, const char *service)
+/* Pass a request to the skeleton, once it has a slot under its method's limit */
+static int
+dispatch_call(struct client_connection *conn, struct method_limit *limit,
+		struct ipc_message *request, char *body)
 {
-	struct server_connection *conn = NULL;
-	char statedir[PATH_MAX];
-	struct sockaddr_un sock;
-	int len;
-	int fd = -1;
+	int rv;
+
+	current_connection = conn;
+	current_limit = limit;
+	rv = (*conn->binding->dispatch_cb)(conn->fd, request, body);
+	/* Unless the call was deferred, it has completed by now */
+	if (current_limit)
+		method_limit_release(current_limit);
+	current_limit = NULL;
+	current_connection = NULL;
+	return rv;
+}
+
+/* Run waiting calls to a method, for as long as it has free slots */
+static int
+method_limit_run_waiting(struct method_limit *limit)
+{
+	struct waiting_call *call;
 	int rv = 0;
+	int result;
 
-	if (!client) {
-		client = ipc_client();
-	    if (!client) {
-	    	return NULL;
-	    }
-	}
+	while (__atomic_load_n(&limit->nwaiting, __ATOMIC_ACQUIRE) > 0 &&
+			method_limit_acquire(limit)) {
+		pthread_mutex_lock(&limit->server->waiting_mtx);
+		call = TAILQ_FIRST(&limit->waiting);
+		if (call) {
+			TAILQ_REMOVE(&limit->waiting, call, entries);
+			__atomic_sub_fetch(&limit->nwaiting, 1, __ATOMIC_ACQ_REL);
+		}
+		pthread_mutex_unlock(&limit->server->waiting_mtx);
+		if (!call) {
+			__atomic_sub_fetch(&limit->active, 1, __ATOMIC_ACQ_REL);
+			break;
+		}
+		timer_cancel(&limit->server->timers, &call->deadline);
 
-	/* Check if we already have a cached entry to the service */
-	SLIST_FOREACH(conn, &client->servers, sle) {
-		if (conn->domain == domain && strcmp(conn->service, service) == 0) {
-			return ((struct ipc_session *) conn);
+		if (call->conn->closed) {
+			/* Nobody is left to answer */
+			__atomic_sub_fetch(&limit->active, 1, __ATOMIC_ACQ_REL);
+		} else {
+			result = dispatch_call(call->conn, limit, &call->request,
+					call->request._ipc_bufsz > 0 ? call->body : NULL);
+			if (result < 0)
+				rv = result;
 		}
+		client_connection_release(call->conn);
+		free(call);
 	}
+	return rv;
+}
 
-	rv = validate_service_name(service);
-	if (rv < 0) {
-		client->last_error = rv;
-		goto err_out;
-	}
+/* Called on the event loop thread when a call has waited too long for a slot */
+static void
+waiting_call_expire(struct timer *timer, void *arg)
+{
+	struct waiting_call *call = (struct waiting_call *)
+		((char *) timer - offsetof(struct waiting_call, deadline));
+	struct method_limit *limit = method_limit_find(call->conn->binding,
+			call->request._ipc_method);
 
-	rv = get_statedir(domain, statedir, sizeof(statedir));
-	if (rv < 0) {
-		client->last_error = rv;
-		goto err_out;
-	}
+	(void) arg;
+	pthread_mutex_lock(&limit->server->waiting_mtx);
+	TAILQ_REMOVE(&limit->waiting, call, entries);
+	__atomic_sub_fetch(&limit->nwaiting, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&limit->server->waiting_mtx);
 
-	conn = server_connection_new(service);
-	if (!conn) {
-		client->last_error = -IPC_ERROR_NO_MEMORY;
-		goto err_out;
-	}
-	if (server_connection_load_stub(conn) < 0) {
-		log_error("unable to load the stub library");
-		goto err_out;
-	}
+	log_warning("call %u to method %u missed its deadline while waiting",
+			call->request._ipc_id, call->request._ipc_method);
+	if (!call->conn->closed)
+		(void) client_connection_send(call->conn, call->request._ipc_method,
+				call->request._ipc_id, -IPC_ERROR_TIMED_OUT, NULL, 0);
+	client_connection_release(call->conn);
+	free(call);
+}
 
-	sock.sun_family = AF_LOCAL;
-	len = snprintf(sock.sun_path, sizeof(sock.sun_path),
-			"%s/services/%s", statedir, service);
-	if (len >= sizeof(sock.sun_path)) {
-		client->last_error = -IPC_ERROR_NAME_TOO_LONG;
-		goto err_out;
+/* Called when calls in progress have completed, and others may be waiting */
+static int
+server_run_waiting(struct ipc_server *server)
+{
+	struct service_binding *binding;
+	int rv = 0;
+	int result;
+	int i;
+
+	LIST_FOREACH(binding, &server->bindings, entries) {
+		for (i = 0; i < binding->nlimits; i++) {
+			result = method_limit_run_waiting(binding->limits[i]);
+			if (result < 0)
+				rv = result;
+		}
 	}
-	if (len < 0) {
-		client->last_error = IPC_CAPTURE_ERRNO;
-		goto err_out;
+	return rv;
+}
+
+/* Queue a call until a slot under its method's limit becomes free */
+static int
+method_limit_wait(struct method_limit *limit, struct client_connection *conn,
+		struct ipc_message *request, char *body)
+{
+	struct waiting_call *call;
+	size_t offset;
+
+	offset = roundup(sizeof(*call), BODY_ALIGNMENT);
+	call = malloc(offset + request->_ipc_bufsz);
+	if (!call)
+		return -IPC_ERROR_NO_MEMORY;
+	call->conn = conn;
+	__atomic_add_fetch(&conn->refcnt, 1, __ATOMIC_ACQ_REL);
+	memcpy(&call->request, request, sizeof(*request));
+	call->body = (char *) call + offset;
+	if (request->_ipc_bufsz > 0)
+		memcpy(call->body, body, request->_ipc_bufsz);
+	timer_init(&call->deadline, waiting_call_expire);
+	if (limit->server->deadline_ticks)
+		server_timer_at(limit->server, &call->deadline,
+				limit->server->tick + limit->server->deadline_ticks);
+
+	pthread_mutex_lock(&limit->server->waiting_mtx);
+	TAILQ_INSERT_TAIL(&limit->waiting, call, entries);
+	__atomic_add_fetch(&limit->nwaiting, 1, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&limit->server->waiting_mtx);
+
+	/* A slot may have been freed since the caller looked */
+	return method_limit_run_waiting(limit);
+}
+
+/*
+ * Pass a request to the skeleton, unless its method is already running as
+ * many times as it may. In that case, the request waits or is rejected.
+ */
+static int
+dispatch_request(struct ipc_server *server, struct client_connection *conn,
+		struct ipc_message *request, char *body)
+{
+	struct method_limit *limit;
+
+	limit = method_limit_find(conn->binding, request->_ipc_method);
+	if (!limit)
+		return dispatch_call(conn, NULL, request, body);
+
+	/* Calls that are already waiting go first */
+	if (__atomic_load_n(&limit->nwaiting, __ATOMIC_ACQUIRE) == 0 &&
+			method_limit_acquire(limit))
+		return dispatch_call(conn, limit, request, body);
+
+	if (limit->flags & IPC_LIMIT_QUEUE)
+		return method_limit_wait(limit, conn, request, body);
+
+	log_debug("rejecting a call to method %u; limit of %d reached",
+			request->_ipc_method, limit->max);
+	return client_connection_send(conn, request->_ipc_method, request->_ipc_id,
+			-IPC_ERROR_LIMIT_EXCEEDED, NULL, 0);
+}
+
+/*
+ * Dispatch the complete requests in buf, for as long as the connection's
+ * deficit lasts. Whatever is left over is kept for later. If that includes
+ * a complete request, the connection waits on the run queue for its next
+ * turn, and is not read from until it has caught up.
+ */
+static int
+client_connection_run(struct ipc_server *server, struct client_connection *conn,
+		char *buf, size_t len)
+{
+	struct ipc_message request;
+	char *body;
+	size_t pos = 0;
+	size_t msglen;
+	int backlog = 0;
+	int rv = 0;
+	int result;
+
+	while (len - pos >= sizeof(request)) {
+		memcpy(&request, buf + pos, sizeof(request));
+		log_debug("request: method=%u body_size=%u", request._ipc_method,
+				request._ipc_bufsz);
+
+		result = ipc_message_validate(&request);
+		if (result < 0) {
+			log_error("an invalid message was received");
+			client_connection_close(server, conn);
+			return result;
+		}
+
+		msglen = sizeof(request) + request._ipc_bufsz;
+		if (len - pos < msglen)
+			break;
+		if (msglen > conn->deficit) {
+			backlog = 1;
+			break;
+		}
+		conn->deficit -= msglen;
+
+		if (conn->bucket && !rate_bucket_take(conn->bucket, msglen)) {
+			log_debug("rejecting a call to method %u; rate limit reached",
+					request._ipc_method);
+			result = client_connection_send(conn, request._ipc_method, request._ipc_id,
+					-IPC_ERROR_RATE_LIMITED, NULL, 0);
+			if (result < 0)
+				rv = result;
+			pos += msglen;
+			continue;
+		}
+
+		body = buf + pos + sizeof(request);
+		if ((uintptr_t) body % BODY_ALIGNMENT != 0) {
+			memcpy(server->bodybuf, body, request._ipc_bufsz);
+			body = server->bodybuf;
+		}
+
+		result = dispatch_request(server, conn, &request, request._ipc_bufsz > 0 ? body : NULL);
+		if (result < 0)
+			rv = result;
+		pos += msglen;
 	}
 
-	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
-	if (fd < 0) {
-		client->last_error = IPC_CAPTURE_ERRNO;
-		log_errno("socket(2)");
-		goto err_out;
+	if (pos < len) {
+		conn->partial = malloc(len - pos);
+		if (!conn->partial) {
+			log_error("out of memory");
+			client_connection_close(server, conn);
+			return -IPC_ERROR_NO_MEMORY;
+		}
+		memcpy(conn->partial, buf + pos, len - pos);
+		conn->partial_len = len - pos;
 	}
 
-	if (connect(fd, (struct sockaddr *) &sock, SUN_LEN(&sock)) < 0) {
-		client->last_error = IPC_CAPTURE_ERRNO;
-		log_errno("connect(2) to %s", sock.sun_path);
-		goto err_out;
+	if (backlog) {
+		if (conn->runnable) {
+			/* It has had its turn; go to the back of the queue */
+			TAILQ_REMOVE(&server->runq, conn, runq_entries);
+			TAILQ_INSERT_TAIL(&server->runq, conn, runq_entries);
+		} else {
+			TAILQ_INSERT_TAIL(&server->runq, conn, runq_entries);
+			conn->runnable = 1;
+			result = server_add_change(server, conn->fd, EVFILT_READ, EV_DISABLE, conn);
+			if (result < 0)
+				rv = result;
+		}
+	} else {
+		conn->deficit = 0;
+		if (conn->runnable) {
+			TAILQ_REMOVE(&server->runq, conn, runq_entries);
+			conn->runnable = 0;
+			result = server_add_change(server, conn->fd, EVFILT_READ, EV_ENABLE, conn);
+			if (result < 0)
+				rv = result;
+		}
 	}
-	conn->fd = fd;
 
-	log_debug("service `%s' connected to fd %d", service, fd);
+	return rv;
+}
+
+/* Take the leftover data of a connection, to be dispatched from the read buffer */
+static size_t
+client_connection_take_partial(struct ipc_server *server, struct client_connection *conn)
+{
+	size_t len;
 
-	SLIST_INSERT_HEAD(&client->servers, conn, sle);
+	if (!conn->partial)
+		return 0;
+	memcpy(server->readbuf + READ_BUFFER_OFFSET, conn->partial, conn->partial_len);
+	len = conn->partial_len;
+	free(conn->partial);
+	conn->partial = NULL;
+	conn->partial_len = 0;
+	return len;
+}
 
-	return (struct ipc_session *) conn;
+/* Whether a client runs as the same user as the server, or as root */
+static int
+client_connection_trusted(struct client_connection *conn)
+{
+	uid_t uid;
+	gid_t gid;
 
-err_out:
-	server_connection_free(conn);
-	close(fd);
-	return NULL;
+	if (ipc_getpeereid(conn->fd, &uid, &gid) < 0)
+		return 0;
+	return uid == 0 || uid == geteuid();
 }
 
-ipc_function_t VISIBLE
-ipc_session_stub(struct ipc_session *session, uint32_t method_id)
+/*
+ * Read as much as the client has sent in a single read(2), and dispatch
+ * the requests in it. A client that has been quiet gets its turn right away.
+ *
+ * The read buffer is shared by all connections, so idle connections do not
+ * hold on to any buffer space.
+ */
+static ssize_t
+client_connection_recv(struct client_connection *conn, char *buf, size_t len)
 {
-	struct server_connection *conn = (struct server_connection *) session;
-	ipc_function_t retfunc;
-	char symbol[PATH_MAX];
-	int len;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t bytes;
+	int flags = 0;
+	int fd;
 
-	len = snprintf(symbol, sizeof(symbol), "ipc_stub__%s__method_%u",
-			conn->libname, method_id);
-	if (len >= sizeof(symbol) || len < 0) {
-		return ((ipc_function_t) NULL);
-	}
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	bytes = recvmsg(conn->fd, &msg, flags);
+	if (bytes < 0)
+		return bytes;
 
-	retfunc = (ipc_function_t) dlfunc(conn->stub_dlh, symbol);
-	if (!retfunc) {
-		log_error("cannot resolve method; dlh=%p method=%s error=%s\n",
-				conn->stub_dlh, symbol, dlerror());
+	/* The client passes its buffer pool along with its first request */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+		if (conn->pool.base) {
+			/* Calls in progress may be using the one it has */
+			log_warning("ignoring another buffer pool on fd %d", conn->fd);
+			(void) close(fd);
+		} else if (buffer_pool_map(&conn->pool, fd, client_connection_trusted(conn)) < 0) {
+			log_error("unable to map the buffer pool passed on fd %d", conn->fd);
+		}
 	}
-	return retfunc;
+	if (msg.msg_flags & MSG_CTRUNC)
+		log_warning("descriptors passed on fd %d were discarded", conn->fd);
+	return bytes;
 }
 
 static int
-ipc_accept(struct ipc_server *server) {
-	struct kevent kev;
-	struct sockaddr sa;
-	socklen_t sa_len;
-	int client_fd;
+client_connection_read(struct ipc_server *server, struct client_connection *conn)
+{
+	char *buf = server->readbuf + READ_BUFFER_OFFSET;
+	size_t len;
+	ssize_t bytes;
 	int rv;
 
-	log_debug("waiting for a connection");
-	client_fd = accept(server->listenfd, &sa, &sa_len);
-	if (client_fd < 0) {
+	len = client_connection_take_partial(server, conn);
+	bytes = client_connection_recv(conn, buf + len, READ_BUFFER_SIZE - len);
+	if (bytes < 0) {
 		rv = IPC_CAPTURE_ERRNO;
-		log_errno("accept(2)");
+		log_errno("recvmsg(2) on %d", conn->fd);
+		client_connection_close(server, conn);
 		return rv;
 	}
-
-	struct client_connection *conn;
-	conn = malloc(sizeof(*conn));
-	if (!conn) {
-		log_error("out of memory");
-		close(client_fd);
-		return -IPC_ERROR_NO_MEMORY;
+	if (bytes == 0) {
+		/* The client has disconnected */
+		if (len > 0)
+			log_warning("discarding %zu bytes of an incomplete request", len);
+		client_connection_close(server, conn);
+		return 0;
 	}
-	conn->fd = client_fd;
-	SLIST_INSERT_HEAD(&server->clients, conn, sle);
+	len += bytes;
 
-	EV_SET(&kev, client_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, (void *)event_type_client_read);
-	if (kevent(server->pollfd, &kev, 1, NULL, 0, NULL) < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		log_errno("kevent(2)");
-		SLIST_REMOVE_HEAD(&server->clients, sle);
-		free(conn);
-		return rv;
-	}
+	conn->last_active = server->tick;
+	conn->deficit = SCHED_QUANTUM;
+	return client_connection_run(server, conn, buf, len);
+}
 
-	log_debug("accepted a connection on fd %d", client_fd);
+/*
+ * Give the connection at the head of the run queue its turn, using deficit
+ * round robin: each turn adds SCHED_QUANTUM bytes to what the connection
+ * may dispatch, so clients are served in proportion to the bytes they
+ * send, however many requests they have queued up.
+ */
+static int
+server_run_turn(struct ipc_server *server)
+{
+	struct client_connection *conn;
+	size_t len;
 
-	return client_fd;
+	conn = TAILQ_FIRST(&server->runq);
+	len = client_connection_take_partial(server, conn);
+	conn->deficit += SCHED_QUANTUM;
+	return client_connection_run(server, conn, server->readbuf + READ_BUFFER_OFFSET, len);
 }
 
-int VISIBLE
-ipc_server_dispatch(struct ipc_server *server)
+static int
+server_handle_event(struct ipc_server *server, struct kevent *kev)
 {
-	struct kevent kev;
-	struct ipc_message request;
-	int client;
+	struct event_source *evsrc;
+	struct client_connection *conn;
 	int rv;
-	ssize_t bytes;
-	char *buf = NULL;
 
-	rv = kevent(server->pollfd, NULL, 0, &kev, 1, NULL);
-	if (rv < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		log_errno("kevent(2)");
+	evsrc = (struct event_source *) kev->udata;
+	if (kev->flags & EV_ERROR) {
+		/* One of the changes submitted above could not be applied */
+		rv = IPC_ERRNO((int) kev->data);
+		log_error("kevent(2) registration of fd %d: %s",
+				(int) kev->ident, strerror((int) kev->data));
+		if (evsrc->type == event_type_client_read) {
+			conn = (struct client_connection *) evsrc;
+			if (kev->flags & EV_ADD)
+				conn->registered = 0;
+			client_connection_close(server, conn);
+		}
 		return rv;
 	}
-	if (rv == 0) {
-		log_debug("spurious wakeup; no events pending");
-		return 0;
-	}
 
-	switch ((intptr_t) kev.udata) {
+	switch (evsrc->type) {
 	case event_type_client_accept:
-		client = ipc_accept(server);
-		if (client < 0) {
+		rv = ipc_accept(server, (struct service_binding *) evsrc);
+		if (rv < 0) {
 			log_error("ipc_accept failed");
-			return client;
+			return rv;
 		}
 		return 0;
 
+	case event_type_wakeup:
+		return server_run_waiting(server);
+
+	case event_type_timer:
+		/* The timers are run once the event has been handled */
+		return 0;
+
 	case event_type_client_read:
-		client = kev.ident;
-		log_debug("pending data on fd %d", client);
-		break;
+		conn = (struct client_connection *) evsrc;
+		log_debug("pending data on fd %d", conn->fd);
+		return client_connection_read(server, conn);
 
 	default:
-		log_error("bad event type: %ld", (intptr_t)kev.udata);
+		log_error("bad event type: %d", evsrc->type);
 		return -1;
 	}
+}
 
-	bytes = read(client, &request, sizeof(request));
-	if (bytes < 0) {
+/* How long the event loop may sleep before a timer is due, or NULL for ever */
+static const struct timespec *
+server_timers_timeout(struct ipc_server *server, struct timespec *ts)
+{
+	uint64_t next, now;
+
+	next = timer_wheel_next(&server->timers);
+	if (next == TIMER_WHEEL_NEVER)
+		return NULL;
+	now = monotonic_ns() - server->epoch_ns;
+	next *= TIMER_TICK_NS;
+	ns_to_timespec(next > now ? next - now : 0, ts);
+	return ts;
+}
+
+int VISIBLE
+ipc_server_dispatch(struct ipc_server *server)
+{
+	static const struct timespec poll_only = { 0, 0 };
+	const struct timespec *timeout;
+	struct timespec ts;
+	struct kevent kev;
+	int runnable;
+	int rv, result;
+
+	/* Connections with a backlog are served between events, so just check for events */
+	runnable = !TAILQ_EMPTY(&server->runq);
+	timeout = runnable ? &poll_only : server_timers_timeout(server, &ts);
+	kev.filter = 0;
+	rv = kevent(server->pollfd, server->changes, server->nchanges, &kev, 1, timeout);
+
+	/*
+	 * A failed change takes the only slot in the eventlist, and libkqueue
+	 * leaves it out of the count, so look at the slot as well as at rv.
+	 */
+	if (server->nchanges > 0 && (rv < 0 || (rv == 0 && kev.filter != 0)))
+		return server_retry_changes(server);
+	server->nchanges = 0;
+	if (rv < 0) {
 		rv = IPC_CAPTURE_ERRNO;
-		log_errno("read(2) on %d", client);
-		close(client);
+		log_errno("kevent(2)");
 		return rv;
 	}
-	if (bytes < sizeof(request)) {
-		rv = -IPC_ERROR_ARGUMENT_INVALID;
-		log_error("short read; expected %zu, got %zu",
-				sizeof(request), bytes);
-		close(client);
-		return rv;
+	server->tick = (monotonic_ns() - server->epoch_ns) / TIMER_TICK_NS;
+	if (rv > 0) {
+		rv = server_handle_event(server, &kev);
+	} else if (!timeout) {
+		log_debug("spurious wakeup; no events pending");
+		return 0;
 	}
-	log_debug("request: method=%u body_size=%u", request._ipc_method,
-			request._ipc_bufsz
-			);
 
-	rv = ipc_message_validate(&request);
-	if (rv < 0) {
-		log_error("an invalid message was received");
-		close(client);
-		return rv;
-	}
+	/* Timers may close connections, so they wait until the event is handled */
+	timer_wheel_advance(&server->timers, server->tick, server);
 
-	if (request._ipc_bufsz > 0) {
-		buf = malloc(request._ipc_bufsz);
-		if (!buf) {
-			close(client);
-			return -IPC_ERROR_NO_MEMORY;
-		}
+	if (!TAILQ_EMPTY(&server->runq)) {
+		result = server_run_turn(server);
+		if (result < 0)
+			rv = result;
+	}
 
-		bytes = read(client, buf, request._ipc_bufsz);
-		if (bytes < 0) {
-			rv = IPC_CAPTURE_ERRNO;
-			log_errno("read(2) on %d", client);
-			free(buf);
-			close(client);
-			return rv;
-		}
-		if (bytes < request._ipc_bufsz) {
-			rv = -IPC_ERROR_ARGUMENT_INVALID;
-			log_error("short read; expected %u, got %ld",
-					request._ipc_bufsz, bytes);
-			free(buf);
-			close(client);
-			return rv;
+	if (server->external_poll) {
+		/* The caller will wait on pollfd, so it has to become readable */
+		if (!TAILQ_EMPTY(&server->runq)) {
+			result = server_register_wakeup(server);
+			if (result < 0)
+				return result;
+			server_wakeup(server);
 		}
+		result = server_flush_changes(server);
+		if (result < 0)
+			rv = result;
 	}
-
-	rv = (*server->dispatch_cb)(client, &request, buf);
-	free(buf);
-
 	return rv;
 }
 
@@ -772,12 +5044,18 @@ ipc_close(int s)
 
 int VISIBLE
 ipc_message_validate(struct ipc_message *msg)
+{
+	return message_validate(msg, IPC_MESSAGE_SIZE_MAX);
+}
+
+static int
+message_validate(const struct ipc_message *msg, uint32_t max)
 {
 	int i;
 	uint32_t argsz = 0;
 
 	/* TODO: create more specific error codes for these problems */
-	if (msg->_ipc_bufsz > IPC_MESSAGE_SIZE_MAX)
+	if (msg->_ipc_bufsz > max)
 		return -IPC_ERROR_NAME_TOO_LONG;
 	if (msg->_ipc_argc > IPC_ARGUMENT_MAX)
 		return -IPC_ERROR_ARGUMENT_INVALID;
@@ -849,6 +5127,18 @@ ipc_strerror(int code)
 		return "Connection failed";
 	case IPC_ERROR_MESSAGE_INVALID:
 		return "Invalid message structure";
+	case IPC_ERROR_BUSY:
+		return "Server busy";
+	case IPC_ERROR_LIMIT_EXCEEDED:
+		return "Too many calls to the method are in progress";
+	case IPC_ERROR_RATE_LIMITED:
+		return "Too many requests from this user";
+	case IPC_ERROR_UNAVAILABLE:
+		return "The service is failing, and calls to it are on hold";
+	case IPC_ERROR_TIMED_OUT:
+		return "The call did not complete in time";
+	case IPC_ERROR_SPOOL_FULL:
+		return "The spool of one-way calls is full";
 	}
 	if (code < -1000) {
 		return strerror((code * -1) - 1000);
@@ -44,10 +44,27 @@ module IPC
       type
     end
 
+    # A buffer in shared memory; only a reference to it is sent
+    def buffer?
+      base_type == 'struct ipc_buffer' or type == 'struct ipc_buffer *'
+    end
+
+    # A range of a file, which the server sends straight from the file
+    def file?
+      type == 'struct ipc_file *'
+    end
+
     # Copy in for stubs
     def copy_in(iovec)
       tok = []
       case return_type
+      when 'struct ipc_buffer'
+        tok << "#{iovec}.iov_base = &#{name};"
+        tok << "#{iovec}.iov_len = IPC_BUFFER_REF_SIZE;"
+      when 'struct ipc_buffer *'
+        # The range lent to the server for the result
+        tok << "#{iovec}.iov_base = #{name};"
+        tok << "#{iovec}.iov_len = IPC_BUFFER_REF_SIZE;"
       when 'char *'
         tok << "#{iovec}.iov_base = #{name};"
         tok << "#{iovec}.iov_len = (#{name} == NULL) ? 0 : strlen(#{name}) + 1;"
@@ -61,17 +78,49 @@ module IPC
       tok
     end
     
-    # Copy out for stubs?
-    def copy_out(iovec, argsz)
+    # Copy a result out of the response body, for stubs. If it is the only
+    # result, it may take over the body instead of copying it.
+    def copy_out(argsz, only = false)
       tok = []
-      if type == 'char **'
-        tok << "char *tmp_#{name} = malloc(#{argsz});"
-        tok << "#{iovec}.iov_base = tmp_#{name};"
-        tok << "#{iovec}.iov_len = #{argsz};"
+      if file? and only
+        tok << "if (#{argsz} > 0) {"
+        tok << "	#{name}->data = pos;"
+        tok << "	body = NULL;"
+        tok << "}"
+        tok << "#{name}->length = #{argsz};"
+      elsif file?
+        tok << "if (#{argsz} > 0) {"
+        tok << "	#{name}->data = malloc(#{argsz});"
+        tok << "	if (#{name}->data == NULL) {"
+        tok << "		rv = -IPC_ERROR_NO_MEMORY;"
+        tok << "		goto out;"
+        tok << "	}"
+        tok << "	memcpy(#{name}->data, pos, #{argsz});"
+        tok << "}"
+        tok << "#{name}->length = #{argsz};"
+      elsif type == 'char **'
+        tok << "if (#{argsz} > 0) {"
+        tok << "	*#{name} = malloc(#{argsz});"
+        tok << "	if (*#{name} == NULL) {"
+        tok << "		rv = -IPC_ERROR_NO_MEMORY;"
+        tok << "		goto out;"
+        tok << "	}"
+        tok << "	memcpy(*#{name}, pos, #{argsz});"
+        tok << "	(*#{name})[#{argsz} - 1] = '\\0';"
+        tok << "}"
+      elsif type == 'struct ipc_buffer *'
+        tok << "if (#{argsz} != IPC_BUFFER_REF_SIZE || ipc_buffer_update(#{name}, pos) < 0) {"
+        tok << "	rv = -IPC_ERROR_MESSAGE_INVALID;"
+        tok << "	goto out;"
+        tok << "}"
       else
-        tok << "#{iovec}.iov_base = #{name};"
-        tok << "#{iovec}.iov_len = sizeof(*#{name});"
+        tok << "if (#{argsz} != sizeof(*#{name})) {"
+        tok << "	rv = -IPC_ERROR_MESSAGE_INVALID;"
+        tok << "	goto out;"
+        tok << "}"
+        tok << "memcpy(#{name}, pos, sizeof(*#{name}));"
       end
+      tok << "pos += #{argsz};"
       tok
     end
 
@@ -79,16 +128,31 @@ module IPC
       tok = []
     end
 
-    def skeleton_copy_in
+    # Copy in for skeletons. The position is among the arguments that are
+    # passed by value, which are the only ones in the request, apart from
+    # the buffers lent for results. A reference to a buffer that is not in
+    # the pool of the client is answered with fail.
+    def skeleton_copy_in(position, ctx, fail)
       tok = []
-      if @type == 'char *'
+      if buffer?
+        tok << "#{base_type} #{name};" unless pointer?
+        tok << "if (ipc_buffer_resolve(#{ctx}, pos, request->_ipc_argsz[#{position}], &#{name}) < 0) {"
+        tok.concat fail.map { |line| "\t#{line}" }
+        tok << "}"
+      elsif @type == 'char *'
         tok << "#{return_type} #{name} = (#{type}) pos;"
       else
         tok << "#{return_type} #{name} = *((#{type} *) pos);"
       end
-      tok << "pos += request->_ipc_argsz[#{index - 1}];"
+      tok << "pos += request->_ipc_argsz[#{position}];"
       tok
     end
+
+    # The type of a result when it is passed by value: one level of
+    # indirection less, so a string result is a char *
+    def result_type
+      type.sub(/\s*\*\z/, '')
+    end
   end
 
   class Method
@@ -103,7 +167,240 @@ module IPC
       @prototype = spec['prototype']
       raise "method #{name}: prototype is required" unless @prototype
       raise "method #{name}: id is required" unless @method_id
+      # How the skeleton disposes of string results after sending them:
+      # 'free', 'none' for references to long-lived data, or the name of
+      # a function that takes the string as its only argument.
+      @release = spec['release'] || 'free'
+      unless @release =~ /\A[A-Za-z_][A-Za-z0-9_]*\z/
+        raise "method #{name}: release must be 'free', 'none', or a function name"
+      end
+      # An asynchronous method is passed a token instead of pointers to its
+      # results, and completes the call later with <name>_complete().
+      @async = spec['async'] ? true : false
+      # A blocking method runs on libipc's thread pool, not the event loop
+      @blocking = spec['blocking'] ? true : false
+      raise "method #{name}: cannot be both async and blocking" if @async and @blocking
+      # At most this many calls to the method are in progress at once; the
+      # rest wait their turn, or fail with IPC_ERROR_LIMIT_EXCEEDED.
+      @concurrency = spec['concurrency']
+      if @concurrency and (not @concurrency.is_a?(Integer) or @concurrency < 1)
+        raise "method #{name}: concurrency must be a positive integer"
+      end
+      @overflow = spec['overflow'] || 'reject'
+      unless %w(queue reject).include?(@overflow)
+        raise "method #{name}: overflow must be 'queue' or 'reject'"
+      end
+      # Calls to an idempotent method can safely be made more than once, so
+      # the client may retry them, or hedge them by sending them to another
+      # replica of the service when they are slow.
+      @idempotent = spec['idempotent'] ? true : false
+      @retries = spec['retries'] || (@idempotent ? 3 : 0)
+      @hedge = spec['hedge'] ? true : false
+      if not @retries.is_a?(Integer) or @retries < 0
+        raise "method #{name}: retries must be a non-negative integer"
+      end
+      if (@retries > 0 or @hedge) and not @idempotent
+        raise "method #{name}: only idempotent methods can be retried or hedged"
+      end
+      # A one-way method is not answered, so the client does not wait for it,
+      # and may keep calls in a spool while the server is down.
+      @oneway = spec['oneway'] ? true : false
+      if @oneway and (@retries > 0 or @hedge)
+        raise "method #{name}: one-way methods cannot be retried or hedged"
+      end
       parse_prototype
+      if @oneway and @returns.any?
+        raise "method #{name}: one-way methods cannot return anything"
+      end
+      if @oneway and @accepts.any? { |arg| arg.buffer? }
+        raise "method #{name}: buffers cannot be passed to one-way methods"
+      end
+      if @hedge and (@accepts + @returns).any? { |arg| arg.buffer? }
+        raise "method #{name}: buffers cannot be passed to hedged methods"
+      end
+      if @async and buffer_returns.any?
+        raise "method #{name}: asynchronous methods cannot return buffers"
+      end
+      if @accepts.any? { |arg| arg.base_type == 'struct ipc_file' }
+        raise "method #{name}: files can only be returned"
+      end
+      if @async and file_returns.any?
+        raise "method #{name}: asynchronous methods cannot return files"
+      end
+    end
+
+    # Files returned by the method
+    def file_returns
+      @returns.select { |ent| ent.file? }
+    end
+
+    # A mask of the results that are files, for ipc_response_send_files()
+    def files_mask
+      mask = 0
+      @returns.each_with_index { |ent, i| mask |= 1 << i if ent.file? }
+      format('0x%x', mask)
+    end
+
+    # Buffers lent to the server for results, which are sent after the arguments
+    def buffer_returns
+      @returns.select { |ent| ent.buffer? }
+    end
+
+    # Everything in the request, in order
+    def request_args
+      @accepts + buffer_returns
+    end
+
+    # An entry in the table of limits that the server applies at bind time
+    def limit_entry
+      return nil unless @concurrency
+      flags = @overflow == 'queue' ? 'IPC_LIMIT_QUEUE' : 'IPC_LIMIT_REJECT'
+      "{ #{method_id}, #{@concurrency}, #{flags} },"
+    end
+
+    # An entry in the table of retry policies that the client loads
+    def policy_entry
+      return nil unless @retries > 0 or @hedge or @oneway
+      flags = []
+      flags << 'IPC_POLICY_HEDGE' if @hedge
+      flags << 'IPC_POLICY_ONEWAY' if @oneway
+      "{ #{method_id}, #{@retries}, #{flags.empty? ? '0' : flags.join(' | ')} },"
+    end
+
+    def async?
+      @async
+    end
+
+    def oneway?
+      @oneway
+    end
+
+    def blocking?
+      @blocking
+    end
+
+    # The function that runs a blocking method on a pool thread
+    def blocking_name
+      'ipc_blocking__' + service.identifier + '__method_' + method_id.to_s
+    end
+
+    # Call the real function with the arguments in the request, and send
+    # the response by calling respond(<args>, status, results, nresults).
+    # The arguments are resolved for the token ctx, and a bad one is
+    # answered with fail.
+    def call_and_respond(respond, ctx, fail)
+      tok = []
+      tok << "struct iovec results[#{[@returns.length, 1].max}];"
+      tok << 'int rv;'
+      tok << ''
+      tok << '/* Setup temporary variables to hold the return values */'
+      @returns.each do |ret|
+        if ret.type == 'char **'
+          tok << "char *#{ret.name} = NULL;"
+        elsif ret.file?
+          tok << "struct ipc_file #{ret.name} = { -1, 0, 0, NULL };"
+        else
+          tok << "#{ret.result_type} #{ret.name};"
+        end
+      end
+      tok << ''
+      tok << '/* Copy in arguments */'
+      tok << 'void *pos = body;'
+      tok.concat skeleton_copy_in(ctx, fail)
+      tok << ''
+      tok << '/* Call the real function */'
+      tok << "rv = #{name}(#{archetype_args});"
+      tok << ''
+      tok << '/* Send the response */'
+      @returns.each_with_index do |ret, i|
+        if ret.type == 'char **'
+          tok << "results[#{i}].iov_base = #{ret.name};"
+          tok << "results[#{i}].iov_len = (#{ret.name} == NULL) ? 0 : strlen(#{ret.name}) + 1;"
+        elsif ret.buffer?
+          tok << "results[#{i}].iov_base = &#{ret.name};"
+          tok << "results[#{i}].iov_len = IPC_BUFFER_REF_SIZE;"
+        else
+          tok << "results[#{i}].iov_base = &#{ret.name};"
+          tok << "results[#{i}].iov_len = sizeof(#{ret.name});"
+        end
+      end
+      if file_returns.empty?
+        tok << "rv = #{respond}, rv, results, #{@returns.length});"
+      else
+        # libipc sends the contents of the files, and closes them
+        tok << "rv = #{respond.sub('(', '_files(')}, rv, results, #{@returns.length}, #{files_mask});"
+      end
+      tok.concat release_results
+      tok
+    end
+
+    def completion_name
+      name + '_complete'
+    end
+
+    # A typed wrapper around ipc_response_complete(), for the skeleton header
+    def completion_function
+      params = ['struct ipc_response *token', 'int status']
+      params.concat @returns.map { |ent| "#{ent.result_type} #{ent.name}" }
+      tok = []
+      tok << 'static inline int'
+      tok << "#{completion_name}(#{params.join(', ')})"
+      tok << '{'
+      tok << "\tstruct iovec results[#{[@returns.length, 1].max}];"
+      tok << "\tint rv;"
+      tok << ''
+      @returns.each_with_index do |ent, i|
+        if ent.type == 'char **'
+          tok << "\tresults[#{i}].iov_base = #{ent.name};"
+          tok << "\tresults[#{i}].iov_len = (#{ent.name} == NULL) ? 0 : strlen(#{ent.name}) + 1;"
+        else
+          tok << "\tresults[#{i}].iov_base = &#{ent.name};"
+          tok << "\tresults[#{i}].iov_len = sizeof(#{ent.name});"
+        end
+      end
+      tok << "\trv = ipc_response_complete(token, status, results, #{@returns.length});"
+      release_results.each { |line| tok << "\t#{line}" }
+      tok << "\treturn rv;"
+      tok << '}'
+      tok.join("\n")
+    end
+
+    # Unpack the results of a local call to an asynchronous method, in the
+    # same way as the stub does for a remote call.
+    def local_unpack
+      tok = []
+      tok << 'pos = body;'
+      @returns.each_with_index do |ent, i|
+        argsz = "response._ipc_argsz[#{i}]"
+        if ent.type == 'char **'
+          tok << "*#{ent.name} = NULL;"
+          tok << "if (#{argsz} > 0 && (*#{ent.name} = malloc(#{argsz})) != NULL) {"
+          tok << "\tmemcpy(*#{ent.name}, pos, #{argsz});"
+          tok << "\t(*#{ent.name})[#{argsz} - 1] = '\\0';"
+          tok << '}'
+        else
+          tok << "if (#{argsz} == sizeof(*#{ent.name}))"
+          tok << "\tmemcpy(#{ent.name}, pos, sizeof(*#{ent.name}));"
+        end
+        tok << "pos += #{argsz};"
+      end
+      tok
+    end
+
+    def string_returns
+      @returns.select { |ent| ent.type == 'char **' }
+    end
+
+    # A declaration of the release function, if the method has one
+    def release_declaration
+      return nil if %w{free none}.include?(@release) or string_returns.empty?
+      "extern void #{@release}(char *);"
+    end
+
+    # Dispose of the string results after they have been sent
+    def release_results
+      return [] if @release == 'none'
+      string_returns.map { |ent| "if (#{ent.name} != NULL) #{@release}(#{ent.name});" }
     end
 
     # Given a C function prototype, parse it into a list of @accepts and @returns
@@ -133,6 +430,10 @@ module IPC
           arg[:type] += ' *'
         when /u?int(8|16|32|64)_t/, 'int', 'long', 'bool', 'void', 'char'
           arg[:type] = node
+        when 'buffer'
+          arg[:type] = 'struct ipc_buffer'
+        when 'file'
+          arg[:type] = 'struct ipc_file'
         when 'const'
           # ignored, for now
         when ','
@@ -224,7 +525,86 @@ module IPC
     def skeleton_prototype
       "int #{stub_name}(int s, struct ipc_message *request, char *body)"
     end
-    
+
+    # The name of the function that calls the archetype directly, for
+    # clients in the same process as the server.
+    def local_name
+      'ipc_local__' + service.identifier + '__method_' + method_id.to_s
+    end
+
+    # Takes the same arguments as the stub, so clients can call either one
+    def local_prototype
+      tok = []
+      tok << 'struct ipc_session *session'
+      tok.concat @returns.map { |ent| "#{ent.return_type} #{ent.name}" }
+      tok.concat @accepts.map { |ent| "#{ent.type} #{ent.name}" }
+      "int #{local_name}(#{tok.join(', ')})"
+    end
+
+    def local_args
+      tok = []
+      if async?
+        tok << 'token'
+      else
+        tok.concat @returns.map { |ent| ent.name }
+      end
+      tok.concat @accepts.map { |ent| ent.name }
+      tok.join(', ')
+    end
+
+    # The results start out empty, as they do in the skeleton, so that a
+    # method that fails without setting them leaves nothing to copy out.
+    def local_init_results
+      return [] if async?
+      tok = []
+      string_returns.each { |ent| tok << "*#{ent.name} = NULL;" }
+      file_returns.each do |ent|
+        tok << "memset(#{ent.name}, 0, sizeof(*#{ent.name}));"
+        tok << "#{ent.name}->fd = -1;"
+      end
+      tok
+    end
+
+    # Remote callers always get their own malloc'd copy of a string result.
+    # If the method hands over ownership, a local caller can have the
+    # original; otherwise it gets a copy, and the original is released.
+    # If a copy cannot be made, the caller gets none of the results.
+    #
+    # Files are read into memory, as they would be sent to a remote caller.
+    def local_copy_out
+      return [] if async?
+      tok = []
+      file_returns.each do |ent|
+        tok << "if (ipc_file_load(#{ent.name}) < 0 && rv == 0)"
+        tok << "	rv = -IPC_ERROR_ARGUMENT_INVALID;"
+      end
+      return tok if @release == 'free'
+      strings = string_returns
+      strings.each_with_index do |ent, i|
+        tok << "if (*#{ent.name} != NULL) {"
+        tok << "	char *tmp = *#{ent.name};"
+        tok << "	*#{ent.name} = strdup(tmp);"
+        tok << "	#{@release}(tmp);" unless @release == 'none'
+        tok << "	if (*#{ent.name} == NULL) {"
+        strings[0...i].each do |copied|
+          tok << "		free(*#{copied.name});"
+          tok << "		*#{copied.name} = NULL;"
+        end
+        strings[(i + 1)..-1].each do |pending|
+          tok << "		if (*#{pending.name} != NULL) #{@release}(*#{pending.name});" unless @release == 'none'
+          tok << "		*#{pending.name} = NULL;"
+        end
+        file_returns.each do |file|
+          tok << "		free(#{file.name}->data);"
+          tok << "		#{file.name}->data = NULL;"
+        end
+        tok << "		return -IPC_ERROR_NO_MEMORY;"
+        tok << "	}"
+        tok << "}"
+      end
+      tok
+    end
+
     def prototype
       return skeleton_prototype if @service.kind_of?(Skeleton)
       template = <<__EOF__
@@ -247,7 +627,7 @@ __EOF__
       tok << 'extern int ' + name
       tok << '(' + "\n"
       tok << [
-        @returns.map { |ent| "#{ent.type} #{ent.name}" },
+        async? ? 'struct ipc_response *token' : @returns.map { |ent| "#{ent.type} #{ent.name}" },
         @accepts.map { |ent| "#{ent.type} #{ent.name}" },
       ].flatten.map { |s| "\t" + s }.join(",\n")
       tok << "\n);"
@@ -257,24 +637,26 @@ __EOF__
     def args_copy_in
       tok = []
       
-      tok << "struct iovec iov_in[#{@accepts.length + 1}];"
+      tok << "struct iovec iov_in[#{request_args.length + 1}];"
       tok << "iov_in[0].iov_base = &request;"
       tok << "iov_in[0].iov_len = sizeof(request);"
-      for i in 0.upto(@accepts.length - 1)
-        tok.concat(@accepts[i].copy_in("iov_in[#{i + 1}]"))
+      request_args.each_with_index do |arg, i|
+        tok.concat(arg.copy_in("iov_in[#{i + 1}]"))
       end
 
       # Fill in the message header
       tok << '' << "/* Set the header variables */"
       bufsz_tok = "request._ipc_bufsz = 0"
-      @accepts.each { |arg| bufsz_tok += " + iov_in[#{arg.index - 1}].iov_len" }
+      request_args.each_index { |i| bufsz_tok += " + iov_in[#{i + 1}].iov_len" }
       tok << bufsz_tok + ';'
       tok << "request._ipc_method = #{method_id};"
-      tok << "request._ipc_argc = #{@accepts.length};"
+      tok << "request._ipc_id = 0;"
+      tok << "request._ipc_argc = #{request_args.length};"
+      tok << "request._ipc_status = 0;"
       tok << "memset(&request._ipc_argsz, 0, " +
         "sizeof(request._ipc_argsz));"
       count = 0
-      @accepts.each do |arg|
+      request_args.each do |arg|
         tok << "request._ipc_argsz[#{count}] = iov_in[#{count + 1}].iov_len;"
         count += 1
       end
@@ -285,19 +667,30 @@ __EOF__
     # The arguments to the real function, as defined within the skeleton
     def archetype_args
       tok = []
-      @returns.map { |ent| tok << "&#{ent.name}" }
+      if async?
+        tok << 'token'
+      else
+        @returns.map { |ent| tok << "&#{ent.name}" }
+      end
       @accepts.map { |ent| tok << ent.name }
       tok.join(', ')
     end
+
+    def skeleton_copy_in(ctx, fail)
+      tok = []
+      request_args.each_with_index { |arg, i| tok.concat arg.skeleton_copy_in(i, ctx, fail) }
+      tok
+    end
     
-    # Copy out for stubs?
-    def copy_out(iovec, response)
+    # Copy the results out of the response body, for stubs
+    def copy_out(response)
       tok = []
-      tok << "struct iovec #{iovec}[#{returns.length}];"
-      iov_count = 0
-      @returns.each do |arg|
-        tok << arg.copy_out("#{iovec}[#{iov_count}]", "#{response}._ipc_argsz[#{iov_count}]")
-        iov_count += 1
+      tok << "if (#{response}._ipc_argc != #{returns.length}) {"
+      tok << "	rv = -IPC_ERROR_MESSAGE_INVALID;"
+      tok << "	goto out;"
+      tok << "}"
+      @returns.each_with_index do |arg, i|
+        tok.concat arg.copy_out("#{response}._ipc_argsz[#{i}]", @returns.length == 1)
       end
       tok
     end
@@ -305,12 +698,18 @@ __EOF__
   end
 
   class Service
-    attr_accessor :version, :name, :domain, :methods, :vtable
+    attr_accessor :version, :name, :domain, :address, :methods, :vtable
 
     def initialize(spec)
       @version = spec['version']
       @name = spec['service']
       @domain = spec['domain']
+      # A transport address such as tcp:host:port, which takes the place of
+      # the service's name in the statedir of its domain
+      @address = spec['address']
+      if @address and @address !~ /\A(unix|abstract|tcp):[^"\\]+\z/
+        raise "address must be unix:<path>, abstract:<name> or tcp:<host>:<port>"
+      end
       @methods = spec['methods'].map do |name, body|
         Method.new(self, name, body)
       end
@@ -335,6 +734,12 @@ __EOF__
       name.gsub(/[^A-Za-z0-9_]/, '_')
     end
 
+    # Both sides look up the address at run time, so that libipc can find it
+    def address_definition
+      return '' unless @address
+      "const char ipc_address__#{identifier}[] = \"#{@address}\";\n"
+    end
+
     def to_c_stub_header
       template = <<__EOF__
 #ifndef #{include_guard_name}
@@ -360,64 +765,62 @@ __EOF__
         
 #include <ipc.h>
       
-<% @methods.each do |method| %>
+<%= address_definition %>
+/* Retry policies of idempotent methods, and which methods are one-way, ending with an empty entry */
+const struct ipc_method_policy ipc_policies__#{identifier}[] = {
+<% @methods.map { |method| method.policy_entry }.compact.each do |entry| %>
+	<%= entry %>
+<% end %>
+	{ 0, 0, 0 }
+};
+
+<% @methods.select { |method| method.oneway? }.each do |method| %>
+<%= method.prototype %>
+{
+	struct ipc_message request;
+<% method.args_copy_in.each do |line| -%>
+	<%= line %>
+<% end -%>
+
+	return ipc_session_send(session, iov_in, <%= method.request_args.length + 1 %>);
+}
+<% end %>
+<% @methods.reject { |method| method.oneway? }.each do |method| %>
 <%= method.prototype %>
 {
 	struct ipc_message request;
 	struct ipc_message response;
-	char *buf = NULL;
-	int fd = -1;
+	char *body = NULL;
+	char *pos;
 	int rv = 0;
-	ssize_t bytes;
 	
-	fd = ipc_session_fd(session);
-
+<% method.string_returns.each do |arg| -%>
+	*<%= arg.name %> = NULL;
+<% end -%>
+<% method.file_returns.each do |arg| -%>
+	memset(<%= arg.name %>, 0, sizeof(*<%= arg.name %>));
+	<%= arg.name %>->fd = -1;
+<% end -%>
 <% method.args_copy_in.each do |line| -%>
 	<%= line %>
 <% end -%>
   
-	bytes = writev(fd, (struct iovec *) &iov_in, <%= method.accepts.length + 1 %>);
-	if (bytes < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		goto out;
-	}
-	if (bytes < request._ipc_bufsz) {
-		rv = -73; /* FIXME: need an error code / logging */
-		goto out; 
-	}
+	rv = ipc_session_call(session, iov_in, <%= method.request_args.length + 1 %>, &response, &body);
+	if (rv < 0)
+		return rv;
 
-	if (read(fd, &response, sizeof(response)) < sizeof(response)) {
-		rv = IPC_CAPTURE_ERRNO;
-		goto out;
-	}
-
-	rv = ipc_message_validate(&response);
-	if (rv < 0) goto out;
-	
 	if (response._ipc_bufsz > 0) {
-<% method.copy_out("iov", "response").flatten.each do |line| -%>
+		pos = body;
+<% method.copy_out("response").each do |line| -%>
 <%= "\t\t" + line %>
-<% end -%>
-		if (readv(fd, (struct iovec *) &iov, <%= method.returns.length %>) < response._ipc_bufsz) {
-			rv = IPC_CAPTURE_ERRNO;
-			goto out;
-		}
-<% method.returns.each do |arg| -%>
-<%  if arg.type == 'char **' -%>
-		if (response._ipc_argsz[<%= arg.index - 1%>] == 0) {
-			free(tmp_<%= arg.name %>);
-			<%= arg.name %> = NULL;
-		} else {
-      *<%= arg.name %> = tmp_<%= arg.name %>;
-			*<%= arg.name %>[response._ipc_argsz[<%= arg.index - 1 %>] -1] = '\\0';
-		}
-<%  end -%>
 <% end -%>
 	}
 
+	/* The return value of the method on the server */
+	rv = response._ipc_status;
+
 out:
-	free(buf);
-	close(fd);
+	free(body);
 	return rv;
 }
 <% end %>
@@ -434,20 +837,23 @@ __EOF__
   
   # Generated code executed on the server-side
   class Skeleton < Service
+    # Declarations for the server, including the functions that
+    # asynchronous methods use to complete their calls
     def to_c_header
       template = <<__EOF__
 #ifndef #{include_guard_name}
 #define #{include_guard_name}
 
+#include <string.h>
+#include <stdlib.h>
+
 #include <ipc.h>
 
 int ipc_dispatch__#{identifier}(int, struct ipc_message *, char *);
 
-#{
-      if false
-      @methods.map { |method| method.prototype.gsub('ipc_stub__', 'ipc_skeleton__') }.join("\n")
-      end
-      };
+<%= @methods.map { |method| method.release_declaration }.compact.uniq.join("\n") %>
+
+<%= @methods.select { |method| method.async? }.map { |method| method.completion_function }.join("\n\n") %>
 
 #endif /* !#{include_guard_name} */
 __EOF__
@@ -467,6 +873,17 @@ __EOF__
 
 <%= @methods.map { |method| method.archetype }.join("\n\n") %>
 
+<%= @methods.map { |method| method.release_declaration }.compact.uniq.join("\n") %>
+
+<%= address_definition %>
+/* Limits on concurrent calls, ending with an empty entry */
+const struct ipc_method_limit ipc_limits__#{identifier}[] = {
+<% @methods.map { |method| method.limit_entry }.compact.each do |entry| %>
+	<%= entry %>
+<% end %>
+	{ 0, 0, 0 }
+};
+
 int ipc_dispatch__#{identifier}(int s, struct ipc_message *request, char *body)
 {
 	int (*method)(int, struct ipc_message *, char *);
@@ -484,62 +901,92 @@ int ipc_dispatch__#{identifier}(int s, struct ipc_message *request, char *body)
 	return (*method)(s, request, body);
 }
 
+<% @methods.select { |method| method.blocking? }.each do |method| %>
+/* Runs on a pool thread */
+static void
+<%= method.blocking_name %>(struct ipc_response *token, struct ipc_message *request, char *body)
+{
+<% method.call_and_respond('ipc_response_complete(token', 'token', ['(void) ipc_response_complete(token, -IPC_ERROR_MESSAGE_INVALID, NULL, 0);', 'return;']).each do |line| -%>
+	<%= line %>
+<% end -%>
+	/* There is nobody to return rv to; libipc has logged any failure */
+	(void) rv;
+}
+<% end %>
+
 <% @methods.each do |method| %>
 <%= method.prototype  %>
 {
-	int rv = 0;
-	struct ipc_message response;
-	struct iovec iov_in[<%= method.accepts.length %>];
-	struct iovec iov_out[<%= method.returns.length + 1%>];
-	ssize_t bytes;
+<% if method.async? -%>
+	struct ipc_response *token;
+	int rv;
 
-	/* Setup temporary variables to hold the return values */
-<% method.returns.each do |ret| -%>
-	<%= ret.type.gsub(/\\*\\z/, '') %> <%= ret.name %>;
-<% end -%>
-	
 	/* Copy in arguments */
 	void *pos = body;
-<% method.accepts.map { |arg| arg.skeleton_copy_in }.flatten.each do |line| -%>
+<% method.skeleton_copy_in('NULL', ['return ipc_response_send(request, -IPC_ERROR_MESSAGE_INVALID, NULL, 0);']).each do |line| -%>
 	<%= line %>
 <% end -%>
-	
-	/* Call the real function */
+
+	token = ipc_response_token(request);
+	if (!token)
+		return -IPC_ERROR_NO_MEMORY;
+
+	/* The method completes the call later, unless it fails right away */
 	rv = <%= method.name %>(<%= method.archetype_args %>);
-  
-	/* Prepare the response */
-	iov_out[0].iov_base = &response;
-	iov_out[0].iov_len = sizeof(response);
-	response._ipc_bufsz = 0;
-	response._ipc_method = request->_ipc_method;
-	response._ipc_argc = <%= method.returns.length %>;
-	memset(&response._ipc_argsz, 0, sizeof(response._ipc_argsz));
-<% method.returns.each do |ret| -%>
-<% if ret.type == 'char **' -%>
-	iov_out[<%= ret.index %>].iov_base = <%= ret.name %>;
-	iov_out[<%= ret.index %>].iov_len = strlen(<%= ret.name %>) + 1;
+	if (rv != 0)
+		return ipc_response_complete(token, rv, NULL, 0);
+	return 0;
+<% elsif method.blocking? -%>
+	/* Run the method on a pool thread, so the event loop is not held up */
+	return ipc_response_offload(request, body, &<%= method.blocking_name %>);
 <% else -%>
-	iov_out[<%= ret.index %>].iov_base = &<%= ret.name %>;
-	iov_out[<%= ret.index %>].iov_len = sizeof(<%= ret.name %>);
+<% method.call_and_respond('ipc_response_send(request', 'NULL', ['return ipc_response_send(request, -IPC_ERROR_MESSAGE_INVALID, NULL, 0);']).each do |line| -%>
+	<%= line %>
 <% end -%>
-	response._ipc_argsz[<%= ret.index - 1 %>] = iov_out[<%= ret.index %>].iov_len;
-	response._ipc_bufsz += iov_out[<%= ret.index %>].iov_len;
-<% end -%>   
-      
-	/* Send the response */
-	bytes = writev(s, (struct iovec *) &iov_out, <%= method.returns.length + 1%>);
-	if (bytes < 0) {
-		rv = IPC_CAPTURE_ERRNO;
-		goto out;
-	}
-	if (bytes < response._ipc_bufsz) {
-		rv = -1; /* TODO: return code for a short write */
-		goto out;
-	}
 
-out:
-	close(s);
+	/* The connection belongs to libipc, which closes it when the client does */
 	return rv;
+<% end -%>
+}
+
+/* Called instead of the stub when the client is in the same process */
+<%= method.local_prototype %>
+{
+<% if method.async? -%>
+	struct ipc_response *token;
+	struct ipc_message response;
+	char *body;
+	char *pos;
+	int rv;
+
+	token = ipc_response_local();
+	if (!token)
+		return -IPC_ERROR_NO_MEMORY;
+	rv = <%= method.name %>(<%= method.local_args %>);
+	if (rv != 0)
+		(void) ipc_response_complete(token, rv, NULL, 0);
+	rv = ipc_response_wait(token, &response, &body);
+	if (rv < 0)
+		return rv;
+<% method.local_unpack.each do |line| -%>
+	<%= line %>
+<% end -%>
+	free(body);
+	return response._ipc_status;
+<% elsif method.local_init_results.empty? -%>
+	return <%= method.name %>(<%= method.local_args %>);
+<% else -%>
+	int rv;
+
+<% method.local_init_results.each do |line| -%>
+	<%= line %>
+<% end -%>
+	rv = <%= method.name %>(<%= method.local_args %>);
+<% method.local_copy_out.each do |line| -%>
+	<%= line %>
+<% end -%>
+	return rv;
+<% end -%>
 }
 <% end %>
 __EOF__
@@ -572,7 +1019,10 @@ __EOF__
       File.open("#{@outdir}/#{@service.identifier}.h", "w+") do |f|
         f.puts "/* Automatically generated by ipcc(1) -- do not edit */\n"
         f.puts @service.to_c_stub_header
-        #DEADWOOD: f.puts @skeleton.to_c_header
+      end
+      File.open("#{@outdir}/#{@service.identifier}_skeleton.h", "w+") do |f|
+        f.puts "/* Automatically generated by ipcc(1) -- do not edit */\n"
+        f.puts @skeleton.to_c_header
       end
       @skeleton_source = "#{@outdir}/#{@service.identifier}.ipc-skeleton.c" 
       File.open(@skeleton_source, "w+") do |f|
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/ipc.h"
+#include "spool.h"
+#include "log.h"
+
+/* "ipcspool" */
+#define SPOOL_MAGIC 0x6c6f6f7073637069ULL
+
+void
+spool_init(struct spool *spool)
+{
+	spool->fd = -1;
+	spool->base = NULL;
+	spool->header = NULL;
+	spool->ring = NULL;
+}
+
+/* Check that the header of an existing file describes a ring that can be used */
+static int
+spool_header_valid(const struct spool_header *h, off_t size)
+{
+	if (h->magic != SPOOL_MAGIC)
+		return 0;
+	if (h->capacity == 0 || size != SPOOL_HEADER_SIZE + (off_t) h->capacity)
+		return 0;
+	if (h->head > h->tail || h->tail - h->head > h->capacity)
+		return 0;
+	if (h->wrap != 0 && (h->wrap < h->head || h->wrap > h->tail))
+		return 0;
+	return 1;
+}
+
+/*
+ * Open a spool file, creating it if need be. If the file already holds a
+ * valid spool, its requests are kept, along with its size. The file is
+ * locked, so that only one process at a time uses it.
+ */
+int
+spool_open(struct spool *spool, const char *path, size_t capacity)
+{
+	struct spool_header h;
+	struct stat sb;
+	int rv;
+
+	/* Any request must fit */
+	if (capacity < sizeof(struct ipc_message) + IPC_MESSAGE_SIZE_MAX)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (spool->fd < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("open(2) of `%s'", path);
+		return rv;
+	}
+	if (flock(spool->fd, LOCK_EX | LOCK_NB) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_error("spool `%s' is in use by another process", path);
+		spool_close(spool);
+		return rv;
+	}
+	if (fstat(spool->fd, &sb) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("fstat(2)");
+		spool_close(spool);
+		return rv;
+	}
+
+	memset(&h, 0, sizeof(h));
+	if (sb.st_size > 0 && (pread(spool->fd, &h, sizeof(h), 0) != sizeof(h) ||
+			!spool_header_valid(&h, sb.st_size))) {
+		log_warning("`%s' is not a valid spool; starting afresh", path);
+		memset(&h, 0, sizeof(h));
+	}
+	if (h.magic == SPOOL_MAGIC) {
+		log_debug("resuming spool `%s' with %llu bytes of requests", path,
+				(unsigned long long) (h.tail - h.head));
+		capacity = h.capacity;
+	} else if (ftruncate(spool->fd, 0) < 0 ||
+			ftruncate(spool->fd, SPOOL_HEADER_SIZE + capacity) < 0) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("ftruncate(2)");
+		spool_close(spool);
+		return rv;
+	}
+
+	spool->base = mmap(NULL, SPOOL_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE,
+			MAP_SHARED, spool->fd, 0);
+	if (spool->base == MAP_FAILED) {
+		rv = IPC_CAPTURE_ERRNO;
+		log_errno("mmap(2)");
+		spool->base = NULL;
+		spool_close(spool);
+		return rv;
+	}
+	spool->header = (struct spool_header *) spool->base;
+	spool->ring = spool->base + SPOOL_HEADER_SIZE;
+	if (spool->header->magic != SPOOL_MAGIC) {
+		spool->header->capacity = capacity;
+		spool->header->head = 0;
+		spool->header->tail = 0;
+		spool->header->wrap = 0;
+		spool->header->magic = SPOOL_MAGIC;
+	}
+	return 0;
+}
+
+void
+spool_close(struct spool *spool)
+{
+	if (spool->base)
+		(void) munmap(spool->base, SPOOL_HEADER_SIZE + spool->header->capacity);
+	if (spool->fd >= 0)
+		(void) close(spool->fd);
+	spool_init(spool);
+}
+
+/*
+ * Add a request at the tail. Returns -IPC_ERROR_SPOOL_FULL if there is no
+ * room for it until older requests are taken out.
+ */
+int
+spool_append(struct spool *spool, const struct iovec *iov, int iovcnt)
+{
+	struct spool_header *h = spool->header;
+	uint64_t cap = h->capacity;
+	uint64_t start;
+	size_t len = 0;
+	char *pos;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > cap)
+		return -IPC_ERROR_ARGUMENT_INVALID;
+
+	/* Requests are sent straight from the ring, so they are never split */
+	start = h->tail;
+	if (len > cap - start % cap)
+		start += cap - start % cap;
+	if (start + len - h->head > cap)
+		return -IPC_ERROR_SPOOL_FULL;
+	if (start != h->tail)
+		h->wrap = h->tail;
+
+	pos = spool->ring + start % cap;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	/* If the process dies, a request is either in the file whole, or not at all */
+	__sync_synchronize();
+	h->tail = start + len;
+	return 0;
+}
+
+/*
+ * Find up to max requests at the head that are next to each other in the
+ * ring, so that they can be sent in one piece. Returns their total length,
+ * 0 if the spool is empty, or -IPC_ERROR_MESSAGE_INVALID if the file has
+ * been damaged.
+ */
+ssize_t
+spool_peek(struct spool *spool, char **batch, int max, int *count)
+{
+	struct spool_header *h = spool->header;
+	struct ipc_message header;
+	uint64_t cap = h->capacity;
+	uint64_t end, pos;
+	int n = 0;
+
+	if (h->wrap != 0 && h->head == h->wrap) {
+		h->head += cap - h->head % cap;
+		h->wrap = 0;
+	}
+	if (h->head == h->tail)
+		return 0;
+
+	end = h->wrap != 0 ? h->wrap : h->tail;
+	if (end > h->head - h->head % cap + cap)
+		end = h->head - h->head % cap + cap;
+	for (pos = h->head; pos < end && n < max; n++) {
+		if (end - pos < sizeof(header))
+			return -IPC_ERROR_MESSAGE_INVALID;
+		memcpy(&header, spool->ring + pos % cap, sizeof(header));
+		if (header._ipc_bufsz > IPC_MESSAGE_SIZE_MAX ||
+				end - pos - sizeof(header) < header._ipc_bufsz)
+			return -IPC_ERROR_MESSAGE_INVALID;
+		pos += sizeof(header) + header._ipc_bufsz;
+	}
+	*batch = spool->ring + h->head % cap;
+	*count = n;
+	return pos - h->head;
+}
+
+/* Take requests that have been answered out of the spool */
+void
+spool_consume(struct spool *spool, size_t len)
+{
+	spool->header->head += len;
+}
+
+/* Throw away every request in the spool */
+void
+spool_discard(struct spool *spool)
+{
+	spool->header->head = spool->header->tail;
+	spool->header->wrap = 0;
+}
+
+int
+spool_empty(const struct spool *spool)
+{
+	return spool->header->head == spool->header->tail;
+}
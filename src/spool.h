@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+/*
+ * A ring of requests in a memory-mapped file, for one-way calls that wait
+ * for their service. Requests are appended at the tail, whole, and taken
+ * from the head once the server has answered them; because the file is
+ * shared, they outlive the process that made them. The file starts with
+ * a header page, and head and tail count bytes from the first request ever
+ * appended. A request that does not fit before the end of the ring goes at
+ * its start, and the header records where the requests before it stop.
+ */
+
+/* The size of the header at the start of the file */
+#define SPOOL_HEADER_SIZE 4096
+
+struct spool_header {
+	uint64_t magic;
+	uint64_t capacity; /** The size of the ring, in bytes */
+	uint64_t head; /** The offset of the oldest request */
+	uint64_t tail; /** The offset just past the newest request */
+	uint64_t wrap; /** Where the requests in the lap of head stop short of its end, or 0 */
+};
+
+struct spool {
+	int fd; /** The spool file, or -1 */
+	char *base; /** Where the file is mapped, or NULL */
+	struct spool_header *header;
+	char *ring; /** The requests, after the header */
+};
+
+void spool_init(struct spool *spool);
+int spool_open(struct spool *spool, const char *path, size_t capacity);
+void spool_close(struct spool *spool);
+int spool_append(struct spool *spool, const struct iovec *iov, int iovcnt);
+ssize_t spool_peek(struct spool *spool, char **batch, int max, int *count);
+void spool_consume(struct spool *spool, size_t len);
+void spool_discard(struct spool *spool);
+int spool_empty(const struct spool *spool);
+
+#endif /* SPOOL_H_ */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* The furthest ahead that a timer can be set; later ones fire at this point */
+#define TIMER_WHEEL_RANGE (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void
+timer_wheel_init(struct timer_wheel *wheel)
+{
+	int level, slot;
+
+	memset(wheel, 0, sizeof(*wheel));
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+			LIST_INIT(&wheel->slots[level][slot]);
+	}
+}
+
+void
+timer_init(struct timer *timer, timer_func_t func)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->func = func;
+}
+
+/* Put a timer in the slot for its expiry, on the lowest level that reaches it */
+static void
+timer_place(struct timer_wheel *wheel, struct timer *timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	int level = 0;
+
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+			delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	timer->level = level;
+	timer->slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	LIST_INSERT_HEAD(&wheel->slots[level][timer->slot], timer, entries);
+	wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+static void
+timer_unlink(struct timer_wheel *wheel, struct timer *timer)
+{
+	LIST_REMOVE(timer, entries);
+	if (LIST_EMPTY(&wheel->slots[timer->level][timer->slot]))
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+void
+timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t ticks)
+{
+	if (timer->pending)
+		timer_unlink(wheel, timer);
+	else
+		wheel->count++;
+	if (ticks == 0)
+		ticks = 1;
+	if (ticks >= TIMER_WHEEL_RANGE)
+		ticks = TIMER_WHEEL_RANGE - 1;
+	timer->expires = wheel->now + ticks;
+	timer->pending = 1;
+	timer_place(wheel, timer);
+}
+
+void
+timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (!timer->pending)
+		return;
+	timer_unlink(wheel, timer);
+	timer->pending = 0;
+	wheel->count--;
+}
+
+static uint64_t
+rotate_right(uint64_t bits, unsigned int n)
+{
+	n &= 63;
+	return n ? (bits >> n) | (bits << (64 - n)) : bits;
+}
+
+uint64_t
+timer_wheel_next(const struct timer_wheel *wheel)
+{
+	uint64_t next = TIMER_WHEEL_NEVER;
+	uint64_t period, tick, ahead;
+	unsigned int shift, level;
+
+	if (wheel->count == 0)
+		return TIMER_WHEEL_NEVER;
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (wheel->occupied[level] == 0)
+			continue;
+		/*
+		 * The current slot of each level has already been handled, so
+		 * look at the slots after it, wrapping around to it last.
+		 */
+		shift = TIMER_WHEEL_BITS * level;
+		period = wheel->now >> shift;
+		ahead = rotate_right(wheel->occupied[level], (period + 1) & TIMER_WHEEL_MASK);
+		tick = (period + 1 + __builtin_ctzll(ahead)) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/* Move the timers of the current slot of a level down to the levels below */
+static void
+timer_wheel_cascade(struct timer_wheel *wheel, int level)
+{
+	struct timer *timer;
+	int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	while ((timer = LIST_FIRST(&wheel->slots[level][slot])) != NULL) {
+		timer_unlink(wheel, timer);
+		timer_place(wheel, timer);
+	}
+}
+
+static void
+timer_wheel_tick(struct timer_wheel *wheel, void *arg)
+{
+	struct timer *timer;
+	int level, slot;
+
+	wheel->now++;
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		if ((wheel->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+			break;
+		timer_wheel_cascade(wheel, level);
+	}
+
+	/*
+	 * A timer may add or cancel others, including those due now. Timers
+	 * that are added always fire on a later tick, so never land here.
+	 */
+	slot = wheel->now & TIMER_WHEEL_MASK;
+	while ((timer = LIST_FIRST(&wheel->slots[0][slot])) != NULL) {
+		timer_cancel(wheel, timer);
+		(*timer->func)(timer, arg);
+	}
+}
+
+void
+timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, void *arg)
+{
+	uint64_t next;
+
+	/* Skip over the ticks where nothing happens */
+	while (wheel->now < now) {
+		next = timer_wheel_next(wheel);
+		if (next > now) {
+			wheel->now = now;
+			break;
+		}
+		wheel->now = next - 1;
+		timer_wheel_tick(wheel, arg);
+	}
+}
+
+struct timer *
+timer_wheel_pop(struct timer_wheel *wheel)
+{
+	struct timer *timer;
+	int level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (wheel->occupied[level] == 0)
+			continue;
+		timer = LIST_FIRST(&wheel->slots[level][__builtin_ctzll(wheel->occupied[level])]);
+		timer_cancel(wheel, timer);
+		return timer;
+	}
+	return NULL;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <sys/queue.h>
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel: each level has 64 slots, and each slot of a
+ * level spans a whole turn of the level below it. Adding and cancelling a
+ * timer take constant time, and a timer moves down a level at most three
+ * times before it fires, however many timers there are.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Returned by timer_wheel_next() when there are no timers */
+#define TIMER_WHEEL_NEVER UINT64_MAX
+
+struct timer;
+
+/* Called when a timer fires, with the argument given to timer_wheel_advance() */
+typedef void (*timer_func_t)(struct timer *, void *);
+
+struct timer {
+	LIST_ENTRY(timer) entries;
+	uint64_t expires; /** The tick that the timer fires on */
+	timer_func_t func;
+	uint8_t level; /** Where the timer is in the wheel, if pending */
+	uint8_t slot;
+	uint8_t pending; /** If true, the timer is in a wheel */
+};
+
+struct timer_wheel {
+	uint64_t now; /** The current tick */
+	unsigned int count; /** The number of pending timers */
+	uint64_t occupied[TIMER_WHEEL_LEVELS]; /** A bit for each slot that holds timers */
+	LIST_HEAD(, timer) slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *wheel);
+void timer_init(struct timer *timer, timer_func_t func);
+
+/* Fire the timer after the given number of ticks, replacing any earlier time */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t ticks);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/*
+ * The tick by which the wheel next has to be advanced, for a timer to fire
+ * or to move down a level. The wheel can sleep until then.
+ */
+uint64_t timer_wheel_next(const struct timer_wheel *wheel);
+
+/* Move the wheel forward to the given tick, firing every timer due by then */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now, void *arg);
+
+/* Remove any one pending timer, or return NULL if there are none */
+struct timer *timer_wheel_pop(struct timer_wheel *wheel);
+
+#endif /* TIMER_WHEEL_H_ */
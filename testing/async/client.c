@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Start a slow asynchronous call, and check that the server answers other
+ * calls while it is outstanding. The server is freed while the last call
+ * is still outstanding, so that call fails.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_async.h>
+
+static int delay_done;
+
+static void *
+call_delay(void *arg)
+{
+	int response = -1;
+	int rv;
+
+	rv = delay(&response, 42);
+	if (rv != 0 || response != 42)
+		errx(1, "FAIL: delay: rv=%d response=%d", rv, response);
+	__atomic_store_n(&delay_done, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid;
+	int response = -1;
+	char *text;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.async", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	if (pthread_create(&tid, NULL, call_delay, NULL) != 0)
+		errx(1, "pthread_create()");
+	usleep(50000);
+
+	rv = echo(&response, 123);
+	if (rv != 0 || response != 123)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+	if (__atomic_load_n(&delay_done, __ATOMIC_SEQ_CST))
+		errx(1, "FAIL: echo was not answered until delay completed");
+
+	pthread_join(tid, NULL);
+
+	rv = fetch(&text, 1);
+	if (rv != 0 || text == NULL || strcmp(text, "fetched") != 0)
+		errx(1, "FAIL: fetch: rv=%d", rv);
+	free(text);
+
+	rv = fetch(&text, 0);
+	if (rv != -1 || text != NULL)
+		errx(1, "FAIL: fetch of a missing key: rv=%d", rv);
+
+	rv = delay(&response, 7);
+	if (rv >= 0)
+		errx(1, "FAIL: delay on a server that was freed: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Calls made by the server to its own asynchronous methods. This is kept
+ * apart from server.c, because the stub header and the server both define
+ * the methods.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/ipc.h"
+#include <ipc/com_example_async.h>
+
+void
+call_local(void)
+{
+	int response = -1;
+	char *text;
+	int rv;
+
+	rv = delay(&response, 7);
+	if (rv != 0 || response != 7)
+		errx(1, "FAIL: local delay: rv=%d response=%d", rv, response);
+
+	rv = fetch(&text, 1);
+	if (rv != 0 || text == NULL || strcmp(text, "fetched") != 0)
+		errx(1, "FAIL: local fetch: rv=%d", rv);
+	free(text);
+
+	rv = fetch(&text, 0);
+	if (rv != -1 || text != NULL)
+		errx(1, "FAIL: local fetch of a missing key: rv=%d", rv);
+}
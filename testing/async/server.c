@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server with asynchronous methods. Calls to delay() are completed by
+ * another thread after a while, and the event loop keeps serving other
+ * calls in the meantime. The last call to delay() is completed after the
+ * server has been freed.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_async_skeleton.h>
+
+/* How long delay() takes, in microseconds */
+#define DELAY_USEC 200000
+
+struct pending_call {
+	struct ipc_response *token;
+	int value;
+	struct pending_call *next;
+};
+
+static struct pending_call *pending;
+static pthread_mutex_t pending_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+
+/* The number of calls that have been answered */
+static int handled;
+
+/* The number of calls to delay() that have been taken, and completed */
+static int accepted;
+static int completed;
+
+void call_local(void);
+
+int
+echo(int *ret1, int arg1)
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	*ret1 = arg1;
+	return 0;
+}
+
+/* Hand the call to the completion thread, and return right away */
+int
+delay(struct ipc_response *token, int arg1)
+{
+	struct pending_call *call;
+
+	call = malloc(sizeof(*call));
+	if (!call)
+		return -IPC_ERROR_NO_MEMORY;
+	__atomic_add_fetch(&accepted, 1, __ATOMIC_SEQ_CST);
+	call->token = token;
+	call->value = arg1;
+	pthread_mutex_lock(&pending_mtx);
+	call->next = pending;
+	pending = call;
+	pthread_cond_signal(&pending_cond);
+	pthread_mutex_unlock(&pending_mtx);
+	return 0;
+}
+
+/* Complete the call before returning, or fail without taking the token */
+int
+fetch(struct ipc_response *token, int key)
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	if (key == 0)
+		return -1;
+	return fetch_complete(token, 0, strdup("fetched"));
+}
+
+static void *
+completion_thread(void *arg)
+{
+	struct pending_call *call;
+
+	for (;;) {
+		pthread_mutex_lock(&pending_mtx);
+		while (!pending)
+			pthread_cond_wait(&pending_cond, &pending_mtx);
+		call = pending;
+		pending = call->next;
+		pthread_mutex_unlock(&pending_mtx);
+
+		usleep(DELAY_USEC);
+		__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+		if (delay_complete(call->token, 0, call->value) < 0)
+			log_error("delay_complete() failed");
+		free(call);
+		__atomic_add_fetch(&completed, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	pthread_t tid;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	if (pthread_create(&tid, NULL, completion_thread, NULL) != 0)
+		errx(1, "pthread_create()");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.async");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	/* The token of each call to delay() holds on to the limit */
+	rv = ipc_server_set_limit(server, "com.example.async", 2, 2, IPC_LIMIT_REJECT);
+	if (rv < 0)
+		errx(1, "ipc_server_set_limit: %s", ipc_strerror(rv));
+
+	/* Calls from within the process wait for the completion thread */
+	call_local();
+	handled = 0;
+	accepted = 0;
+	completed = 0;
+
+	/* Serve test-client: echo, delay, two calls to fetch, and another delay */
+	while (__atomic_load_n(&handled, __ATOMIC_SEQ_CST) < 4 ||
+			__atomic_load_n(&accepted, __ATOMIC_SEQ_CST) < 2) {
+		log_info("waiting for event");
+
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	/* The last call is completed after the server is gone */
+	ipc_server_free(server);
+	while (__atomic_load_n(&completed, __ATOMIC_SEQ_CST) < 2)
+		usleep(10000);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
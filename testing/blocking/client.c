@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Start a call to a blocking method, and check that the server answers
+ * calls to a fast method while it runs.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_blocking.h>
+
+static int slow_done;
+
+static void *
+call_slow(void *arg)
+{
+	char *response = NULL;
+	int rv;
+
+	rv = slow(&response, 42);
+	if (rv != 42 || response == NULL || strcmp(response, "done") != 0)
+		errx(1, "FAIL: slow: rv=%d", rv);
+	free(response);
+	__atomic_store_n(&slow_done, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/* The server is freed while this call runs, so it is never answered */
+static void *
+call_slow_unanswered(void *arg)
+{
+	char *response = NULL;
+	int rv;
+
+	rv = slow(&response, 7);
+	if (rv >= 0)
+		errx(1, "FAIL: slow on a server that was freed: rv=%d", rv);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid;
+	int response = -1;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.blocking", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	if (pthread_create(&tid, NULL, call_slow, NULL) != 0)
+		errx(1, "pthread_create()");
+	usleep(50000);
+
+	rv = fast(&response, 123);
+	if (rv != 0 || response != 123)
+		errx(1, "FAIL: fast: rv=%d response=%d", rv, response);
+	if (__atomic_load_n(&slow_done, __ATOMIC_SEQ_CST))
+		errx(1, "FAIL: fast was not answered until slow completed");
+
+	pthread_join(tid, NULL);
+
+	/* Let the server know that the response to slow has arrived */
+	rv = fast(&response, 0);
+	if (rv != 0 || response != 0)
+		errx(1, "FAIL: fast: rv=%d response=%d", rv, response);
+
+	/* Once this has started, a call to fast lets the server stop */
+	if (pthread_create(&tid, NULL, call_slow_unanswered, NULL) != 0)
+		errx(1, "pthread_create()");
+	usleep(50000);
+	rv = fast(&response, 1);
+	if (rv != 0 || response != 1)
+		errx(1, "FAIL: fast: rv=%d response=%d", rv, response);
+	pthread_join(tid, NULL);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server with a blocking method, which must not hold up calls to the
+ * other method while it runs. The server is freed while the last call to
+ * the blocking method is still running in the skeleton library.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* How long slow() takes, in microseconds */
+#define SLOW_USEC 300000
+
+/* The number of calls that have been answered */
+static int handled;
+
+/* The number of calls to slow() that have started, and finished */
+static int started;
+static int finished;
+
+static pthread_t main_thread;
+
+int
+fast(int *ret1, int arg1)
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	*ret1 = arg1;
+	return 0;
+}
+
+/* Runs on a pool thread, so it can take as long as it likes */
+int
+slow(char **ret1, int arg1)
+{
+	if (pthread_equal(pthread_self(), main_thread))
+		errx(1, "FAIL: slow() was called on the event loop");
+	__atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+	usleep(SLOW_USEC);
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_SEQ_CST);
+	*ret1 = strdup("done");
+	return arg1;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	main_thread = pthread_self();
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.blocking");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	/*
+	 * Serve test-client: slow, fast while slow is running, fast again, and
+	 * then fast while slow is running again
+	 */
+	while (__atomic_load_n(&handled, __ATOMIC_SEQ_CST) < 4 ||
+			__atomic_load_n(&started, __ATOMIC_SEQ_CST) < 2) {
+		log_info("waiting for event");
+
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	/* The skeleton library stays loaded until the pool thread is done with it */
+	ipc_server_free(server);
+	while (__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < 2)
+		usleep(10000);
+	usleep(100000);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that calls to a service that is down fail right away once enough of
+ * them have failed, and that calls resume once a probe gets through.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_breaker.h>
+
+/* Must match server.c */
+#define DOWN_USEC 1500000
+
+/* How long the breaker stays open */
+#define OPEN_USEC 1000000
+
+static int
+call_echo(int request)
+{
+	int response = -1;
+	int rv;
+
+	rv = echo(&response, request);
+	if (rv == 0 && response != request)
+		errx(1, "FAIL: echo: response=%d", response);
+	return rv;
+}
+
+int main(int argc, char *argv[])
+{
+	int response;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.breaker", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	if (call_echo(1) != 0)
+		errx(1, "FAIL: echo before the crash");
+	if (crash(&response, 0) != 0)
+		errx(1, "FAIL: crash");
+	usleep(100000);
+
+	/* Calls fail while the server is down, until the breaker opens */
+	for (i = 0; i < 20; i++) {
+		rv = call_echo(i);
+		if (rv == 0)
+			errx(1, "FAIL: echo succeeded while the server was down");
+		if (rv == -IPC_ERROR_UNAVAILABLE)
+			break;
+	}
+	if (i == 20)
+		errx(1, "FAIL: the breaker did not open");
+	log_notice("the breaker opened after %d failed calls", i);
+
+	/* The first probe finds the server still down */
+	usleep(OPEN_USEC + 100000);
+	rv = call_echo(2);
+	if (rv == 0 || rv == -IPC_ERROR_UNAVAILABLE)
+		errx(1, "FAIL: the probe was not sent: %s", ipc_strerror(rv));
+	rv = call_echo(3);
+	if (rv != -IPC_ERROR_UNAVAILABLE)
+		errx(1, "FAIL: a call was sent after the probe failed: %s", ipc_strerror(rv));
+
+	/* The next probe finds it back up, and closes the breaker */
+	usleep(OPEN_USEC + 100000);
+	for (i = 0; i < 5; i++) {
+		rv = call_echo(4 + i);
+		if (rv != 0)
+			errx(1, "FAIL: echo after the recovery: %s", ipc_strerror(rv));
+	}
+
+	if (done(&response, 0) != 0)
+		errx(1, "FAIL: done");
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
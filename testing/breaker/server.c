@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that goes down for a while when told to, refusing connections
+ * until it comes back up.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* Must match client.c */
+#define DOWN_USEC 1500000
+
+static int crashed;
+static int finished;
+
+int
+echo(int *ret1, int arg1)
+{
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+crash(int *ret1, int arg1)
+{
+	crashed = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+done(int *ret1, int arg1)
+{
+	finished = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+static struct ipc_server *
+start_server(void)
+{
+	struct ipc_server *server;
+	int rv;
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.breaker");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+	return server;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = start_server();
+	while (!finished) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+		if (crashed) {
+			ipc_server_free(server);
+			usleep(DOWN_USEC);
+			server = start_server();
+			crashed = 0;
+		}
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
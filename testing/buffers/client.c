@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pass bulk data to a server in shared memory: arguments and results in
+ * buffers, buffers that are reused, references that are not in the pool,
+ * and a pool that has to be passed again after the connection is closed.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_buffers.h>
+
+#define DATA_SIZE (256 * 1024)
+
+static void
+fill(struct ipc_buffer *buf, int seed)
+{
+	unsigned char *p = buf->data;
+	uint32_t i;
+
+	for (i = 0; i < buf->length; i++)
+		p[i] = (unsigned char) (i * 7 + seed);
+}
+
+static int
+sum(const struct ipc_buffer *buf)
+{
+	const unsigned char *p = buf->data;
+	uint32_t i;
+	int total = 0;
+
+	for (i = 0; i < buf->length; i++)
+		total += p[i];
+	return total;
+}
+
+static void
+check_checksum(struct ipc_buffer *buf, int blocking, const char *what)
+{
+	int response = -1;
+	int rv;
+
+	if (blocking)
+		rv = digest(&response, *buf);
+	else
+		rv = checksum(&response, *buf);
+	if (rv != 0 || response != sum(buf))
+		errx(1, "FAIL: %s: rv=%d response=%d expected=%d", what, rv,
+				response, sum(buf));
+}
+
+static void
+check_reverse(struct ipc_session *session)
+{
+	struct ipc_buffer input, output;
+	const unsigned char *in, *out;
+	uint32_t i;
+	int rv;
+
+	if (ipc_buffer_alloc(session, 1000, &input) < 0 ||
+			ipc_buffer_alloc(session, IPC_BUFFER_SIZE, &output) < 0)
+		errx(1, "FAIL: ipc_buffer_alloc");
+	fill(&input, 3);
+	rv = reverse(&output, input);
+	if (rv != 0)
+		errx(1, "FAIL: reverse: rv=%d", rv);
+	if (output.length != input.length)
+		errx(1, "FAIL: reverse returned %u bytes", output.length);
+	in = input.data;
+	out = output.data;
+	for (i = 0; i < input.length; i++) {
+		if (out[i] != in[input.length - i - 1])
+			errx(1, "FAIL: reverse: byte %u is wrong", i);
+	}
+	ipc_buffer_free(session, &input);
+	ipc_buffer_free(session, &output);
+}
+
+/* References to memory that is not in the pool are rejected */
+static void
+check_bad_references(struct ipc_buffer *buf)
+{
+	struct ipc_buffer bad;
+	int response;
+	int rv;
+
+	bad = *buf;
+	bad.index = 60;
+	rv = checksum(&response, bad);
+	if (rv != -IPC_ERROR_MESSAGE_INVALID)
+		errx(1, "FAIL: a buffer outside the pool was accepted: rv=%d", rv);
+
+	bad = *buf;
+	bad.offset = IPC_BUFFER_SIZE - 1;
+	bad.length = 2;
+	rv = checksum(&response, bad);
+	if (rv != -IPC_ERROR_MESSAGE_INVALID)
+		errx(1, "FAIL: a range past the end of a buffer was accepted: rv=%d", rv);
+}
+
+/* Every buffer in the pool can be allocated, and then no more */
+static void
+check_exhaustion(struct ipc_session *session)
+{
+	struct ipc_buffer bufs[64];
+	int count, i;
+	int rv;
+
+	rv = ipc_buffer_alloc(session, IPC_BUFFER_SIZE + 1, &bufs[0]);
+	if (rv != -IPC_ERROR_ARGUMENT_INVALID)
+		errx(1, "FAIL: an oversized buffer was allocated: rv=%d", rv);
+
+	for (count = 0; count < 64; count++) {
+		rv = ipc_buffer_alloc(session, 16, &bufs[count]);
+		if (rv < 0)
+			break;
+	}
+	if (rv != -IPC_ERROR_NO_MEMORY || count == 0 || count == 64)
+		errx(1, "FAIL: %d buffers were allocated before rv=%d", count, rv);
+	for (i = 0; i < count; i++)
+		ipc_buffer_free(session, &bufs[i]);
+	log_notice("the pool holds %d more buffers", count);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipc_session *session;
+	struct ipc_buffer buf;
+	int response;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.buffers", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	/* The same session that the stubs use */
+	session = ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.buffers");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect");
+
+	rv = ipc_buffer_alloc(session, DATA_SIZE, &buf);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_buffer_alloc: %s", ipc_strerror(rv));
+	fill(&buf, 1);
+	check_checksum(&buf, 0, "checksum");
+
+	/* The buffer is reused for the next call */
+	fill(&buf, 2);
+	check_checksum(&buf, 0, "checksum of a reused buffer");
+	check_checksum(&buf, 1, "checksum on a pool thread");
+
+	check_reverse(session);
+	check_bad_references(&buf);
+	check_exhaustion(session);
+
+	/* Long enough for the server to close the connection */
+	usleep(400000);
+	fill(&buf, 5);
+	check_checksum(&buf, 0, "checksum over a new connection");
+	ipc_buffer_free(session, &buf);
+
+	rv = done(&response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that works on data in buffers shared by the client. Idle
+ * connections are closed quickly, so that the client has to pass its
+ * buffer pool again over the next one.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+#define IDLE_MS 200
+
+static int finished;
+
+static int
+sum(const struct ipc_buffer *buf)
+{
+	const unsigned char *p = buf->data;
+	uint32_t i;
+	int total = 0;
+
+	for (i = 0; i < buf->length; i++)
+		total += p[i];
+	return total;
+}
+
+int
+checksum(int *ret1, struct ipc_buffer data)
+{
+	*ret1 = sum(&data);
+	return 0;
+}
+
+/* Fills in as much of the output buffer as the input needs */
+int
+reverse(struct ipc_buffer *output, struct ipc_buffer input)
+{
+	const char *src = input.data;
+	char *dst = output->data;
+	uint32_t i;
+
+	if (input.length > output->length)
+		return 1;
+	for (i = 0; i < input.length; i++)
+		dst[i] = src[input.length - i - 1];
+	output->length = input.length;
+	return 0;
+}
+
+/* Runs on a pool thread */
+int
+digest(int *ret1, struct ipc_buffer data)
+{
+	*ret1 = sum(&data);
+	return 0;
+}
+
+int
+done(int *ret1, int arg1)
+{
+	finished = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.buffers");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+	rv = ipc_server_set_timeouts(server, IDLE_MS, 0, 0);
+	if (rv < 0)
+		errx(1, "ipc_server_set_timeouts: %s", ipc_strerror(rv));
+
+	while (!finished) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
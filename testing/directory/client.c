@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Connect to a service listed in the directory many times over, and check
+ * that the connections are spread across its endpoints by weight, with the
+ * share of the endpoint that is down going to the next one.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_directory.h>
+
+#define NCLIENTS 200
+
+/* Call whoami() on a new connection */
+static int
+connect_and_ask(void)
+{
+	struct ipc_session *session;
+	struct ipc_client *client;
+	int (*stub)(struct ipc_session *, int *, int);
+	int response = -1;
+	int rv;
+
+	client = ipc_client();
+	if (!client)
+		errx(1, "ipc_client()");
+	session = ipc_client_connect(client, IPC_DOMAIN_USER, "com.example.directory");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect()");
+	stub = (int (*)(struct ipc_session *, int *, int)) ipc_session_stub(session, 1);
+	if (!stub)
+		errx(1, "ipc_session_stub()");
+	rv = stub(session, &response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: whoami: %s", ipc_strerror(rv));
+	(void) close(ipc_session_fd(session));
+	return response;
+}
+
+static void
+stop_server(const char *address)
+{
+	struct ipc_session *session;
+	int (*stub)(struct ipc_session *, int *, int);
+	int response;
+
+	session = ipc_client_connect_address(ipc_client(), address, "com.example.directory");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect_address(%s)", address);
+	stub = (int (*)(struct ipc_session *, int *, int)) ipc_session_stub(session, 2);
+	if (!stub || stub(session, &response, 0) != 0)
+		errx(1, "FAIL: done() at %s", address);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *servers[] = {
+		"abstract:com.example.directory",
+		"tcp:127.0.0.1:47090",
+	};
+	int count[3] = { 0, 0, 0 };
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+
+	/* The connections only follow the weights once both servers are up */
+	for (i = 0; i < 2; i++) {
+		rv = ipc_client_wait_for_address(servers[i], "com.example.directory", 5000);
+		if (rv < 0)
+			errx(1, "FAIL: %s is not up: %s", servers[i], ipc_strerror(rv));
+	}
+
+	for (i = 0; i < NCLIENTS; i++) {
+		rv = connect_and_ask();
+		if (rv < 1 || rv > 2)
+			errx(1, "FAIL: whoami returned %d", rv);
+		count[rv]++;
+	}
+	log_notice("connections: %d to the first server, %d to the second",
+			count[1], count[2]);
+
+	/* Expect 4/5 and 1/5 of the connections */
+	if (count[1] < NCLIENTS * 3 / 5 || count[2] < NCLIENTS / 20 ||
+			count[2] > NCLIENTS * 7 / 20)
+		errx(1, "FAIL: the connections do not follow the weights");
+
+	stop_server(servers[0]);
+	stop_server(servers[1]);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+make -C ../.. clean all || exit
+make clean all || exit
+
+# The service is not in the statedir, so clients can only find it here.
+# The first endpoint is never up, and its share goes to the one after it.
+cat > directory <<EOD
+# service		address				weight
+com.example.directory	abstract:com.example.directory	3
+com.example.directory	tcp:127.0.0.1:47090		1
+
+com.example.directory	unix:/nonexistent/com.example.directory	1
+EOD
+
+./test-server abstract:com.example.directory 1 &
+server1_pid=$!
+./test-server tcp:127.0.0.1:47090 2 &
+server2_pid=$!
+
+IPC_DIRECTORY=./directory ./test-client || { kill $server1_pid $server2_pid; exit 1; }
+wait $server1_pid && wait $server2_pid
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Send a burst of calls on one connection, and then a single call on
+ * another. The single call should not have to wait for the whole burst.
+ *
+ * Requests are written directly in the wire format, so that the burst
+ * arrives in a single write.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* Must match server.c */
+#define NOISY_CALLS 400
+#define QUIET_REQUEST -1
+
+/* A frame of the echo method, as it appears on the wire */
+struct echo_frame {
+	struct ipc_message header;
+	int value;
+};
+
+static struct sockaddr_un sock;
+
+static int
+open_connection(void)
+{
+	int fd;
+
+	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "socket(2)");
+	if (connect(fd, (struct sockaddr *) &sock, SUN_LEN(&sock)) < 0)
+		err(1, "connect(2) to %s", sock.sun_path);
+	return fd;
+}
+
+static void
+make_echo(struct echo_frame *frame, int value)
+{
+	memset(frame, 0, sizeof(*frame));
+	frame->header._ipc_method = 1;
+	frame->header._ipc_argc = 1;
+	frame->header._ipc_argsz[0] = sizeof(int);
+	frame->header._ipc_bufsz = sizeof(int);
+	frame->value = value;
+}
+
+static int
+recv_echo(int fd)
+{
+	struct echo_frame frame;
+	size_t len = 0;
+	ssize_t bytes;
+
+	while (len < sizeof(frame)) {
+		bytes = read(fd, (char *) &frame + len, sizeof(frame) - len);
+		if (bytes <= 0)
+			err(1, "read(2)");
+		len += bytes;
+	}
+	if (frame.header._ipc_status != 0 || frame.header._ipc_bufsz != sizeof(int))
+		errx(1, "FAIL: bad response");
+	return frame.value;
+}
+
+int main(int argc, char *argv[])
+{
+	struct echo_frame *burst, quiet;
+	int noisy_fd, quiet_fd;
+	int waited, i;
+	int rv;
+	const char *home;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.fairness", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	home = getenv("HOME");
+	if (!home)
+		errx(1, "HOME is not set");
+	sock.sun_family = AF_LOCAL;
+	snprintf(sock.sun_path, sizeof(sock.sun_path),
+			"%s/.ipc/services/com.example.fairness", home);
+
+	burst = calloc(NOISY_CALLS, sizeof(*burst));
+	if (!burst)
+		err(1, "calloc");
+	for (i = 0; i < NOISY_CALLS; i++)
+		make_echo(&burst[i], i);
+	make_echo(&quiet, QUIET_REQUEST);
+
+	noisy_fd = open_connection();
+	quiet_fd = open_connection();
+
+	if (write(noisy_fd, burst, NOISY_CALLS * sizeof(*burst)) !=
+			NOISY_CALLS * sizeof(*burst))
+		err(1, "write(2)");
+	usleep(50000);
+	if (write(quiet_fd, &quiet, sizeof(quiet)) != sizeof(quiet))
+		err(1, "write(2)");
+
+	waited = recv_echo(quiet_fd);
+	log_notice("the quiet call waited for %d of %d noisy calls", waited, NOISY_CALLS);
+	if (waited >= NOISY_CALLS / 2)
+		errx(1, "FAIL: the quiet call waited behind the noisy client");
+
+	for (i = 0; i < NOISY_CALLS; i++) {
+		if (recv_echo(noisy_fd) != i)
+			errx(1, "FAIL: noisy call %d was answered out of order", i);
+	}
+
+	close(noisy_fd);
+	close(quiet_fd);
+	free(burst);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that tells a quiet client how many calls from a noisy client
+ * were answered before its own.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* Must match client.c */
+#define NOISY_CALLS 400
+#define QUIET_REQUEST -1
+
+/* The number of calls from the noisy client that have been answered */
+static int noisy_handled;
+
+static int quiet_handled;
+
+int
+echo(int *ret1, int arg1)
+{
+	if (arg1 == QUIET_REQUEST) {
+		quiet_handled = 1;
+		*ret1 = noisy_handled;
+		return 0;
+	}
+
+	/* Hold up the first call, so that the quiet client's call arrives
+	 * while the rest of the noisy client's calls are waiting. */
+	if (noisy_handled == 0)
+		usleep(200000);
+	noisy_handled++;
+	*ret1 = arg1;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.fairness");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	while (noisy_handled < NOISY_CALLS || !quiet_handled) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Get the contents of files from a server: a whole file much larger than
+ * IPC_MESSAGE_SIZE_MAX, a range of one, a file alongside another result,
+ * one from a blocking method, and a range past the end of the file.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_files.h>
+
+#define DATA_PATH "data.bin"
+#define DATA_SIZE (1536 * 1024 + 7)
+
+static unsigned char *expected;
+
+static void
+create_data(void)
+{
+	FILE *f;
+	int i;
+
+	expected = malloc(DATA_SIZE);
+	if (!expected)
+		err(1, "malloc");
+	for (i = 0; i < DATA_SIZE; i++)
+		expected[i] = (unsigned char) (i * 13 + i / 256);
+	f = fopen(DATA_PATH, "w");
+	if (!f || fwrite(expected, 1, DATA_SIZE, f) != DATA_SIZE || fclose(f) != 0)
+		err(1, "unable to write %s", DATA_PATH);
+}
+
+static void
+check_contents(struct ipc_file *contents, size_t offset, size_t length, const char *what)
+{
+	if (contents->fd != -1)
+		errx(1, "FAIL: %s: the client was given fd %d", what, contents->fd);
+	if (contents->length != length)
+		errx(1, "FAIL: %s: got %llu bytes, expected %zu", what,
+				(unsigned long long) contents->length, length);
+	if (length > 0 && memcmp(contents->data, expected + offset, length) != 0)
+		errx(1, "FAIL: %s: the contents are wrong", what);
+	free(contents->data);
+	contents->data = NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipc_file contents;
+	int response, size;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	create_data();
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.files", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	rv = fetch(&contents, DATA_PATH);
+	if (rv != 0)
+		errx(1, "FAIL: fetch: rv=%d", rv);
+	check_contents(&contents, 0, DATA_SIZE, "fetch");
+
+	rv = slice(&contents, DATA_PATH, 100000, 5000);
+	if (rv != 0)
+		errx(1, "FAIL: slice: rv=%d", rv);
+	check_contents(&contents, 100000, 5000, "slice");
+
+	rv = slice(&contents, DATA_PATH, 0, 0);
+	if (rv != 0)
+		errx(1, "FAIL: empty slice: rv=%d", rv);
+	check_contents(&contents, 0, 0, "empty slice");
+
+	rv = measure(&size, &contents, DATA_PATH);
+	if (rv != 0 || size != DATA_SIZE)
+		errx(1, "FAIL: measure: rv=%d size=%d", rv, size);
+	check_contents(&contents, 0, DATA_SIZE, "measure");
+
+	rv = load(&contents, DATA_PATH);
+	if (rv != 0)
+		errx(1, "FAIL: load: rv=%d", rv);
+	check_contents(&contents, 0, DATA_SIZE, "load");
+
+	/* The server answers with an error, and the connection stays usable */
+	rv = slice(&contents, DATA_PATH, DATA_SIZE - 10, 20);
+	if (rv != -IPC_ERROR_ARGUMENT_INVALID)
+		errx(1, "FAIL: a range past the end of the file: rv=%d", rv);
+	rv = slice(&contents, DATA_PATH, DATA_SIZE - 10, 10);
+	if (rv != 0)
+		errx(1, "FAIL: slice after an error: rv=%d", rv);
+	check_contents(&contents, DATA_SIZE - 10, 10, "slice after an error");
+
+	unlink(DATA_PATH);
+	rv = done(&response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that returns ranges of files, which libipc sends straight from
+ * the files.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+static int finished;
+
+static int
+open_file(struct ipc_file *contents, const char *path)
+{
+	struct stat sb;
+
+	contents->fd = open(path, O_RDONLY);
+	if (contents->fd < 0 || fstat(contents->fd, &sb) < 0)
+		return 1;
+	contents->offset = 0;
+	contents->length = sb.st_size;
+	return 0;
+}
+
+int
+fetch(struct ipc_file *contents, char *path)
+{
+	return open_file(contents, path);
+}
+
+/* The range is not checked here, so a bad one reaches libipc */
+int
+slice(struct ipc_file *contents, char *path, int offset, int length)
+{
+	if (open_file(contents, path) != 0)
+		return 1;
+	contents->offset = offset;
+	contents->length = length;
+	return 0;
+}
+
+int
+measure(int *size, struct ipc_file *contents, char *path)
+{
+	if (open_file(contents, path) != 0)
+		return 1;
+	*size = contents->length;
+	return 0;
+}
+
+/* Runs on a pool thread */
+int
+load(struct ipc_file *contents, char *path)
+{
+	return open_file(contents, path);
+}
+
+int
+done(int *ret1, int arg1)
+{
+	finished = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.files");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	while (!finished) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Call the service from another process. The results must be the same as
+ * the calls the server makes to itself.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_inprocess.h>
+
+int main(int argc, char *argv[])
+{
+	int response = -1;
+	char *text;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.inprocess", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	rv = echo(&response, 123);
+	if (rv != 0 || response != 123)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+
+	/* The return value of the method is passed back to the caller */
+	rv = status(&response, 42);
+	if (rv != 42 || response != 42)
+		errx(1, "FAIL: status: rv=%d response=%d", rv, response);
+
+	rv = greeting(&text);
+	if (rv != 0 || text == NULL || strcmp(text, "hello") != 0)
+		errx(1, "FAIL: greeting: rv=%d", rv);
+	free(text);
+
+	rv = lookup(&text, 7);
+	if (rv != 7 || text == NULL || strcmp(text, "found") != 0)
+		errx(1, "FAIL: lookup: rv=%d", rv);
+	free(text);
+
+	rv = lookup(&text, 0);
+	if (rv != 0 || text != NULL)
+		errx(1, "FAIL: lookup of a missing key: rv=%d", rv);
+
+	/* A result that the method did not set is empty, whatever the caller passed */
+	text = (char *) "not a result";
+	rv = missing(&text, 3);
+	if (rv != 3 || text != NULL)
+		errx(1, "FAIL: missing: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
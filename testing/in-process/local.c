@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Calls made by the server to its own service. This is kept apart from
+ * server.c, because the stub header and the server both define the methods.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../include/ipc.h"
+#include <ipc/com_example_inprocess.h>
+
+void
+call_local(void)
+{
+	struct ipc_session *session;
+	int response = -1;
+	char *text;
+	int rv;
+
+	session = ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.inprocess");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect()");
+	if (ipc_session_fd(session) != -1)
+		errx(1, "FAIL: the session uses a socket");
+
+	rv = echo(&response, 123);
+	if (rv != 0 || response != 123)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+
+	rv = status(&response, 42);
+	if (rv != 42 || response != 42)
+		errx(1, "FAIL: status: rv=%d response=%d", rv, response);
+
+	rv = greeting(&text);
+	if (rv != 0 || text == NULL || strcmp(text, "hello") != 0)
+		errx(1, "FAIL: greeting: rv=%d", rv);
+	free(text);
+
+	rv = lookup(&text, 7);
+	if (rv != 7 || text == NULL || strcmp(text, "found") != 0)
+		errx(1, "FAIL: lookup: rv=%d", rv);
+	free(text);
+
+	rv = lookup(&text, 0);
+	if (rv != 0 || text != NULL)
+		errx(1, "FAIL: lookup of a missing key: rv=%d", rv);
+
+	/* A result that the method did not set is empty, whatever the caller passed */
+	text = (char *) "not a result";
+	rv = missing(&text, 3);
+	if (rv != 3 || text != NULL)
+		errx(1, "FAIL: missing: rv=%d", rv);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that calls its own service. Those calls should not go through
+ * the socket, but must behave the same as calls from another process.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+int calls;
+int released;
+
+void call_local(void);
+
+int
+echo(int *ret1, int arg1)
+{
+	calls++;
+	*ret1 = arg1;
+	return 0;
+}
+
+/* Returns the request as the status of the call */
+int
+status(int *ret1, int arg1)
+{
+	calls++;
+	*ret1 = arg1;
+	return arg1;
+}
+
+/* Returns a reference to a constant, which must not be freed */
+int
+greeting(char **text)
+{
+	calls++;
+	*text = "hello";
+	return 0;
+}
+
+void
+release_text(char *text)
+{
+	released++;
+	free(text);
+}
+
+/* Returns a string that must be passed to release_text() */
+int
+lookup(char **text, int key)
+{
+	calls++;
+	*text = (key == 0) ? NULL : strdup("found");
+	return key;
+}
+
+/* Fails without setting its result */
+int
+missing(char **text, int key)
+{
+	calls++;
+	return key;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.inprocess");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	/* No events are dispatched, so these only succeed if they are direct calls */
+	call_local();
+	if (calls != 6)
+		errx(1, "FAIL: %d local calls reached the server", calls);
+
+	/* Now serve the same calls from test-client */
+	while (calls < 12) {
+		log_info("waiting for event");
+
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	ipc_server_free(server);
+
+	if (released != 2)
+		errx(1, "FAIL: release_text() was called %d times", released);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
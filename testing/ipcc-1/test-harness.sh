@@ -24,9 +24,6 @@ rm -f ~/.ipc/services/com.example.myservice
 server_pid=$!
 echo "launched server on pid $server_pid"
 
-# Ensure the server has time to bind to the name
-sleep 1
-
 ./test-client
 kill $server_pid
 
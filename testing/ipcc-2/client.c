@@ -56,6 +56,10 @@ int main(int argc, char *argv[])
 	log_open("client", "/dev/stderr");
 	ipc_openlog("client", "/dev/stderr");
 
+	result = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.myservice", 5000);
+	if (result < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(result));
+
 	call_pingpong();
 
 	log_notice("success; exiting normally");
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that a call over the limit of slow() is rejected, and that calls
+ * to queued() all succeed, one at a time.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_limits.h>
+
+#define NQUEUED 4
+
+static void *
+call_slow(void *arg)
+{
+	int response = -1;
+	int rv;
+
+	rv = slow(&response, 42);
+	if (rv != 0 || response != 42)
+		errx(1, "FAIL: slow: rv=%d response=%d", rv, response);
+	return NULL;
+}
+
+static void *
+call_queued(void *arg)
+{
+	int request = (int) (intptr_t) arg;
+	int response = -1;
+	int rv;
+
+	rv = queued(&response, request);
+	if (rv != 0 || response != request)
+		errx(1, "FAIL: queued: rv=%d response=%d", rv, response);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[NQUEUED];
+	int response = -1;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.limits", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	/* A second call to slow() while the first is running goes over its limit */
+	if (pthread_create(&tid[0], NULL, call_slow, NULL) != 0)
+		errx(1, "pthread_create()");
+	usleep(50000);
+	rv = slow(&response, 7);
+	if (rv != -IPC_ERROR_LIMIT_EXCEEDED)
+		errx(1, "FAIL: slow over its limit: rv=%d", rv);
+	pthread_join(tid[0], NULL);
+
+	/* Calls to queued() wait for each other instead */
+	for (i = 0; i < NQUEUED; i++) {
+		if (pthread_create(&tid[i], NULL, call_queued, (void *) (intptr_t) i) != 0)
+			errx(1, "pthread_create()");
+	}
+	for (i = 0; i < NQUEUED; i++)
+		pthread_join(tid[i], NULL);
+
+	/* Ask the server how many calls to queued() it saw at once */
+	rv = fast(&response, 0);
+	if (rv != 0 || response != 1)
+		errx(1, "FAIL: %d calls to queued() ran at once", response);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server with limits on concurrent calls: slow() rejects the calls over
+ * its limit, which comes from the interface definition, and queued() makes
+ * them wait, with a limit set through the API.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* How long slow() takes, in microseconds */
+#define SLOW_USEC 300000
+
+/* How long queued() takes, in microseconds */
+#define QUEUED_USEC 50000
+
+/* The number of calls that test-client makes, not counting rejected ones */
+#define EXPECTED_CALLS 6
+
+/* The number of calls that have been answered */
+static int handled;
+
+/* The number of calls to queued() in progress, and the most seen at once */
+static int queued_active;
+static int queued_max;
+
+int
+fast(int *ret1, int arg1)
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	*ret1 = __atomic_load_n(&queued_max, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+int
+slow(int *ret1, int arg1)
+{
+	usleep(SLOW_USEC);
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+queued(int *ret1, int arg1)
+{
+	int active, max;
+
+	active = __atomic_add_fetch(&queued_active, 1, __ATOMIC_SEQ_CST);
+	max = __atomic_load_n(&queued_max, __ATOMIC_SEQ_CST);
+	while (active > max &&
+			!__atomic_compare_exchange_n(&queued_max, &max, active, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		;
+	usleep(QUEUED_USEC);
+	__atomic_sub_fetch(&queued_active, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&handled, 1, __ATOMIC_SEQ_CST);
+	*ret1 = arg1;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.limits");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	rv = ipc_server_set_limit(server, "com.example.limits", 3, 1, IPC_LIMIT_QUEUE);
+	if (rv < 0)
+		errx(1, "ipc_server_set_limit: %s", ipc_strerror(rv));
+
+	while (__atomic_load_n(&handled, __ATOMIC_SEQ_CST) < EXPECTED_CALLS) {
+		log_info("waiting for event");
+
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "histogram.h"
+
+#define HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+
+static int
+bucket_index(uint64_t value)
+{
+	int exponent;
+	int idx;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return (int) value;
+
+	/* Shift the value until it lands in [HALF_BUCKETS, HISTOGRAM_SUB_BUCKETS) */
+	exponent = (63 - __builtin_clzll(value)) - 6;
+	idx = HISTOGRAM_SUB_BUCKETS + (exponent - 1) * HALF_BUCKETS +
+		(int) ((value >> exponent) - HALF_BUCKETS);
+	if (idx >= HISTOGRAM_BUCKETS)
+		idx = HISTOGRAM_BUCKETS - 1;
+	return idx;
+}
+
+/* The highest value that would be recorded in the given bucket */
+static uint64_t
+bucket_value(int idx)
+{
+	int exponent;
+	uint64_t mantissa;
+
+	if (idx < HISTOGRAM_SUB_BUCKETS)
+		return (uint64_t) idx;
+
+	exponent = (idx - HISTOGRAM_SUB_BUCKETS) / HALF_BUCKETS + 1;
+	mantissa = (idx - HISTOGRAM_SUB_BUCKETS) % HALF_BUCKETS + HALF_BUCKETS;
+	return ((mantissa + 1) << exponent) - 1;
+}
+
+void
+histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void
+histogram_record(struct histogram *h, uint64_t value)
+{
+	h->counts[bucket_index(value)]++;
+	h->total++;
+	if (value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+}
+
+void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	if (src->min < dst->min) dst->min = src->min;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t
+histogram_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	int i;
+
+	if (h->total == 0)
+		return 0;
+
+	target = (uint64_t) ((percentile / 100.0) * h->total + 0.5);
+	if (target < 1) target = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= target) {
+			uint64_t v = bucket_value(i);
+			return (v > h->max) ? h->max : v;
+		}
+	}
+	return h->max;
+}
+
+void
+histogram_print(const struct histogram *h, FILE *f, double scale)
+{
+	uint64_t seen = 0;
+	double pct;
+	int i;
+
+	fprintf(f, "%12s %14s %10s %14s\n\n",
+			"Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		if (h->counts[i] == 0)
+			continue;
+		seen += h->counts[i];
+		pct = (double) seen / h->total;
+		if (seen < h->total) {
+			fprintf(f, "%12.3f %2.12f %10llu %14.2f\n",
+					bucket_value(i) / scale, pct,
+					(unsigned long long) seen, 1.0 / (1.0 - pct));
+		} else {
+			fprintf(f, "%12.3f %2.12f %10llu\n",
+					bucket_value(i) / scale, pct,
+					(unsigned long long) seen);
+		}
+	}
+	fprintf(f, "#[Max = %12.3f, Total count = %10llu]\n",
+			h->max / scale, (unsigned long long) h->total);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS are recorded exactly. Above that, each
+ * power of two is split into HISTOGRAM_SUB_BUCKETS / 2 linear buckets, so a
+ * bucket is at most 1/64 of its lowest value wide, and the relative error
+ * stays under 1.6% across the whole range.
+ */
+#define HISTOGRAM_SUB_BUCKETS 128
+#define HISTOGRAM_MAGNITUDES  40  /* 2^40 ns is about 18 minutes */
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_SUB_BUCKETS + HISTOGRAM_MAGNITUDES * (HISTOGRAM_SUB_BUCKETS / 2))
+
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+/** Return the highest value that is equivalent to the given percentile */
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+
+/** Write the percentile distribution in the HdrHistogram .hgrm text format */
+void histogram_print(const struct histogram *h, FILE *f, double scale);
+
+#endif /* HISTOGRAM_H_ */
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * loadgen - an open-loop load generator for ipcc-generated services
+ *
+ * Requests are built directly from the wire format, so any method of any
+ * service can be driven without linking against its stub library. Each
+ * argument is given as TYPE:VALUE, where TYPE is one of int, int64 or str.
+ *
+ * Requests are scheduled at a fixed arrival rate, independently of how fast
+ * the server answers. Latency is measured from the time a request was
+ * scheduled to be sent, not from when it was actually sent, so time spent
+ * queued behind a slow response is included. This avoids the coordinated
+ * omission problem of closed-loop benchmarks.
+ *
+ * With -R, the rate is swept from -r to -R in steps of -s until the service
+ * saturates, printing one line per step. The output can be plotted directly
+ * as a throughput/latency curve.
+ *
+ * Example:
+ *   loadgen -t 4 -c 16 -r 1000 -R 50000 -s 1000 -m 1 -a int:123 \
+ *       com.example.myservice
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "histogram.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* How long to wait for outstanding responses at the end of each step */
+#define DRAIN_TIMEOUT (5 * NSEC_PER_SEC)
+
+struct connection {
+	int      fd;
+	int      busy;       /** A request is outstanding */
+	uint64_t intended;   /** When the outstanding request was scheduled */
+	size_t   have;       /** Bytes of the response received so far */
+	char     buf[sizeof(struct ipc_message) + IPC_MESSAGE_SIZE_MAX];
+};
+
+struct worker {
+	pthread_t tid;
+	int       id;
+	uint64_t  start;     /** Scheduled time of the first request */
+	uint64_t  interval;  /** Nanoseconds between requests on this thread */
+	struct connection *conns;
+	struct histogram hist;
+	uint64_t  completed;
+	uint64_t  errors;
+	uint64_t  unsent;    /** Requests that were due but never sent */
+};
+
+static struct {
+	struct sockaddr_un sock;
+	int      threads;
+	int      conns;
+	double   rate;
+	double   max_rate;
+	double   step;
+	uint64_t duration;
+	int      keepalive;
+	const char *hgrm_prefix;
+	struct ipc_message request;
+	char     body[IPC_MESSAGE_SIZE_MAX];
+} cfg;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: loadgen [-k] [-d user|system] [-p path] [-t threads] [-c connections]\n"
+		"               [-r rate] [-R max_rate] [-s step] [-D seconds]\n"
+		"               [-H prefix] -m method [-a type:value ...] service\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+add_argument(const char *spec)
+{
+	const char *value;
+	uint32_t argc = cfg.request._ipc_argc;
+	size_t len;
+	char *pos;
+
+	if (argc >= IPC_ARGUMENT_MAX)
+		errx(1, "too many arguments");
+
+	value = strchr(spec, ':');
+	if (!value)
+		errx(1, "argument must be TYPE:VALUE: %s", spec);
+	value++;
+	pos = cfg.body + cfg.request._ipc_bufsz;
+
+	if (strncmp(spec, "int:", 4) == 0) {
+		int v = (int) strtol(value, NULL, 0);
+		len = sizeof(v);
+		if (cfg.request._ipc_bufsz + len > IPC_MESSAGE_SIZE_MAX)
+			errx(1, "arguments are too large");
+		memcpy(pos, &v, len);
+	} else if (strncmp(spec, "int64:", 6) == 0) {
+		int64_t v = (int64_t) strtoll(value, NULL, 0);
+		len = sizeof(v);
+		if (cfg.request._ipc_bufsz + len > IPC_MESSAGE_SIZE_MAX)
+			errx(1, "arguments are too large");
+		memcpy(pos, &v, len);
+	} else if (strncmp(spec, "str:", 4) == 0) {
+		len = strlen(value) + 1;
+		if (cfg.request._ipc_bufsz + len > IPC_MESSAGE_SIZE_MAX)
+			errx(1, "arguments are too large");
+		memcpy(pos, value, len);
+	} else {
+		errx(1, "unknown argument type: %s", spec);
+	}
+
+	cfg.request._ipc_argsz[argc] = len;
+	cfg.request._ipc_bufsz += len;
+	cfg.request._ipc_argc++;
+}
+
+static void
+set_socket_path(const char *domain, const char *service)
+{
+	int len;
+
+	cfg.sock.sun_family = AF_LOCAL;
+	if (strcmp(domain, "user") == 0) {
+		const char *home = getenv("HOME");
+		if (!home)
+			errx(1, "HOME is not set");
+		len = snprintf(cfg.sock.sun_path, sizeof(cfg.sock.sun_path),
+				"%s/.ipc/services/%s", home, service);
+	} else if (strcmp(domain, "system") == 0) {
+		len = snprintf(cfg.sock.sun_path, sizeof(cfg.sock.sun_path),
+				"/var/run/ipc/services/%s", service);
+	} else {
+		errx(1, "unknown domain: %s", domain);
+	}
+	if (len < 0 || len >= sizeof(cfg.sock.sun_path))
+		errx(1, "socket path is too long");
+}
+
+static int
+connection_open(struct connection *conn)
+{
+	int fd;
+
+	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &cfg.sock, SUN_LEN(&cfg.sock)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		close(fd);
+		return -1;
+	}
+	conn->fd = fd;
+	return 0;
+}
+
+static void
+connection_close(struct connection *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->busy = 0;
+	conn->have = 0;
+}
+
+/* Send the request on an idle connection. Returns -1 if it could not be sent. */
+static int
+connection_send(struct connection *conn, uint64_t intended)
+{
+	struct iovec iov[2];
+	size_t len;
+	ssize_t bytes;
+
+	if (conn->fd < 0 && connection_open(conn) < 0)
+		return -1;
+
+	iov[0].iov_base = &cfg.request;
+	iov[0].iov_len = sizeof(cfg.request);
+	iov[1].iov_base = cfg.body;
+	iov[1].iov_len = cfg.request._ipc_bufsz;
+	len = iov[0].iov_len + iov[1].iov_len;
+
+	bytes = writev(conn->fd, iov, 2);
+	if (bytes < 0 || (size_t) bytes < len) {
+		/* A partial write cannot be recovered without resynchronizing */
+		connection_close(conn);
+		return -1;
+	}
+	conn->busy = 1;
+	conn->intended = intended;
+	conn->have = 0;
+	return 0;
+}
+
+/*
+ * Read whatever is available for the outstanding response.
+ * Returns 1 if the response is complete, 0 if more data is needed,
+ * or -1 on error.
+ */
+static int
+connection_receive(struct connection *conn)
+{
+	struct ipc_message *response = (struct ipc_message *) conn->buf;
+	size_t want;
+	ssize_t bytes;
+
+	for (;;) {
+		want = sizeof(*response);
+		if (conn->have >= want) {
+			if (response->_ipc_bufsz > IPC_MESSAGE_SIZE_MAX ||
+					response->_ipc_method != cfg.request._ipc_method)
+				return -1;
+			want += response->_ipc_bufsz;
+		}
+		if (conn->have == want)
+			return 1;
+
+		bytes = read(conn->fd, conn->buf + conn->have, want - conn->have);
+		if (bytes < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		if (bytes == 0)
+			return -1;
+		conn->have += bytes;
+	}
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	struct pollfd *pfd;
+	struct connection **pconn;
+	struct timespec timeout;
+	uint64_t next = w->start;
+	uint64_t end = w->start + cfg.duration;
+	uint64_t now, wait;
+	int nbusy = 0;
+	int i, n, rv;
+
+	pfd = calloc(cfg.conns, sizeof(*pfd));
+	pconn = calloc(cfg.conns, sizeof(*pconn));
+	if (!pfd || !pconn)
+		err(1, "calloc");
+
+	for (;;) {
+		now = now_ns();
+
+		/* Send every request that is due, as long as a connection is free */
+		for (i = 0; i < cfg.conns && next < end && next <= now; i++) {
+			struct connection *conn = &w->conns[i];
+			if (conn->busy)
+				continue;
+			if (connection_send(conn, next) < 0) {
+				w->errors++;
+			} else {
+				nbusy++;
+			}
+			next += w->interval;
+		}
+
+		if (next >= end && nbusy == 0)
+			break;
+		if (now > end + DRAIN_TIMEOUT)
+			break;
+
+		/* Sleep until the next request is due, or a response arrives */
+		if (next < end && nbusy < cfg.conns) {
+			wait = (next > now) ? next - now : 0;
+		} else {
+			wait = NSEC_PER_SEC / 10;
+		}
+		timeout.tv_sec = wait / NSEC_PER_SEC;
+		timeout.tv_nsec = wait % NSEC_PER_SEC;
+
+		n = 0;
+		for (i = 0; i < cfg.conns; i++) {
+			if (!w->conns[i].busy)
+				continue;
+			pfd[n].fd = w->conns[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			pconn[n] = &w->conns[i];
+			n++;
+		}
+		rv = ppoll(pfd, n, &timeout, NULL);
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "ppoll(2)");
+		}
+
+		now = now_ns();
+		for (i = 0; i < n && rv > 0; i++) {
+			struct connection *conn = pconn[i];
+			if (pfd[i].revents == 0)
+				continue;
+			switch (connection_receive(conn)) {
+			case 1:
+				histogram_record(&w->hist, now - conn->intended);
+				w->completed++;
+				nbusy--;
+				conn->busy = 0;
+				conn->have = 0;
+				if (!cfg.keepalive)
+					connection_close(conn);
+				break;
+			case 0:
+				break;
+			default:
+				w->errors++;
+				nbusy--;
+				connection_close(conn);
+				break;
+			}
+		}
+	}
+
+	/* Anything still outstanding after the drain period has timed out */
+	for (i = 0; i < cfg.conns; i++) {
+		if (w->conns[i].busy)
+			w->errors++;
+	}
+	if (next < end)
+		w->unsent = (end - next + w->interval - 1) / w->interval;
+
+	free(pfd);
+	free(pconn);
+	return NULL;
+}
+
+/* Run the load at a single rate. Returns 1 if the service kept up. */
+static int
+run_step(struct worker *workers, double rate)
+{
+	struct histogram total;
+	uint64_t start, completed = 0, errors = 0, unsent = 0;
+	double seconds, achieved;
+	int i;
+
+	start = now_ns() + NSEC_PER_SEC / 100;
+	for (i = 0; i < cfg.threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->interval = (uint64_t) (NSEC_PER_SEC * cfg.threads / rate);
+		if (w->interval == 0)
+			w->interval = 1;
+		/* Stagger the threads so their requests interleave evenly */
+		w->start = start + (w->interval / cfg.threads) * i;
+		w->completed = w->errors = w->unsent = 0;
+		histogram_reset(&w->hist);
+		if (pthread_create(&w->tid, NULL, worker_main, w) != 0)
+			errx(1, "pthread_create(3)");
+	}
+
+	histogram_reset(&total);
+	for (i = 0; i < cfg.threads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		histogram_merge(&total, &workers[i].hist);
+		completed += workers[i].completed;
+		errors += workers[i].errors;
+		unsent += workers[i].unsent;
+	}
+
+	seconds = (double) cfg.duration / NSEC_PER_SEC;
+	achieved = completed / seconds;
+	printf("%10.0f %10.0f %10llu %8llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			rate, achieved,
+			(unsigned long long) completed,
+			(unsigned long long) errors,
+			(unsigned long long) unsent,
+			histogram_percentile(&total, 50.0) / 1000.0,
+			histogram_percentile(&total, 90.0) / 1000.0,
+			histogram_percentile(&total, 99.0) / 1000.0,
+			histogram_percentile(&total, 99.9) / 1000.0,
+			total.max / 1000.0);
+	fflush(stdout);
+
+	if (cfg.hgrm_prefix) {
+		char path[PATH_MAX];
+		FILE *f;
+
+		snprintf(path, sizeof(path), "%s.%.0f.hgrm", cfg.hgrm_prefix, rate);
+		f = fopen(path, "w");
+		if (!f)
+			err(1, "fopen(3) of %s", path);
+		histogram_print(&total, f, 1000.0);
+		fclose(f);
+	}
+
+	/* Saturated: the service fell behind the arrival rate */
+	return (unsent == 0 && achieved >= 0.95 * rate);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct worker *workers;
+	const char *domain = "user";
+	const char *path = NULL;
+	int have_method = 0;
+	double rate;
+	int ch, i, j;
+
+	cfg.threads = 1;
+	cfg.conns = 1;
+	cfg.rate = 1000;
+	cfg.duration = 10 * NSEC_PER_SEC;
+	memset(&cfg.request, 0, sizeof(cfg.request));
+
+	while ((ch = getopt(argc, argv, "a:c:d:D:H:km:p:r:R:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			add_argument(optarg);
+			break;
+		case 'c':
+			cfg.conns = atoi(optarg);
+			break;
+		case 'd':
+			domain = optarg;
+			break;
+		case 'D':
+			cfg.duration = (uint64_t) (atof(optarg) * NSEC_PER_SEC);
+			break;
+		case 'H':
+			cfg.hgrm_prefix = optarg;
+			break;
+		case 'k':
+			cfg.keepalive = 1;
+			break;
+		case 'm':
+			cfg.request._ipc_method = (uint32_t) strtoul(optarg, NULL, 0);
+			have_method = 1;
+			break;
+		case 'p':
+			path = optarg;
+			break;
+		case 'r':
+			cfg.rate = atof(optarg);
+			break;
+		case 'R':
+			cfg.max_rate = atof(optarg);
+			break;
+		case 's':
+			cfg.step = atof(optarg);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || !have_method)
+		usage();
+	if (cfg.threads < 1 || cfg.conns < 1 || cfg.rate <= 0 || cfg.duration == 0)
+		usage();
+	if (cfg.max_rate < cfg.rate)
+		cfg.max_rate = cfg.rate;
+	if (cfg.step <= 0)
+		cfg.step = cfg.rate;
+
+	if (path) {
+		cfg.sock.sun_family = AF_LOCAL;
+		if (strlen(path) >= sizeof(cfg.sock.sun_path))
+			errx(1, "socket path is too long");
+		strcpy(cfg.sock.sun_path, path);
+	} else {
+		set_socket_path(domain, argv[0]);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = calloc(cfg.threads, sizeof(*workers));
+	if (!workers)
+		err(1, "calloc");
+	for (i = 0; i < cfg.threads; i++) {
+		workers[i].id = i;
+		workers[i].conns = calloc(cfg.conns, sizeof(struct connection));
+		if (!workers[i].conns)
+			err(1, "calloc");
+		for (j = 0; j < cfg.conns; j++)
+			workers[i].conns[j].fd = -1;
+	}
+
+	printf("#%9s %10s %10s %8s %8s %10s %10s %10s %10s %10s\n",
+			"rate", "achieved", "completed", "errors", "unsent",
+			"p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	for (rate = cfg.rate; rate <= cfg.max_rate; rate += cfg.step) {
+		if (!run_step(workers, rate)) {
+			printf("# saturated at %.0f requests/second\n", rate);
+			break;
+		}
+	}
+
+	for (i = 0; i < cfg.threads; i++) {
+		for (j = 0; j < cfg.conns; j++)
+			connection_close(&workers[i].conns[j]);
+		free(workers[i].conns);
+	}
+	free(workers);
+
+	exit(EXIT_SUCCESS);
+}
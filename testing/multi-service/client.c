@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Call methods of two different services, both hosted by the same server.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_myservice.h>
+#include <ipc/com_example_adder.h>
+
+void call_echo()
+{
+	int rv;
+	int ret1 = -1;
+
+	rv = echo(&ret1, 123);
+	if (rv != 0)
+		errx(1, "FAIL: echo: %s", ipc_strerror(rv));
+	if (ret1 != 123)
+		errx(1, "FAIL: echo: unexpected return value");
+}
+
+void call_add()
+{
+	int rv;
+	int sum = -1;
+
+	rv = add(&sum, 2, 3);
+	if (rv != 0)
+		errx(1, "FAIL: add: %s", ipc_strerror(rv));
+	if (sum != 5)
+		errx(1, "FAIL: add: unexpected return value %d", sum);
+}
+
+int main(int argc, char *argv[])
+{
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.myservice", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.adder", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	call_echo();
+	call_add();
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
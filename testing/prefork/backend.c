@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A replica of the service that the workers of the preforked server call.
+ * It is bound to the address given on the command line, and runs until it
+ * is killed.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* The number of calls to lookup() */
+static int lookups;
+
+/* Answers after the given number of milliseconds */
+int
+lookup(int *ret1, int arg1)
+{
+	__atomic_add_fetch(&lookups, 1, __ATOMIC_SEQ_CST);
+	usleep(arg1 * 1000);
+	*ret1 = arg1;
+	return 0;
+}
+
+/* Runs on a pool thread, so that lookup() can be answered meanwhile */
+int
+hold(int *ret1, int arg1)
+{
+	usleep(arg1 * 1000);
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+count(int *ret1, int arg1)
+{
+	*ret1 = __atomic_load_n(&lookups, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	if (argc != 2)
+		errx(1, "usage: test-backend address");
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("backend", "/dev/stderr");
+	ipc_openlog("backend", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind_address(server, argv[1], "com.example.backend");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	for (;;) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+}
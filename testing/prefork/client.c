@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that calls are spread across the workers of a preforked server, and
+ * that workers which crash are replaced. Requests are written directly in
+ * the wire format, so that each connection stays with the worker that
+ * accepted it.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+#define NWORKERS 3
+#define NCRASHES (NWORKERS + 1)
+
+/* Long enough for the next connection to find the worker still busy */
+#define BUSY_MS 300
+#define CONNECT_GAP_USEC 50000
+
+/* Workers that crashed are restarted within about a second */
+#define SPREAD_TRIES 10
+
+static struct sockaddr_un sock;
+
+static int
+open_connection(void)
+{
+	int fd;
+
+	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "socket(2)");
+	if (connect(fd, (struct sockaddr *) &sock, SUN_LEN(&sock)) < 0)
+		err(1, "connect(2) to %s", sock.sun_path);
+	return fd;
+}
+
+static void
+send_call(int fd, uint32_t method, int value)
+{
+	struct ipc_message request;
+	struct iovec iov[2];
+
+	memset(&request, 0, sizeof(request));
+	request._ipc_method = method;
+	request._ipc_argc = 1;
+	request._ipc_argsz[0] = sizeof(int);
+	request._ipc_bufsz = sizeof(int);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request);
+	iov[1].iov_base = &value;
+	iov[1].iov_len = sizeof(value);
+	if (writev(fd, iov, 2) != sizeof(request) + sizeof(value))
+		err(1, "FAIL: writev(2)");
+}
+
+/* Reads the result of a call, or returns -1 if the connection was closed */
+static int
+recv_int(int fd, const char *method, int *result)
+{
+	struct ipc_message response;
+	struct iovec iov[2];
+	ssize_t len;
+
+	iov[0].iov_base = &response;
+	iov[0].iov_len = sizeof(response);
+	iov[1].iov_base = result;
+	iov[1].iov_len = sizeof(*result);
+	len = readv(fd, iov, 2);
+	if (len == 0 || (len < 0 && errno == ECONNRESET))
+		return -1;
+	if (len != sizeof(response) + sizeof(*result) || response._ipc_status != 0)
+		errx(1, "FAIL: bad response to %s", method);
+	return 0;
+}
+
+/* Returns the pid of the worker that answered, or -1 if the connection was closed */
+static int
+recv_pid(int fd)
+{
+	int pid;
+
+	if (recv_int(fd, "whoami", &pid) < 0)
+		return -1;
+	return pid;
+}
+
+/*
+ * Keep each worker busy in turn, so that every connection is accepted by
+ * a different one. Returns -1 if two connections went to the same worker,
+ * as happens while one is still starting.
+ */
+static int
+spread_calls(int *pids)
+{
+	int fds[NWORKERS];
+	int rv = 0;
+	int i, j;
+
+	for (i = 0; i < NWORKERS; i++) {
+		fds[i] = open_connection();
+		send_call(fds[i], 1, BUSY_MS);
+		usleep(CONNECT_GAP_USEC);
+	}
+	for (i = 0; i < NWORKERS; i++) {
+		pids[i] = recv_pid(fds[i]);
+		if (pids[i] < 0)
+			errx(1, "FAIL: connection %d was closed", i);
+		close(fds[i]);
+		for (j = 0; j < i; j++) {
+			if (pids[j] == pids[i])
+				rv = -1;
+		}
+	}
+	log_notice("calls went to workers %d, %d and %d", pids[0], pids[1], pids[2]);
+	return rv;
+}
+
+static void
+spread_calls_retry(int *pids)
+{
+	int i;
+
+	for (i = 0; i < SPREAD_TRIES; i++) {
+		if (spread_calls(pids) == 0)
+			return;
+		usleep(100000);
+	}
+	errx(1, "FAIL: calls did not reach %d different workers", NWORKERS);
+}
+
+int main(int argc, char *argv[])
+{
+	int before[NWORKERS], after[NWORKERS];
+	int crashed[NCRASHES];
+	const char *home;
+	int fd, i, j, rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.prefork", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	home = getenv("HOME");
+	if (!home)
+		errx(1, "HOME is not set");
+	sock.sun_family = AF_LOCAL;
+	snprintf(sock.sun_path, sizeof(sock.sun_path),
+			"%s/.ipc/services/com.example.prefork", home);
+
+	spread_calls_retry(before);
+
+	/* Crash more workers than there are; the later ones must be replacements */
+	for (i = 0; i < NCRASHES; i++) {
+		fd = open_connection();
+		send_call(fd, 1, 0);
+		crashed[i] = recv_pid(fd);
+		if (crashed[i] < 0)
+			errx(1, "FAIL: no worker answered before crash %d", i);
+		send_call(fd, 2, 0);
+		if (recv_pid(fd) != -1)
+			errx(1, "FAIL: worker %d did not crash", crashed[i]);
+		close(fd);
+		log_notice("worker %d crashed", crashed[i]);
+	}
+
+	spread_calls_retry(after);
+	for (i = 0; i < NWORKERS; i++) {
+		for (j = 0; j < NCRASHES; j++) {
+			if (after[i] == crashed[j])
+				errx(1, "FAIL: worker %d answered after it crashed", after[i]);
+		}
+	}
+
+	/* A hedged call from a worker waits for its answer, instead of hedging at once */
+	fd = open_connection();
+	send_call(fd, 3, 0);
+	if (recv_int(fd, "relay", &rv) < 0)
+		errx(1, "FAIL: no worker answered relay()");
+	close(fd);
+	if (rv != 0)
+		errx(1, "FAIL: a worker hedged a call that was answered in time");
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
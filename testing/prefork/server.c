@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A server that runs its methods in several worker processes, under a
+ * supervisor that restarts the workers that crash. The supervisor calls a
+ * backend before it forks, and the workers go on using the same session.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_backend.h>
+
+#define NWORKERS 3
+
+/* The backends in the directory; see test-harness.sh */
+#define PRIMARY_ADDRESS "abstract:com.example.backend.1"
+#define BACKUP_ADDRESS "abstract:com.example.backend.2"
+#define BACKEND_WAIT_TRIES 500
+
+/* Enough calls for lookup() to be hedged, and how long each of them takes */
+#define WARMUP_CALLS 20
+#define WARMUP_MS 30
+
+/* How long another thread of the worker reads from the session meanwhile */
+#define HOLD_MS 300
+
+typedef int (*method_t)(struct ipc_session *, int *, int);
+
+/* Holds up the worker for a while, and tells the caller which one it is */
+int
+whoami(int *ret1, int arg1)
+{
+	usleep(arg1 * 1000);
+	*ret1 = (int) getpid();
+	return 0;
+}
+
+int
+crash(int *ret1, int arg1)
+{
+	raise(SIGKILL);
+	return 0;
+}
+
+static void *
+hold_session(void *arg)
+{
+	int response;
+
+	if (hold(&response, HOLD_MS) != 0)
+		errx(1, "FAIL: hold()");
+	return NULL;
+}
+
+/* Returns the number of calls to lookup() that a backend got, or an error */
+static int
+backend_lookups(struct ipc_client *client, const char *address, int *lookups)
+{
+	struct ipc_session *session;
+	method_t stub;
+
+	session = ipc_client_connect_address(client, address, "com.example.backend");
+	if (!session)
+		return -IPC_ERROR_CONNECTION_FAILED;
+	stub = (method_t) ipc_session_stub(session, 3);
+	if (!stub)
+		return -IPC_ERROR_METHOD_NOT_FOUND;
+	return stub(session, lookups, 0);
+}
+
+/* The backends start along with the server, so they may not be listening yet */
+static void
+wait_for_backend(const char *address)
+{
+	struct ipc_client *client;
+	int lookups;
+	int i;
+
+	client = ipc_client();
+	if (!client)
+		errx(1, "ipc_client()");
+	for (i = 0; i < BACKEND_WAIT_TRIES; i++) {
+		if (backend_lookups(client, address, &lookups) == 0)
+			return;
+		usleep(10000);
+	}
+	errx(1, "FAIL: the backend at %s did not start", address);
+}
+
+/*
+ * Make a hedged call while another thread is reading from the session, so
+ * that it waits on the condition of the session until its deadline. It is
+ * answered long before then, and must not be sent to the backup. Tells the
+ * caller how many calls the backup got.
+ */
+int
+relay(int *ret1, int arg1)
+{
+	struct ipc_client *client;
+	pthread_t tid;
+	int before, after, response;
+
+	/* The sessions of a client that the supervisor made are not safe to use here */
+	client = ipc_client();
+	if (!client || backend_lookups(client, BACKUP_ADDRESS, &before) != 0)
+		errx(1, "FAIL: count() before lookup()");
+	if (pthread_create(&tid, NULL, hold_session, NULL) != 0)
+		errx(1, "pthread_create(3)");
+	usleep(HOLD_MS * 1000 / 10);
+	if (lookup(&response, 0) != 0 || response != 0)
+		errx(1, "FAIL: lookup() from a worker");
+	pthread_join(tid, NULL);
+	if (backend_lookups(client, BACKUP_ADDRESS, &after) != 0)
+		errx(1, "FAIL: count() after lookup()");
+	*ret1 = after - before;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int response;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind(server, IPC_DOMAIN_USER, "com.example.prefork");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+
+	/* Give the workers a history of latencies to hedge by */
+	wait_for_backend(PRIMARY_ADDRESS);
+	wait_for_backend(BACKUP_ADDRESS);
+	for (i = 0; i < WARMUP_CALLS; i++) {
+		if (lookup(&response, WARMUP_MS) != 0)
+			errx(1, "FAIL: lookup() from the supervisor");
+	}
+
+	rv = ipc_server_prefork(server, NWORKERS);
+	if (rv < 0)
+		errx(1, "ipc_server_prefork: %s", ipc_strerror(rv));
+	if (rv > 0) {
+		/* The supervisor, once the workers have stopped */
+		ipc_server_free(server);
+		log_notice("success; exiting normally");
+		exit(EXIT_SUCCESS);
+	}
+
+	for (;;) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+}
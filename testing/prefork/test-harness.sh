@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+make -C ../.. clean all || exit
+make clean all || exit
+
+rm -f ~/.ipc/services/com.example.prefork
+
+# The workers call the first backend, and hedge their calls to the second
+cat > directory <<EOD
+com.example.backend	abstract:com.example.backend.1	1
+com.example.backend	abstract:com.example.backend.2	0
+EOD
+
+./test-backend abstract:com.example.backend.1 &
+backend1_pid=$!
+./test-backend abstract:com.example.backend.2 &
+backend2_pid=$!
+
+IPC_DIRECTORY=./directory ./test-server &
+server_pid=$!
+echo "launched server on pid $server_pid"
+
+./test-client || { kill $server_pid $backend1_pid $backend2_pid; exit 1; }
+kill $backend1_pid $backend2_pid
+
+# The supervisor stops its workers, and removes the socket once they are gone
+kill $server_pid
+wait $server_pid || { echo "FAIL: the supervisor exited with status $?"; exit 1; }
+if [ -e ~/.ipc/services/com.example.prefork ] ; then
+	echo "FAIL: the socket was not removed"
+	exit 1
+fi
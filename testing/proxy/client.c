@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Call a service through a proxy: integers and strings come back as the
+ * server sent them, concurrent calls get their own responses, and calls
+ * fail once the server behind the proxy has gone away.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_front.h>
+
+#define NTHREADS 4
+#define NCALLS 100
+
+static void *
+caller(void *arg)
+{
+	int base = (intptr_t) arg * NCALLS;
+	int response;
+	int i;
+	int rv;
+
+	for (i = 0; i < NCALLS; i++) {
+		rv = echo(&response, base + i);
+		if (rv != 0 || response != base + i)
+			errx(1, "FAIL: concurrent echo: rv=%d response=%d expected=%d",
+					rv, response, base + i);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[NTHREADS];
+	char *greeting = NULL;
+	int response = -1;
+	intptr_t i;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.front", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	rv = echo(&response, 42);
+	if (rv != 0 || response != 42)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+
+	rv = greet(&greeting, "proxy");
+	if (rv != 0 || !greeting || strcmp(greeting, "hello, proxy") != 0)
+		errx(1, "FAIL: greet: rv=%d greeting=%s", rv, greeting ? greeting : "(null)");
+	free(greeting);
+
+	for (i = 0; i < NTHREADS; i++) {
+		if (pthread_create(&threads[i], NULL, caller, (void *) i) != 0)
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	rv = done(&response, 7);
+	if (rv != 0 || response != 7)
+		errx(1, "FAIL: done: rv=%d response=%d", rv, response);
+
+	/* The proxy answers with an error for the server that has gone away */
+	rv = echo(&response, 43);
+	if (rv >= 0)
+		errx(1, "FAIL: echo without a server: expected an error, got rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A proxy that serves com.example.front by forwarding every call to
+ * com.example.back. It has no skeleton of its own, and runs until it is
+ * killed.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	struct ipc_session *upstream;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("proxy", "/dev/stderr");
+	ipc_openlog("proxy", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.back", 5000);
+	if (rv < 0)
+		errx(1, "ipc_client_wait_for_service: %s", ipc_strerror(rv));
+	upstream = ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.back");
+	if (!upstream)
+		errx(1, "ipc_client_connect");
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind_proxy(server, IPC_DOMAIN_USER, "com.example.front", NULL, upstream);
+	if (rv < 0)
+		errx(1, "ipc_server_bind_proxy: %s", ipc_strerror(rv));
+
+	for (;;) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+	}
+}
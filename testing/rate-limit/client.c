@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Make calls faster than the server allows, and check that only a second's
+ * worth of them get through until the limit has had time to refill.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_ratelimit.h>
+
+/* Must match server.c */
+#define REQUESTS_PER_SEC 5
+
+#define CALLS 20
+
+int main(int argc, char *argv[])
+{
+	int response;
+	int accepted = 0;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.ratelimit", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	for (i = 0; i < CALLS; i++) {
+		response = -1;
+		rv = echo(&response, i);
+		if (rv == 0 && response == i)
+			accepted++;
+		else if (rv != -IPC_ERROR_RATE_LIMITED)
+			errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+	}
+	log_notice("%d of %d calls were accepted", accepted, CALLS);
+	if (accepted < REQUESTS_PER_SEC || accepted > REQUESTS_PER_SEC + 1)
+		errx(1, "FAIL: expected about %d calls to be accepted", REQUESTS_PER_SEC);
+
+	/* The limit refills over the next second */
+	sleep(1);
+	rv = done(&response, 0);
+	if (rv != 0 || response != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that calls to an idempotent method survive a restart of the server,
+ * while others fail, and that slow calls are hedged to the second replica.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_retry.h>
+
+/* Must match server.c */
+#define SLOW_EVERY 25
+#define SLOW_USEC 500000
+
+#define NLOOKUPS 200
+
+/* Calls made before there is enough history to hedge */
+#define WARMUP 30
+
+typedef int (*method_t)(struct ipc_session *, int *, int);
+
+static int
+call(struct ipc_session *session, uint32_t method_id, int request)
+{
+	method_t stub;
+	int response = -1;
+	int rv;
+
+	stub = (method_t) ipc_session_stub(session, method_id);
+	if (!stub)
+		errx(1, "ipc_session_stub()");
+	rv = stub(session, &response, request);
+	if (rv < 0)
+		return rv;
+	if (rv != 0 || response != request)
+		errx(1, "FAIL: method %u: rv=%d response=%d", method_id, rv, response);
+	return 0;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipc_session *session;
+	uint64_t start, elapsed, slowest = 0;
+	int response = -1;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+
+	/* Calls are only hedged if the second replica is up by then */
+	rv = ipc_client_wait_for_address("abstract:com.example.retry", "com.example.retry", 5000);
+	if (rv == 0)
+		rv = ipc_client_wait_for_address("tcp:127.0.0.1:47091", "com.example.retry", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: the replicas are not up: %s", ipc_strerror(rv));
+
+	/* Go straight to the first replica, so that the retries have to wait for it */
+	session = ipc_client_connect_address(ipc_client(), "abstract:com.example.retry",
+			"com.example.retry");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect_address()");
+	if (call(session, 1, 1) < 0)
+		errx(1, "FAIL: get() before the restart");
+	if (call(session, 3, 0) < 0)
+		errx(1, "FAIL: restart()");
+	usleep(20000);
+	rv = call(session, 2, 2);
+	if (rv == 0)
+		errx(1, "FAIL: once() reached the server while it was restarting");
+	log_notice("once() failed as expected: %s", ipc_strerror(rv));
+	rv = call(session, 1, 3);
+	if (rv < 0)
+		errx(1, "FAIL: get() after the restart: %s", ipc_strerror(rv));
+
+	/* The generated stubs find the replicas in the directory */
+	for (i = 0; i < NLOOKUPS; i++) {
+		start = now_ns();
+		rv = lookup(&response, i);
+		elapsed = now_ns() - start;
+		if (rv != 0 || response != i)
+			errx(1, "FAIL: lookup(%d): rv=%d response=%d", i, rv, response);
+		if (i >= WARMUP && elapsed > slowest)
+			slowest = elapsed;
+	}
+	session = ipc_client_connect_address(ipc_client(), "tcp:127.0.0.1:47091",
+			"com.example.retry");
+	if (!session || ipc_session_stub(session, 5) == NULL)
+		errx(1, "FAIL: ipc_client_connect_address()");
+	rv = ((method_t) ipc_session_stub(session, 5))(session, &response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: count(): %s", ipc_strerror(rv));
+	log_notice("slowest lookup took %.3f ms; the second replica got %d calls",
+			slowest / 1e6, response);
+	if (slowest >= SLOW_USEC * 1000ULL / 2)
+		errx(1, "FAIL: slow calls were not hedged");
+	if (response < (NLOOKUPS - WARMUP) / SLOW_EVERY)
+		errx(1, "FAIL: too few calls were hedged");
+
+	if (call(session, 6, 0) < 0)
+		errx(1, "FAIL: done() on the second replica");
+	session = ipc_client_connect_address(ipc_client(), "abstract:com.example.retry",
+			"com.example.retry");
+	if (!session || call(session, 6, 0) < 0)
+		errx(1, "FAIL: done() on the first replica");
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
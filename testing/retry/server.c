@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A replica of a service, bound to the address given on the command line.
+ * The first replica can be told to restart, and is slow to answer some
+ * calls to lookup().
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+
+/* Must match client.c */
+#define SLOW_EVERY 25
+#define SLOW_USEC 500000
+
+/* How long a restart takes */
+#define RESTART_USEC 100000
+
+static int identity;
+static int restarting;
+static int finished;
+static int calls;
+
+int
+get(int *ret1, int arg1)
+{
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+once(int *ret1, int arg1)
+{
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+restart(int *ret1, int arg1)
+{
+	restarting = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+lookup(int *ret1, int arg1)
+{
+	calls++;
+	if (identity == 1 && arg1 % SLOW_EVERY == SLOW_EVERY - 1)
+		usleep(SLOW_USEC);
+	*ret1 = arg1;
+	return 0;
+}
+
+int
+count(int *ret1, int arg1)
+{
+	*ret1 = calls;
+	return 0;
+}
+
+int
+done(int *ret1, int arg1)
+{
+	finished = 1;
+	*ret1 = arg1;
+	return 0;
+}
+
+static struct ipc_server *
+start_server(const char *address)
+{
+	struct ipc_server *server;
+	int rv;
+
+	server = ipc_server();
+	if (!server)
+		errx(1, "ipc_server()");
+
+	rv = ipc_server_bind_address(server, address, "com.example.retry");
+	if (rv < 0)
+		errx(1, "bind: %s", ipc_strerror(rv));
+	return server;
+}
+
+int main(int argc, char *argv[]) {
+	struct ipc_server *server;
+	int rv;
+
+	if (argc != 3)
+		errx(1, "usage: test-server address identity");
+	identity = atoi(argv[2]);
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+
+	log_open("server", "/dev/stderr");
+	ipc_openlog("server", "/dev/stderr");
+
+	server = start_server(argv[1]);
+	while (!finished) {
+		rv = ipc_server_dispatch(server);
+		if (rv < 0)
+			errx(1, "ipc_dispatch: %s", ipc_strerror(rv));
+		if (restarting) {
+			/* Drop every connection, and refuse new ones for a while */
+			ipc_server_free(server);
+			usleep(RESTART_USEC);
+			server = start_server(argv[1]);
+			restarting = 0;
+		}
+	}
+
+	ipc_server_free(server);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+make -C ../.. clean all || exit
+make clean all || exit
+
+# Clients connect to the first replica, and hedge calls to the second
+cat > directory <<EOD
+com.example.retry	abstract:com.example.retry	1
+com.example.retry	tcp:127.0.0.1:47091		0
+EOD
+
+./test-server abstract:com.example.retry 1 &
+server1_pid=$!
+./test-server tcp:127.0.0.1:47091 2 &
+server2_pid=$!
+
+IPC_DIRECTORY=./directory ./test-client || { kill $server1_pid $server2_pid; exit 1; }
+wait $server1_pid && wait $server2_pid
@@ -0,0 +1,63 @@
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+# Rules shared by the tests that build a test-server and a test-client
+# around one or more services. A test sets these, then includes this file:
+#
+#   SERVICE		the services to generate code for; each has a <service>.ipc
+#   SERVER_SRCS		sources linked into test-server besides server.c
+#   CLIENT_SRCS		sources linked into test-client besides client.c
+#   EXTRA_PROGRAMS	more programs to build; the test adds their rules
+#   CLEANFILES		more files for "make clean" to remove
+#
+# IPC_DEFINITION may be given on the command line to generate the code from
+# other definitions of the same services.
+
+test_LDFLAGS+=-Wl,-rpath,../../src -L../../src
+test_LDFLAGS+=-Wl,-rpath,./ipc -L./ipc
+test_CFLAGS+=-std=c99 -I../../include -I. -I./ipc -DDEBUG -g -O0
+test_LDADD+=../../src/log.c
+
+test_CFLAGS+=$(CFLAGS)
+test_LDFLAGS+=$(LDFLAGS)
+test_LDADD+=$(LDADD)
+
+IPCC= 	../../src/ipcc/ipcc.rb
+IPC_DEFINITION?=$(SERVICE:=.ipc)
+
+all: ipc test-server test-client $(EXTRA_PROGRAMS)
+
+ipc:
+	mkdir -p ipc
+	$(IPCC) --debug \
+		--cflags="-I../../include" \
+		--ldflags="-Wl,-rpath,../../src -L../../src" \
+		--c-out=./ipc $(IPC_DEFINITION)
+
+test-client:
+	$(CC) $(test_CFLAGS) $(test_LDFLAGS) -o test-client client.c $(CLIENT_SRCS) $(test_LDADD) -lipc_debug -lpthread
+
+test-server:
+	$(CC) $(test_CFLAGS) -rdynamic $(test_LDFLAGS) -o test-server server.c $(SERVER_SRCS) $(test_LDADD) -lipc_debug -lpthread
+
+check:
+	./test-harness.sh
+
+clean:
+	rm -f test-server test-client $(EXTRA_PROGRAMS) $(CLEANFILES)
+	rm -rf ./ipc
+
+.PHONY: clean
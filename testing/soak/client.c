@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Soak test: hold thousands of idle connections open against the server
+ * while a set of active connections keeps making calls. The server's
+ * resident memory is sampled before and after, and call latency is
+ * recorded throughout.
+ *
+ * Requests are written directly in the wire format, so that every active
+ * connection stays open for the whole test.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include "../loadgen/histogram.h"
+
+static struct sockaddr_un sock;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Resident set size of a process, in kilobytes */
+static long
+get_rss(pid_t pid)
+{
+	char path[64];
+	char line[256];
+	long rss = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+				break;
+		}
+		fclose(f);
+		return rss;
+	}
+
+	/* No procfs; ask ps(1) instead */
+	snprintf(line, sizeof(line), "ps -o rss= -p %d", (int) pid);
+	f = popen(line, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%ld", &rss) != 1)
+		rss = -1;
+	pclose(f);
+	return rss;
+}
+
+static void
+raise_descriptor_limit(int wanted)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		err(1, "getrlimit(2)");
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < wanted)
+		errx(1, "need %d descriptors, but the hard limit is %llu",
+				wanted, (unsigned long long) rl.rlim_max);
+	if (rl.rlim_cur < wanted) {
+		rl.rlim_cur = wanted;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			err(1, "setrlimit(2)");
+	}
+}
+
+static int
+open_connection(void)
+{
+	int fd;
+
+	fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "socket(2)");
+	if (connect(fd, (struct sockaddr *) &sock, SUN_LEN(&sock)) < 0)
+		err(1, "connect(2) to %s", sock.sun_path);
+	return fd;
+}
+
+static void
+make_echo(struct ipc_message *request)
+{
+	memset(request, 0, sizeof(*request));
+	request->_ipc_method = 1;
+	request->_ipc_argc = 1;
+	request->_ipc_argsz[0] = sizeof(int);
+	request->_ipc_bufsz = sizeof(int);
+}
+
+static int
+send_echo(int fd, int value)
+{
+	struct ipc_message request;
+	struct iovec iov[2];
+
+	make_echo(&request);
+	iov[0].iov_base = &request;
+	iov[0].iov_len = sizeof(request);
+	iov[1].iov_base = &value;
+	iov[1].iov_len = sizeof(value);
+
+	if (writev(fd, iov, 2) != sizeof(request) + sizeof(value))
+		return -1;
+	return 0;
+}
+
+/* Send several calls in a single write, so they reach the server together */
+#define PIPELINE_DEPTH 8
+
+static int
+send_echo_pipelined(int fd, int base)
+{
+	struct ipc_message request;
+	int values[PIPELINE_DEPTH];
+	struct iovec iov[2 * PIPELINE_DEPTH];
+	int i;
+
+	make_echo(&request);
+	for (i = 0; i < PIPELINE_DEPTH; i++) {
+		values[i] = base + i;
+		iov[2 * i].iov_base = &request;
+		iov[2 * i].iov_len = sizeof(request);
+		iov[2 * i + 1].iov_base = &values[i];
+		iov[2 * i + 1].iov_len = sizeof(int);
+	}
+
+	if (writev(fd, iov, 2 * PIPELINE_DEPTH) !=
+			PIPELINE_DEPTH * (sizeof(request) + sizeof(int)))
+		return -1;
+	return 0;
+}
+
+/* Send a call in two pieces, split in the middle of the header */
+static int
+send_echo_split(int fd, int value)
+{
+	struct ipc_message request;
+	char frame[sizeof(request) + sizeof(value)];
+	size_t half = sizeof(request) / 2;
+
+	make_echo(&request);
+	memcpy(frame, &request, sizeof(request));
+	memcpy(frame + sizeof(request), &value, sizeof(value));
+
+	if (write(fd, frame, half) != (ssize_t) half)
+		return -1;
+	usleep(1000);
+	if (write(fd, frame + half, sizeof(frame) - half) != (ssize_t) (sizeof(frame) - half))
+		return -1;
+	return 0;
+}
+
+static int
+recv_echo(int fd, int expected)
+{
+	struct ipc_message response;
+	int value;
+	struct iovec iov[2];
+
+	iov[0].iov_base = &response;
+	iov[0].iov_len = sizeof(response);
+	iov[1].iov_base = &value;
+	iov[1].iov_len = sizeof(value);
+	if (readv(fd, iov, 2) != sizeof(response) + sizeof(value))
+		return -1;
+	if (response._ipc_bufsz != sizeof(value) || value != expected)
+		return -1;
+	return 0;
+}
+
+/* Make one call on every active connection at once, recording latency */
+static int
+active_round(int *fds, int nfds, struct histogram *hist)
+{
+	uint64_t *sent;
+	int errors = 0;
+	int i;
+
+	sent = calloc(nfds, sizeof(*sent));
+	if (!sent)
+		err(1, "calloc");
+	for (i = 0; i < nfds; i++) {
+		sent[i] = now_ns();
+		if (send_echo(fds[i], i) < 0)
+			errors++;
+	}
+	for (i = 0; i < nfds; i++) {
+		if (recv_echo(fds[i], i) < 0) {
+			errors++;
+			continue;
+		}
+		histogram_record(hist, now_ns() - sent[i]);
+	}
+	free(sent);
+	return errors;
+}
+
+/*
+ * Make several calls on every active connection with a single write each,
+ * and then one call that arrives in two pieces.
+ */
+static int
+pipelined_round(int *fds, int nfds, struct histogram *hist)
+{
+	uint64_t start;
+	int errors = 0;
+	int i, j;
+
+	for (i = 0; i < nfds; i++) {
+		start = now_ns();
+		if (send_echo_pipelined(fds[i], i * PIPELINE_DEPTH) < 0) {
+			errors++;
+			continue;
+		}
+		for (j = 0; j < PIPELINE_DEPTH; j++) {
+			if (recv_echo(fds[i], i * PIPELINE_DEPTH + j) < 0)
+				errors++;
+		}
+		histogram_record(hist, now_ns() - start);
+	}
+	for (i = 0; i < nfds; i++) {
+		if (send_echo_split(fds[i], -i) < 0 || recv_echo(fds[i], -i) < 0)
+			errors++;
+	}
+	return errors;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: test-client [-n idle] [-a active] [-r rounds] "
+			"[-l max_p99_ms] [-m max_bytes_per_conn] server_pid\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct histogram hist;
+	int nidle = 10000;
+	int nactive = 100;
+	int rounds = 100;
+	double max_p99_ms = 100.0;
+	long max_bytes_per_conn = 16384;
+	int *idle, *active;
+	long rss_start, rss_loaded, rss_end;
+	double bytes_per_conn, p99_ms;
+	int errors = 0;
+	pid_t server_pid;
+	const char *home;
+	char address[sizeof(sock.sun_path) + 5];
+	int ch, i, r, rv;
+
+	while ((ch = getopt(argc, argv, "a:l:m:n:r:")) != -1) {
+		switch (ch) {
+		case 'a': nactive = atoi(optarg); break;
+		case 'l': max_p99_ms = atof(optarg); break;
+		case 'm': max_bytes_per_conn = atol(optarg); break;
+		case 'n': nidle = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	server_pid = (pid_t) atoi(argv[optind]);
+
+	log_open("client", "/dev/stderr");
+
+	home = getenv("HOME");
+	if (!home)
+		errx(1, "HOME is not set");
+	sock.sun_family = AF_LOCAL;
+	snprintf(sock.sun_path, sizeof(sock.sun_path),
+			"%s/.ipc/services/com.example.soak", home);
+
+	/* The connections are made by hand, so wait for the socket without keeping one */
+	snprintf(address, sizeof(address), "unix:%s", sock.sun_path);
+	rv = ipc_client_wait_for_address(address, "com.example.soak", 5000);
+	if (rv < 0)
+		errx(1, "ipc_client_wait_for_address(): %s", ipc_strerror(rv));
+
+	raise_descriptor_limit(nidle + nactive + 64);
+	idle = calloc(nidle, sizeof(int));
+	active = calloc(nactive, sizeof(int));
+	if (!idle || !active)
+		err(1, "calloc");
+	histogram_reset(&hist);
+
+	for (i = 0; i < nactive; i++)
+		active[i] = open_connection();
+	errors += active_round(active, nactive, &hist);
+	rss_start = get_rss(server_pid);
+
+	/* Interleave calls with connection setup, so the server is busy
+	 * accepting and serving at the same time. */
+	for (i = 0; i < nidle; i++) {
+		idle[i] = open_connection();
+		if (i % 1000 == 999) {
+			errors += active_round(active, nactive, &hist);
+			log_notice("%d idle connections open", i + 1);
+		}
+	}
+
+	for (r = 0; r < rounds; r++)
+		errors += active_round(active, nactive, &hist);
+	rss_loaded = get_rss(server_pid);
+
+	/* Tear down the idle connections; the server should notice and
+	 * release everything it was holding for them. */
+	for (i = 0; i < nidle; i++)
+		close(idle[i]);
+	for (r = 0; r < rounds; r++)
+		errors += active_round(active, nactive, &hist);
+	errors += pipelined_round(active, nactive, &hist);
+	rss_end = get_rss(server_pid);
+
+	for (i = 0; i < nactive; i++)
+		close(active[i]);
+
+	bytes_per_conn = (rss_loaded - rss_start) * 1024.0 / nidle;
+	p99_ms = histogram_percentile(&hist, 99.0) / 1e6;
+	log_notice("connections: %d idle, %d active", nidle, nactive);
+	log_notice("server RSS: start=%ld kB loaded=%ld kB end=%ld kB (%.0f bytes per idle connection)",
+			rss_start, rss_loaded, rss_end, bytes_per_conn);
+	log_notice("latency: calls=%llu p50=%.3f ms p99=%.3f ms max=%.3f ms",
+			(unsigned long long) hist.total,
+			histogram_percentile(&hist, 50.0) / 1e6, p99_ms, hist.max / 1e6);
+
+	if (errors > 0)
+		errx(1, "FAIL: %d calls failed", errors);
+	if (p99_ms > max_p99_ms)
+		errx(1, "FAIL: p99 latency of %.3f ms exceeds %.3f ms", p99_ms, max_p99_ms);
+	if (rss_start > 0 && bytes_per_conn > max_bytes_per_conn)
+		errx(1, "FAIL: %.0f bytes per idle connection exceeds %ld",
+				bytes_per_conn, max_bytes_per_conn);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Start a helper server with one end of a socketpair, and call it over the
+ * other end with the generated stubs.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_socketpair.h>
+
+/* The idle timeout of the server */
+#define IDLE_MS 200
+
+static pid_t server_pid;
+
+static void
+stop_server(void)
+{
+	if (server_pid > 0)
+		(void) kill(server_pid, SIGTERM);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ipc_session *session;
+	char arg[16];
+	int sv[2];
+	int response, status;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	if (socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0)
+		err(1, "socketpair(2)");
+	server_pid = fork();
+	if (server_pid < 0)
+		err(1, "fork(2)");
+	if (server_pid == 0) {
+		(void) close(sv[0]);
+		snprintf(arg, sizeof(arg), "%d", sv[1]);
+		execl("./test-server", "test-server", arg, (char *) NULL);
+		err(1, "execl(3)");
+	}
+	(void) close(sv[1]);
+	atexit(stop_server);
+
+	session = ipc_session_from_fd(NULL, IPC_DOMAIN_USER, "com.example.socketpair", sv[0]);
+	if (!session)
+		errx(1, "FAIL: ipc_session_from_fd()");
+	if (ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.socketpair") != session)
+		errx(1, "FAIL: the stubs do not use the session");
+	if (ipc_session_from_fd(NULL, IPC_DOMAIN_USER, "com.example.socketpair", sv[0]))
+		errx(1, "FAIL: a second session to the service was made");
+
+	rv = echo(&response, 42);
+	if (rv != 0 || response != 42)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+
+	/* Idle for longer than the server would allow a named connection */
+	usleep(3 * IDLE_MS * 1000);
+	rv = echo(&response, 43);
+	if (rv != 0 || response != 43)
+		errx(1, "FAIL: echo after an idle period: rv=%d response=%d", rv, response);
+	if (ipc_session_fd(session) != sv[0])
+		errx(1, "FAIL: the session is not using the socketpair");
+
+	rv = done(&response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+	if (waitpid(server_pid, &status, 0) < 0)
+		err(1, "waitpid(2)");
+	server_pid = 0;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "FAIL: the server exited with status %d", status);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
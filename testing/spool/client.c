@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Make one-way calls through a spool. Run as "test-client down" while the
+ * server is down, it fills the spool, and prints how many calls it made.
+ * Run as "test-client up <count>" once the server is up, it makes more calls
+ * directly and through the spool, and checks that the server got every one,
+ * including those left in the spool by the first run.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_spool.h>
+
+#define SPOOL_PATH "./spool.dat"
+#define SPOOL_SIZE (sizeof(struct ipc_message) + IPC_MESSAGE_SIZE_MAX)
+#define NDIRECT 10
+#define NSPOOLED 500
+
+static struct ipc_session *
+connect_session(void)
+{
+	struct ipc_session *session;
+
+	/* Sessions of services with one-way methods are created while the server is down */
+	session = ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.spool");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect");
+	return session;
+}
+
+static void
+spool_down(void)
+{
+	struct ipc_session *session = connect_session();
+	int count;
+	int rv;
+
+	rv = ipc_session_spool(session, SPOOL_PATH, SPOOL_SIZE - 1);
+	if (rv != -IPC_ERROR_ARGUMENT_INVALID)
+		errx(1, "FAIL: a spool too small for a request: rv=%d", rv);
+	rv = ipc_session_spool(session, SPOOL_PATH, SPOOL_SIZE);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_session_spool: %s", ipc_strerror(rv));
+
+	/* Nothing can be sent, so the calls pile up until the spool is full */
+	for (count = 0; ; count++) {
+		rv = record(count + 1);
+		if (rv == -IPC_ERROR_SPOOL_FULL)
+			break;
+		if (rv != 0)
+			errx(1, "FAIL: record: %s", ipc_strerror(rv));
+	}
+	if (count < 100)
+		errx(1, "FAIL: only %d calls fit in the spool", count);
+
+	rv = ipc_session_flush(session, 100);
+	if (rv != -IPC_ERROR_TIMED_OUT)
+		errx(1, "FAIL: flush without a server: expected IPC_ERROR_TIMED_OUT, got rv=%d", rv);
+
+	printf("%d\n", count);
+}
+
+static void
+spool_up(int leftover)
+{
+	struct ipc_session *session;
+	int sum, count, expected_sum, expected_count;
+	int i;
+	int rv;
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.spool", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+	session = connect_session();
+
+	/* Without a spool, calls are written straight to the server */
+	for (i = 0; i < NDIRECT; i++) {
+		rv = record(1);
+		if (rv != 0)
+			errx(1, "FAIL: record without a spool: %s", ipc_strerror(rv));
+	}
+
+	/* The spool keeps the size it was created with, and the calls left in it */
+	rv = ipc_session_spool(session, SPOOL_PATH, 1024 * 1024);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_session_spool: %s", ipc_strerror(rv));
+	for (i = 0; i < NSPOOLED; i++) {
+		rv = record(i + 1);
+		if (rv == -IPC_ERROR_SPOOL_FULL) {
+			rv = ipc_session_flush(session, 5000);
+			if (rv < 0)
+				errx(1, "FAIL: ipc_session_flush: %s", ipc_strerror(rv));
+			i--;
+			continue;
+		}
+		if (rv != 0)
+			errx(1, "FAIL: record: %s", ipc_strerror(rv));
+	}
+	rv = ipc_session_flush(session, 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_session_flush: %s", ipc_strerror(rv));
+
+	rv = total(&sum, &count);
+	if (rv != 0)
+		errx(1, "FAIL: total: rv=%d", rv);
+	expected_count = leftover + NDIRECT + NSPOOLED;
+	expected_sum = leftover * (leftover + 1) / 2 + NDIRECT + NSPOOLED * (NSPOOLED + 1) / 2;
+	if (count != expected_count || sum != expected_sum)
+		errx(1, "FAIL: total: got %d calls adding up to %d, expected %d adding up to %d",
+				count, sum, expected_count, expected_sum);
+
+	rv = done(&count, 1);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+}
+
+int main(int argc, char *argv[])
+{
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	if (argc == 2 && strcmp(argv[1], "down") == 0)
+		spool_down();
+	else if (argc == 3 && strcmp(argv[1], "up") == 0)
+		spool_up(atoi(argv[2]));
+	else
+		errx(1, "usage: test-client down | up <count>");
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+# Usage: check-budget.sh <service> <transport> <side> <counts file>
+#
+# Compare the counts written by syscount.so against budget.conf.
+# Exits non-zero if any system call exceeds its budget.
+
+service=$1
+transport=$2
+side=$3
+counts=$4
+
+test -f "$counts" || { echo "FAIL: $counts was not written"; exit 1; }
+
+awk -v service="$service" -v transport="$transport" -v side="$side" '
+	FNR == NR {
+		if ($0 ~ /^#/ || NF < 5) next
+		if ($1 == service && $2 == transport && $3 == side)
+			budget[$4] = $5
+		next
+	}
+	{ actual[$1] = $2 }
+	END {
+		rv = 0
+		for (name in budget) {
+			n = (name in actual) ? actual[name] : 0
+			if (n > budget[name]) {
+				printf "FAIL: %s/%s/%s: %s called %d times; budget is %d\n", \
+					service, transport, side, name, n, budget[name]
+				rv = 1
+			}
+		}
+		for (name in actual) {
+			if (!(name in budget)) {
+				printf "FAIL: %s/%s/%s: unbudgeted call to %s (%d times)\n", \
+					service, transport, side, name, actual[name]
+				rv = 1
+			}
+		}
+		if (rv == 0)
+			printf "ok: %s/%s/%s: %d system calls\n", \
+				service, transport, side, actual["total"]
+		exit rv
+	}
+' budget.conf "$counts"
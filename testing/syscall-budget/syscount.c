@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An LD_PRELOAD interposer that counts the I/O related system calls made
+ * by a process. When the process exits, the counts are written to the file
+ * named by the SYSCOUNT_OUTPUT environment variable, one "name count" pair
+ * per line, followed by a "total" line.
+ *
+ * Only calls that go through the dynamic linker are seen, which is exactly
+ * the set made by libipc, the generated stubs and skeletons, and libkqueue.
+ * Calls made inside ipc_client_wait_for_service() are not counted, since
+ * how many it makes depends on how soon the server is up.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum {
+	SC_SOCKET,
+	SC_CONNECT,
+	SC_ACCEPT,
+	SC_ACCEPT4,
+	SC_READ,
+	SC_READV,
+	SC_RECV,
+	SC_RECVMSG,
+	SC_WRITE,
+	SC_WRITEV,
+	SC_SEND,
+	SC_SENDMSG,
+	SC_CLOSE,
+	SC_KEVENT,
+	SC_GETSOCKOPT,
+	SC_SETSOCKOPT,
+	SC_MAX
+};
+
+static const char *syscall_names[SC_MAX] = {
+	"socket", "connect", "accept", "accept4",
+	"read", "readv", "recv", "recvmsg",
+	"write", "writev", "send", "sendmsg",
+	"close", "kevent", "getsockopt", "setsockopt",
+};
+
+static unsigned long syscall_count[SC_MAX];
+
+/* Set while this thread is waiting for the server */
+static __thread int waiting;
+
+#define COUNT(idx) do { \
+	if (!waiting) __sync_fetch_and_add(&syscall_count[idx], 1); \
+} while (0)
+
+/* Look up the next definition of a symbol, once */
+#define REAL(ret, name, ...) \
+	static ret (*real_##name)(__VA_ARGS__); \
+	if (!real_##name) real_##name = (ret (*)(__VA_ARGS__)) dlsym(RTLD_NEXT, #name)
+
+int
+socket(int domain, int type, int protocol)
+{
+	REAL(int, socket, int, int, int);
+	COUNT(SC_SOCKET);
+	return real_socket(domain, type, protocol);
+}
+
+int
+connect(int s, const struct sockaddr *name, socklen_t namelen)
+{
+	REAL(int, connect, int, const struct sockaddr *, socklen_t);
+	COUNT(SC_CONNECT);
+	return real_connect(s, name, namelen);
+}
+
+int
+accept(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+	REAL(int, accept, int, struct sockaddr *, socklen_t *);
+	COUNT(SC_ACCEPT);
+	return real_accept(s, addr, addrlen);
+}
+
+int
+accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+	REAL(int, accept4, int, struct sockaddr *, socklen_t *, int);
+	COUNT(SC_ACCEPT4);
+	return real_accept4(s, addr, addrlen, flags);
+}
+
+ssize_t
+read(int fd, void *buf, size_t nbytes)
+{
+	REAL(ssize_t, read, int, void *, size_t);
+	COUNT(SC_READ);
+	return real_read(fd, buf, nbytes);
+}
+
+ssize_t
+readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	REAL(ssize_t, readv, int, const struct iovec *, int);
+	COUNT(SC_READV);
+	return real_readv(fd, iov, iovcnt);
+}
+
+ssize_t
+recv(int s, void *buf, size_t len, int flags)
+{
+	REAL(ssize_t, recv, int, void *, size_t, int);
+	COUNT(SC_RECV);
+	return real_recv(s, buf, len, flags);
+}
+
+ssize_t
+recvmsg(int s, struct msghdr *msg, int flags)
+{
+	REAL(ssize_t, recvmsg, int, struct msghdr *, int);
+	COUNT(SC_RECVMSG);
+	return real_recvmsg(s, msg, flags);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t nbytes)
+{
+	REAL(ssize_t, write, int, const void *, size_t);
+	COUNT(SC_WRITE);
+	return real_write(fd, buf, nbytes);
+}
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	REAL(ssize_t, writev, int, const struct iovec *, int);
+	COUNT(SC_WRITEV);
+	return real_writev(fd, iov, iovcnt);
+}
+
+ssize_t
+send(int s, const void *buf, size_t len, int flags)
+{
+	REAL(ssize_t, send, int, const void *, size_t, int);
+	COUNT(SC_SEND);
+	return real_send(s, buf, len, flags);
+}
+
+ssize_t
+sendmsg(int s, const struct msghdr *msg, int flags)
+{
+	REAL(ssize_t, sendmsg, int, const struct msghdr *, int);
+	COUNT(SC_SENDMSG);
+	return real_sendmsg(s, msg, flags);
+}
+
+int
+close(int fd)
+{
+	REAL(int, close, int);
+	COUNT(SC_CLOSE);
+	return real_close(fd);
+}
+
+/* The prototype is not taken from <sys/event.h> to avoid depending on libkqueue */
+int
+kevent(int kq, const void *changelist, int nchanges, void *eventlist,
+		int nevents, const void *timeout)
+{
+	REAL(int, kevent, int, const void *, int, void *, int, const void *);
+	COUNT(SC_KEVENT);
+	return real_kevent(kq, changelist, nchanges, eventlist, nevents, timeout);
+}
+
+int
+getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen)
+{
+	REAL(int, getsockopt, int, int, int, void *, socklen_t *);
+	COUNT(SC_GETSOCKOPT);
+	return real_getsockopt(s, level, optname, optval, optlen);
+}
+
+int
+setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen)
+{
+	REAL(int, setsockopt, int, int, int, const void *, socklen_t);
+	COUNT(SC_SETSOCKOPT);
+	return real_setsockopt(s, level, optname, optval, optlen);
+}
+
+int
+ipc_client_wait_for_service(int domain, const char *service, int timeout_ms)
+{
+	REAL(int, ipc_client_wait_for_service, int, const char *, int);
+	int rv;
+
+	waiting = 1;
+	rv = real_ipc_client_wait_for_service(domain, service, timeout_ms);
+	waiting = 0;
+	return rv;
+}
+
+static void __attribute__((destructor))
+syscount_report(void)
+{
+	const char *path;
+	unsigned long total = 0;
+	FILE *f;
+	int i;
+
+	path = getenv("SYSCOUNT_OUTPUT");
+	if (!path)
+		return;
+
+	/* stdio uses the internal libc entry points, so this is not counted */
+	f = fopen(path, "w");
+	if (!f)
+		return;
+	for (i = 0; i < SC_MAX; i++) {
+		if (syscall_count[i] > 0)
+			fprintf(f, "%s %lu\n", syscall_names[i], syscall_count[i]);
+		total += syscall_count[i];
+	}
+	fprintf(f, "total %lu\n", total);
+	fclose(f);
+}
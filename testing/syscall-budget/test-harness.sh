@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Copyright (c) 2016 Mark Heily <mark@heily.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+# 
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+#
+
+# Run each ipcc test service under syscount.so and compare the number of
+# system calls made on each side against budget.conf.
+
+make -C ../.. clean all || exit
+make clean all || exit
+
+topdir=`pwd`
+outdir="$topdir/output"
+rv=0
+
+mkdir -p $outdir
+
+run_service() {
+	service=$1
+	transport=$2
+	definition=com.example.myservice.ipc
+
+	# Over TCP, the same service is given a loopback address in its definition
+	case $transport in
+	tcp:*)
+		definition=$outdir/$service-tcp.ipc
+		sed "/^domain:/a\\
+address: $transport" ../$service/com.example.myservice.ipc > $definition
+		transport=tcp
+		;;
+	esac
+
+	(cd ../$service && make clean && make all IPC_DEFINITION=$definition) || exit
+
+	rm -f ~/.ipc/services/com.example.myservice
+	rm -f $outdir/$service.$transport.*
+
+	cd ../$service
+	SYSCOUNT_OUTPUT=$outdir/$service.$transport.server \
+		LD_PRELOAD=$topdir/syscount.so ./test-server &
+	server_pid=$!
+
+	SYSCOUNT_OUTPUT=$outdir/$service.$transport.client \
+		LD_PRELOAD=$topdir/syscount.so ./test-client || rv=1
+	wait $server_pid || rv=1
+	cd $topdir
+
+	./check-budget.sh $service $transport client \
+		$outdir/$service.$transport.client || rv=1
+	./check-budget.sh $service $transport server \
+		$outdir/$service.$transport.server || rv=1
+}
+
+run_service ipcc-1 local
+run_service ipcc-2 local
+run_service ipcc-1 tcp:127.0.0.1:47091
+run_service ipcc-2 tcp:127.0.0.1:47092
+
+exit $rv
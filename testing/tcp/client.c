@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Make calls from several threads at once over TCP, and check that they
+ * all share a single connection, with Nagle's algorithm turned off.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_tcp.h>
+
+#define NTHREADS 4
+#define NCALLS 50
+
+static void *
+call_echo(void *arg)
+{
+	int base = (int) (intptr_t) arg * NCALLS;
+	int response;
+	int rv, i;
+
+	for (i = 0; i < NCALLS; i++) {
+		response = -1;
+		rv = echo(&response, base + i);
+		if (rv != 0 || response != base + i)
+			errx(1, "FAIL: echo(%d): rv=%d response=%d", base + i, rv, response);
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[NTHREADS];
+	struct ipc_session *session;
+	struct ipc_client *client;
+	int response = -1;
+	int fd, nodelay;
+	socklen_t len;
+	int rv, i;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.tcp", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	rv = echo(&response, 1);
+	if (rv != 0 || response != 1)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+	session = ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.tcp");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect()");
+	fd = ipc_session_fd(session);
+
+	nodelay = 0;
+	len = sizeof(nodelay);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len) < 0)
+		err(1, "FAIL: getsockopt(2)");
+	if (!nodelay)
+		errx(1, "FAIL: TCP_NODELAY is not set");
+
+	for (i = 0; i < NTHREADS; i++) {
+		if (pthread_create(&tid[i], NULL, call_echo, (void *) (intptr_t) i) != 0)
+			errx(1, "pthread_create()");
+	}
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(tid[i], NULL);
+
+	if (ipc_client_connect(NULL, IPC_DOMAIN_USER, "com.example.tcp") != session ||
+			ipc_session_fd(session) != fd)
+		errx(1, "FAIL: the connection was not reused");
+
+	/* A client of its own, with the address given explicitly */
+	client = ipc_client();
+	if (!client)
+		errx(1, "ipc_client()");
+	session = ipc_client_connect_address(client, "tcp:127.0.0.1:47089", "com.example.tcp");
+	if (!session)
+		errx(1, "FAIL: ipc_client_connect_address()");
+	if (ipc_session_fd(session) == fd)
+		errx(1, "FAIL: the clients share a connection");
+
+	rv = done(&response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}
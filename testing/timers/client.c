@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2016 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the timeouts of the server: a quiet connection is sent keepalives
+ * and then closed, a stub reconnects by itself after its connection has
+ * been closed, and a call that runs past its deadline fails.
+ */
+
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../include/ipc.h"
+#include "../../src/log.h"
+#include <ipc/com_example_timers.h>
+
+#define PORT 47092
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Connect without sending anything, and wait for the server to give up */
+static void
+check_idle_connection(void)
+{
+	struct sockaddr_in sin;
+	struct ipc_message msg;
+	uint64_t start, elapsed;
+	ssize_t bytes;
+	int keepalives = 0;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		err(1, "socket(2)");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(PORT);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		err(1, "connect(2)");
+
+	start = now_ms();
+	while ((bytes = recv(fd, &msg, sizeof(msg), MSG_WAITALL)) == sizeof(msg)) {
+		if (msg._ipc_id != 0 || msg._ipc_bufsz != 0)
+			errx(1, "FAIL: unexpected message for call %u", msg._ipc_id);
+		keepalives++;
+	}
+	elapsed = now_ms() - start;
+	if (bytes != 0)
+		errx(1, "FAIL: expected the server to close the connection");
+	if (keepalives < 2)
+		errx(1, "FAIL: only %d keepalives were sent", keepalives);
+	if (elapsed < 300 || elapsed > 2000)
+		errx(1, "FAIL: the idle connection was closed after %llu ms",
+				(unsigned long long) elapsed);
+	log_notice("idle connection closed after %llu ms and %d keepalives",
+			(unsigned long long) elapsed, keepalives);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t start, elapsed;
+	int response = -1;
+	int rv;
+
+	setenv("IPC_LIBDIR", "./ipc", 1);
+	log_open("client", "/dev/stderr");
+	ipc_openlog("client", "/dev/stderr");
+
+	rv = ipc_client_wait_for_service(IPC_DOMAIN_USER, "com.example.timers", 5000);
+	if (rv < 0)
+		errx(1, "FAIL: ipc_client_wait_for_service: %s", ipc_strerror(rv));
+
+	check_idle_connection();
+
+	rv = echo(&response, 1);
+	if (rv != 0 || response != 1)
+		errx(1, "FAIL: echo: rv=%d response=%d", rv, response);
+
+	/* Long enough for the server to close the stub's connection */
+	usleep(800000);
+	rv = echo(&response, 2);
+	if (rv != 0 || response != 2)
+		errx(1, "FAIL: echo after the connection was closed: rv=%d response=%d",
+				rv, response);
+
+	start = now_ms();
+	rv = slow(&response, 3);
+	elapsed = now_ms() - start;
+	if (rv != -IPC_ERROR_TIMED_OUT)
+		errx(1, "FAIL: slow: expected IPC_ERROR_TIMED_OUT, got rv=%d", rv);
+	if (elapsed > 900)
+		errx(1, "FAIL: slow took %llu ms to time out", (unsigned long long) elapsed);
+
+	rv = echo(&response, 4);
+	if (rv != 0 || response != 4)
+		errx(1, "FAIL: echo after a deadline: rv=%d response=%d", rv, response);
+
+	rv = done(&response, 0);
+	if (rv != 0)
+		errx(1, "FAIL: done: rv=%d", rv);
+
+	log_notice("success; exiting normally");
+	exit(EXIT_SUCCESS);
+}